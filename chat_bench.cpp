@@ -0,0 +1,1049 @@
+/* ###################################### */
+/* #    TSAM - Project 2: Chatserver    # */
+/* #                                    # */
+/* #    Þórir Ármann Valdimarsson       # */
+/* #    Smári Freyr Guðmundsson         # */
+/* #    Snorri Arinbjarnar              # */
+/* #                                    # */
+/* ###################################### */
+
+// Benchmarks for the chatserver. Run as: chatbench <benchmark> [options]
+
+// Standard includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+// System includes
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Data structure includes
+#include <vector>
+#include <string>
+#include <string.h>
+#include <algorithm>
+#include <random>
+
+// Time includes
+#include <chrono>
+#include <time.h>
+
+// Output includes
+#include <iostream>
+
+// Protocol
+#include "chat_protocol.h"
+
+using namespace std;
+
+/* ### Constants ### */
+
+// How many times the command mix is parsed by each parser.
+#define DEFAULTPARSEROUNDS 200000
+
+// Defaults of the load benchmark.
+#define DEFAULTCONNECTIONS 100
+#define DEFAULTDURATION 10
+#define DEFAULTRATE 200
+#define DEFAULTMESSAGESIZE 64
+
+// Defaults of the connect benchmark. It gives up if no connection makes progress for CONNECTSTALLSECONDS.
+#define DEFAULTCONNECTCONNECTIONS 10000
+#define DEFAULTCONNECTCONCURRENCY 1000
+#define CONNECTSTALLSECONDS 30
+
+// How long the load benchmark waits for messages still in flight after it stops sending, in milliseconds.
+#define DRAINMILLISECONDS 1000
+
+// Every chat message the load benchmark sends carries this marker followed by the time it was sent, in
+// nanoseconds of the monotonic clock, so receivers can measure the fan-out latency.
+#define TIMESTAMPMARKER "bench@"
+
+// The size the server used to pad short replies and the ID reply to, before replies were framed. No knock
+// reply is longer than MINBUFFERSIZE.
+#define MINBUFFERSIZE 16
+#define XLARGEBUFFERSIZE 2048
+#define READBUFFERSIZE 65536
+
+// How many users the wire benchmark assumes are logged in and receiving.
+#define DEFAULTWIREUSERS 100
+
+#define PORTAMOUNT 3
+#define MAXEPOLLEVENTS 256
+
+/* ### Structs ### */
+
+// The operations the load benchmark sends. The mix gives the weight of each.
+enum loadOperation
+{
+    OPERATION_MSG_ALL,
+    OPERATION_MSG_PRIVATE,
+    OPERATION_WHO,
+    OPERATION_ID,
+    OPERATIONCOUNT
+};
+
+// The options of the load benchmark.
+struct loadConfiguration
+{
+    int ports[PORTAMOUNT];
+    int connections;
+    int duration;
+    int rate;
+    int messageSize;
+    int mix[OPERATIONCOUNT];
+    pid_t serverPid;
+    bool binary;
+};
+
+// An authenticated connection of the load benchmark. inbound holds a partially received server message and
+// outbound the frames the server has not accepted yet. userId is the user's id if he uses the binary protocol.
+struct benchConnection
+{
+    int socketFd;
+    string userName;
+    uint64_t userId;
+    string inbound;
+    string outbound;
+    bool watchingWritable;
+};
+
+// What the load benchmark measured. rateLimitedReplies counts the commands the server refused with RATE LIMITED.
+struct loadResults
+{
+    long operationsSent[OPERATIONCOUNT];
+    long messagesDelivered;
+    long repliesReceived;
+    long rateLimitedReplies;
+    long bytesReceived;
+    vector<int64_t> latencies;
+};
+
+// The options of the connect benchmark.
+struct connectConfiguration
+{
+    int ports[PORTAMOUNT];
+    int connections;
+    int concurrency;
+    pid_t serverPid;
+};
+
+// A connection of the connect benchmark. knock is the knock being made, and reply holds the part of the
+// server's reply received so far. loggingIn is set once CONNECT has been sent. started is when the
+// first knock was made.
+struct connectingClient
+{
+    int socketFd;
+    int index;
+    int knock;
+    bool loggingIn;
+    int64_t started;
+    size_t replyBytes;
+    char reply[MAXREPLYHEADERSIZE + MINBUFFERSIZE];
+};
+
+// A reply the wire benchmark compares the encodings of. legacySize is the size the old encoding padded it to,
+// or 0 if it was sent with a terminating null character. receivers is how many users it is sent to, and isMessage
+// whether it is a message from another user rather than a reply to the command.
+struct wireReply
+{
+    const char *command;
+    string text;
+    size_t legacySize;
+    int receivers;
+    bool isMessage;
+};
+
+/* ### Forward declarations ### */
+
+// Compares the cost of parsing a mix of typical commands with the original splitString parser, with
+// parseCommand and with the binary protocol's header. <rounds> is how many times the mix is parsed.
+void benchmarkParse(long rounds);
+
+// The original command splitter of checkAPI, kept as the baseline: ABCDEFGH... A, B, CDEFGH...
+void splitString(vector<string> &inputCommands, string input);
+
+// The original verb matching of checkAPI on top of splitString. Returns the verb matched.
+enum commandVerb legacyParse(const string &input);
+
+// The original encoding of a server reply, kept as the baseline: <text> padded with null characters to
+// <legacySize> bytes, or followed by a single null character if <legacySize> is 0.
+string legacyReply(const string &text, size_t legacySize);
+
+// Compares the bytes the server sends in answer to typical commands with length prefixed replies and with the
+// old null terminated and fixed size replies, assuming <users> receiving users.
+void benchmarkWire(int users);
+
+// Opens authenticated connections to a local chatserver and drives a mix of commands over them for a while.
+// Reports the throughput, the fan-out latency percentiles and, given the server's pid, its CPU use per message.
+void benchmarkLoad(const struct loadConfiguration *configuration);
+
+// Reads the options of the load benchmark, starting at args[first]. Exits with the usage message on bad options.
+void parseLoadArguments(int argv, char *args[], int first, struct loadConfiguration *configuration);
+
+// Opens many connections to a local chatserver at once, each knocking and logging in, and keeps them open.
+// Reports how long it took, the percentiles of the time each connection took and, given the server's pid, the
+// server's CPU use per connection.
+void benchmarkConnect(const struct connectConfiguration *configuration);
+
+// Reads the options of the connect benchmark, starting at args[first]. Exits with the usage message on bad options.
+void parseConnectArguments(int argv, char *args[], int first, struct connectConfiguration *configuration);
+
+// Starts the client's next knock with a non-blocking connect and watches the socket for the server's answer.
+// Returns false if the knock could not be started.
+bool startKnock(struct connectingClient *client, const int *sequence, int epollFileDescriptor);
+
+// Handles the server's answer on the client's socket. Returns 1 once the client has logged in, -1 if it failed
+// and 0 while it is still on its way.
+int advanceClient(struct connectingClient *client, const int *sequence, int epollFileDescriptor);
+
+// Knocks <sequence> from the source address <sourceAddress> and returns the connected socket, or -1 if the knock
+// failed. Each knock waits for the server to close it, so the server has seen it before the next one is made.
+int knockFrom(uint32_t sourceAddress, const int *sequence);
+
+// Finds the knocking sequence among the permutations of <ports> and writes it to <sequence>. Returns false if
+// none of them is accepted.
+bool discoverKnockSequence(const int *ports, int *sequence);
+
+// Returns the loopback address the <index>th connection knocks from, in host byte order. Knock state is kept per
+// address, so every connection gets its own.
+uint32_t sourceAddressFor(int index);
+
+// Sends one command of the mix over a random connection.
+void sendOperation(vector<struct benchConnection> &connections, const struct loadConfiguration *configuration, mt19937 *randomGenerator, struct loadResults *results, int epollFileDescriptor);
+
+// Appends <payload> as a frame to the connection's outbound data and sends what the socket accepts.
+void queueFrame(struct benchConnection *connection, const string &payload, int epollFileDescriptor);
+
+// Appends a binary frame to the connection's outbound data and sends what the socket accepts.
+void queueBinaryFrame(struct benchConnection *connection, enum binaryOpcode opcode, uint64_t userId, const string &payload, int epollFileDescriptor);
+
+// Sends as much of the connection's outbound data as the socket accepts, watching for writability while some is left.
+void flushConnection(struct benchConnection *connection, int epollFileDescriptor);
+
+// Reads what the server sent on a connection and accounts for every complete message. The server's keepalive PING is
+// answered with PONG, so connections which mostly receive are not disconnected as idle.
+void readConnection(struct benchConnection *connection, const struct loadConfiguration *configuration, struct loadResults *results, int epollFileDescriptor);
+
+// Sends <payload> as a frame and waits for the reply. Returns false if the reply is not SUCCESS.
+bool sendCommandExpectingSuccess(int socketFd, const string &payload);
+
+// Logs in as <userName> with the binary protocol and stores the user id the server answers with in <userId>.
+// Returns false if the login failed.
+bool connectBinary(int socketFd, const string &userName, uint64_t *userId);
+
+// Returns the length of the reply whose first <replyBytes> bytes are in <reply>, as far as it is known: one
+// byte more than has been received until the header is complete. Payloads are cut off at MINBUFFERSIZE bytes.
+size_t replyLength(const char *reply, size_t replyBytes);
+
+// Returns the monotonic clock in nanoseconds.
+int64_t monotonicNanoseconds();
+
+// Returns the CPU time <pid> has used, in seconds, or -1 if it cannot be read.
+double processCpuSeconds(pid_t pid);
+
+// Returns the <percentile> of the sorted <values>.
+int64_t percentileOf(const vector<int64_t> &values, double percentile);
+
+// Prints how to run chatbench and exits.
+void printUsage();
+
+/* ### Main ### */
+
+int main(int argv, char *args[]) {
+    if (argv < 2) { printUsage(); }
+    string benchmark = args[1];
+
+    if (benchmark == "parse") {
+        long rounds = argv > 2 ? atol(args[2]) : DEFAULTPARSEROUNDS;
+        if (rounds <= 0) { printUsage(); }
+        benchmarkParse(rounds);
+    }
+    else if (benchmark == "wire") {
+        int users = argv > 2 ? atoi(args[2]) : DEFAULTWIREUSERS;
+        if (users < 2) { printUsage(); }
+        benchmarkWire(users);
+    }
+    else if (benchmark == "load") {
+        struct loadConfiguration configuration;
+        parseLoadArguments(argv, args, 2, &configuration);
+        benchmarkLoad(&configuration);
+    }
+    else if (benchmark == "connect") {
+        struct connectConfiguration configuration;
+        parseConnectArguments(argv, args, 2, &configuration);
+        benchmarkConnect(&configuration);
+    }
+    else { printUsage(); }
+
+    return 0;
+}
+
+/* ### Benchmarks ### */
+
+// Compares the cost of parsing a mix of typical commands with the original splitString parser, with
+// parseCommand and with the binary protocol's header. <rounds> is how many times the mix is parsed.
+void benchmarkParse(long rounds) {
+    // The commands are stored back to back like frames in a read buffer.
+    const char *commandMix[] = {
+        "MSG ALL hello everyone, how is it going?",
+        "MSG alice are you there? I have a question about the assignment",
+        "MSG ALL short",
+        "WHO",
+        "ID",
+        "RECV",
+        "CONNECT somebody",
+        "CHANGE ID ABC",
+        "STATS",
+        "LEAVE"
+    };
+    int commandCount = sizeof commandMix / sizeof commandMix[0];
+    string buffer;
+    vector<string_view> commands;
+    vector<string> commandStrings;
+    for (int i = 0; i < commandCount; i++) { buffer.append(commandMix[i]); }
+    size_t offset = 0;
+    for (int i = 0; i < commandCount; i++) {
+        commands.push_back(string_view(buffer.data() + offset, strlen(commandMix[i])));
+        commandStrings.push_back(commandMix[i]);
+        offset += strlen(commandMix[i]);
+    }
+
+    // The same mix as binary frames. Commands without an opcode of their own are sent as text.
+    string binaryBuffer;
+    appendBinaryFrame(binaryBuffer, BINARY_MSG_ALL, 0, "hello everyone, how is it going?");
+    appendBinaryFrame(binaryBuffer, BINARY_MSG_USER, 1, "are you there? I have a question about the assignment");
+    appendBinaryFrame(binaryBuffer, BINARY_MSG_ALL, 0, "short");
+    appendBinaryFrame(binaryBuffer, BINARY_WHO, 0, "");
+    appendBinaryFrame(binaryBuffer, BINARY_ID, 0, "");
+    appendBinaryFrame(binaryBuffer, BINARY_RECV, 0, "");
+    appendBinaryFrame(binaryBuffer, BINARY_TEXT, 0, "CONNECT somebody");
+    appendBinaryFrame(binaryBuffer, BINARY_TEXT, 0, "CHANGE ID ABC");
+    appendBinaryFrame(binaryBuffer, BINARY_TEXT, 0, "STATS");
+    appendBinaryFrame(binaryBuffer, BINARY_LEAVE, 0, "");
+    static const enum commandVerb binaryVerbs[BINARYOPCODECOUNT] = {VERB_UNKNOWN, VERB_MSG, VERB_MSG, VERB_MSG, VERB_WHO, VERB_ID, VERB_RECV, VERB_LEAVE, VERB_LOOKUP};
+
+    // The checksums keep the compiler from discarding the parsing.
+    long legacyChecksum = 0;
+    chrono::steady_clock::time_point legacyStart = chrono::steady_clock::now();
+    for (long round = 0; round < rounds; round++) {
+        for (int i = 0; i < commandCount; i++) { legacyChecksum += legacyParse(commandStrings[i]); }
+    }
+    chrono::steady_clock::time_point legacyEnd = chrono::steady_clock::now();
+
+    long parsedChecksum = 0;
+    struct parsedCommand command;
+    for (long round = 0; round < rounds; round++) {
+        for (int i = 0; i < commandCount; i++) {
+            parseCommand(commands[i], &command);
+            parsedChecksum += command.verb + command.argument.length() + command.text.length();
+        }
+    }
+    chrono::steady_clock::time_point parsedEnd = chrono::steady_clock::now();
+
+    // Like the server, the header is decoded and the opcode looked up in a table. Only text commands are parsed.
+    long binaryChecksum = 0;
+    struct binaryHeader header;
+    for (long round = 0; round < rounds; round++) {
+        for (size_t frame = 0; frame < binaryBuffer.length(); frame += BINARYHEADERSIZE + header.payloadLength) {
+            decodeBinaryHeader(binaryBuffer.data() + frame, &header);
+            string_view payload(binaryBuffer.data() + frame + BINARYHEADERSIZE, header.payloadLength);
+            if (header.opcode == BINARY_TEXT) {
+                parseCommand(payload, &command);
+                binaryChecksum += command.verb + command.argument.length() + command.text.length();
+            }
+            else { binaryChecksum += binaryVerbs[header.opcode] + header.userId + payload.length(); }
+        }
+    }
+    chrono::steady_clock::time_point binaryEnd = chrono::steady_clock::now();
+
+    double parsedCount = (double)rounds * commandCount;
+    double legacyNanoseconds = chrono::duration<double, nano>(legacyEnd - legacyStart).count() / parsedCount;
+    double parsedNanoseconds = chrono::duration<double, nano>(parsedEnd - legacyEnd).count() / parsedCount;
+    double binaryNanoseconds = chrono::duration<double, nano>(binaryEnd - parsedEnd).count() / parsedCount;
+    printf("commands parsed: %.0f per parser (checksums %ld %ld %ld)\n", parsedCount, legacyChecksum, parsedChecksum, binaryChecksum);
+    printf("splitString:  %8.1f ns/command\n", legacyNanoseconds);
+    printf("parseCommand: %8.1f ns/command\n", parsedNanoseconds);
+    printf("binary:       %8.1f ns/command\n", binaryNanoseconds);
+}
+
+// Compares the bytes the server sends in answer to typical commands with length prefixed replies and with the
+// old null terminated and fixed size replies, assuming <users> receiving users. Messages to everyone are counted once
+// for every receiver.
+void benchmarkWire(int users) {
+    // Usernames are named like those of the load benchmark, and the Id is made like the server makes it, from a
+    // short fortune, a timestamp and the group's initials.
+    string userList;
+    string stats;
+    for (int i = 0; i < users; i++) {
+        string userName = "bench12345_" + to_string(i);
+        if (i > 0) { userList.push_back(' '); }
+        userList.append(userName);
+        stats.append(userName).append(" queued=0 bytes=0 peak=1 dropped=0\n");
+    }
+    string message = "bench12345_0: " + string(DEFAULTMESSAGESIZE, 'x');
+    struct wireReply replies[] = {
+        {"knock", "KNOCK SUCCESS", MINBUFFERSIZE, 1, false},
+        {"CONNECT", "SUCCESS", MINBUFFERSIZE, 1, false},
+        {"JOIN", "FAIL", MINBUFFERSIZE, 1, false},
+        {"ID", "You will be honored for contributing your time and skill to a worthy cause.\nSat Oct 17 12:00:00 2026\nTHSS", XLARGEBUFFERSIZE, 1, false},
+        {"WHO", userList, 0, 1, false},
+        {"STATS", stats, 0, 1, false},
+        {"MSG ALL", message, 0, users - 1, true},
+        {"MSG", "<PRIVATE> " + message, 0, 1, true}
+    };
+    int replyCount = sizeof replies / sizeof replies[0];
+
+    // The load benchmark's default mix, by index into replies.
+    int mixReplies[OPERATIONCOUNT] = {6, 7, 4, 3};
+    int mixWeights[OPERATIONCOUNT] = {70, 20, 5, 5};
+    size_t legacyBytes[sizeof replies / sizeof replies[0]];
+    size_t replyBytes[sizeof replies / sizeof replies[0]];
+
+    printf("%d receiving users\n", users);
+    printf("%-10s %10s %12s %12s %8s\n", "command", "receivers", "old bytes", "new bytes", "saved");
+    for (int i = 0; i < replyCount; i++) {
+        string reply;
+        appendReplyHeader(reply, replies[i].text.length(), replies[i].isMessage);
+        reply.append(replies[i].text);
+        legacyBytes[i] = legacyReply(replies[i].text, replies[i].legacySize).length() * replies[i].receivers;
+        replyBytes[i] = reply.length() * replies[i].receivers;
+        printf("%-10s %10d %12zu %12zu %7.1f%%\n", replies[i].command, replies[i].receivers, legacyBytes[i], replyBytes[i],
+               100.0 * ((double)legacyBytes[i] - replyBytes[i]) / legacyBytes[i]);
+    }
+
+    double legacyMixBytes = 0, replyMixBytes = 0;
+    for (int i = 0; i < OPERATIONCOUNT; i++) {
+        legacyMixBytes += mixWeights[i] / 100.0 * legacyBytes[mixReplies[i]];
+        replyMixBytes += mixWeights[i] / 100.0 * replyBytes[mixReplies[i]];
+    }
+    printf("load mix 70,20,5,5: %.1f bytes/command before, %.1f after\n", legacyMixBytes, replyMixBytes);
+}
+
+// Opens authenticated connections to a local chatserver and drives a mix of commands over them for a while.
+// Reports the throughput, the fan-out latency percentiles and, given the server's pid, its CPU use per message.
+void benchmarkLoad(const struct loadConfiguration *configuration) {
+    // Every connection needs a descriptor.
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    int sequence[PORTAMOUNT];
+    if (!discoverKnockSequence(configuration->ports, sequence)) {
+        fprintf(stderr, "None of the knocking sequences was accepted.\n");
+        exit(1);
+    }
+
+    // Knock, log in and enter receive mode on every connection. The first address was used to find the sequence.
+    vector<struct benchConnection> connections;
+    int64_t setupStart = monotonicNanoseconds();
+    for (int i = 0; i < configuration->connections; i++) {
+        int socketFd = knockFrom(sourceAddressFor(i + 1), sequence);
+        if (socketFd < 0) {
+            fprintf(stderr, "Connection %d could not knock, continuing with %d connections.\n", i, i);
+            break;
+        }
+
+        struct benchConnection connection;
+        connection.socketFd = socketFd;
+        connection.userName = "bench" + to_string(getpid()) + "_" + to_string(i);
+        connection.userId = 0;
+        connection.watchingWritable = false;
+        bool loggedIn;
+        if (configuration->binary) {
+            string receive;
+            appendBinaryFrame(receive, BINARY_RECV, 0, "");
+            loggedIn = connectBinary(socketFd, connection.userName, &connection.userId) && sendAll(socketFd, receive.data(), receive.length());
+        }
+        else { loggedIn = sendCommandExpectingSuccess(socketFd, "CONNECT " + connection.userName) && sendFrame(socketFd, "RECV"); }
+        if (!loggedIn) {
+            fprintf(stderr, "Connection %d could not log in, continuing with %d connections.\n", i, i);
+            close(socketFd);
+            break;
+        }
+        connections.push_back(connection);
+    }
+    double setupSeconds = (monotonicNanoseconds() - setupStart) / 1e9;
+    if (connections.size() < 2) {
+        fprintf(stderr, "At least two connections are needed.\n");
+        exit(1);
+    }
+    printf("connections: %zu, set up in %.2f s\n", connections.size(), setupSeconds);
+
+    int epollFileDescriptor = epoll_create1(0);
+    for (size_t i = 0; i < connections.size(); i++) {
+        fcntl(connections[i].socketFd, F_SETFL, fcntl(connections[i].socketFd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, connections[i].socketFd, &event);
+    }
+
+    struct loadResults results;
+    memset(results.operationsSent, 0, sizeof results.operationsSent);
+    results.messagesDelivered = 0;
+    results.repliesReceived = 0;
+    results.rateLimitedReplies = 0;
+    results.bytesReceived = 0;
+    mt19937 randomGenerator(random_device{}());
+
+    // Operations are sent at a steady rate. Whatever is due is sent whenever the loop comes around.
+    double cpuStart = processCpuSeconds(configuration->serverPid);
+    int64_t loadStart = monotonicNanoseconds();
+    int64_t loadEnd = loadStart + (int64_t)configuration->duration * 1000000000;
+    int64_t drainEnd = loadEnd + (int64_t)DRAINMILLISECONDS * 1000000;
+    long operationsDue = 0;
+    long operationsSent = 0;
+    struct epoll_event readyEvents[MAXEPOLLEVENTS];
+    while (true) {
+        int64_t timeNow = monotonicNanoseconds();
+        if (timeNow >= drainEnd) { break; }
+        if (timeNow < loadEnd) {
+            operationsDue = (long)((timeNow - loadStart) / 1e9 * configuration->rate);
+            for (; operationsSent < operationsDue; operationsSent++) {
+                sendOperation(connections, configuration, &randomGenerator, &results, epollFileDescriptor);
+            }
+        }
+
+        int readyCount = epoll_wait(epollFileDescriptor, readyEvents, MAXEPOLLEVENTS, 1);
+        for (int i = 0; i < readyCount; i++) {
+            struct benchConnection *connection = &connections[readyEvents[i].data.u64];
+            if (readyEvents[i].events & EPOLLOUT) { flushConnection(connection, epollFileDescriptor); }
+            if (readyEvents[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) { readConnection(connection, configuration, &results, epollFileDescriptor); }
+        }
+    }
+    double cpuEnd = processCpuSeconds(configuration->serverPid);
+
+    for (size_t i = 0; i < connections.size(); i++) { close(connections[i].socketFd); }
+    close(epollFileDescriptor);
+
+    // Report.
+    double loadSeconds = configuration->duration;
+    sort(results.latencies.begin(), results.latencies.end());
+    printf("sent: %ld MSG ALL, %ld MSG, %ld WHO, %ld ID in %d s\n", results.operationsSent[OPERATION_MSG_ALL],
+           results.operationsSent[OPERATION_MSG_PRIVATE], results.operationsSent[OPERATION_WHO],
+           results.operationsSent[OPERATION_ID], configuration->duration);
+    // Commands the server refused cost it next to nothing, so the rates and costs per command only count the
+    // commands it carried out.
+    long operationsAccepted = operationsSent - results.rateLimitedReplies;
+    printf("commands/sec: %.0f\n", operationsAccepted / loadSeconds);
+    if (results.rateLimitedReplies > 0) {
+        printf("refused by the server's rate limits: %ld commands, not counted in the figures per command.\n", results.rateLimitedReplies);
+        printf("Run the server with --rate-limit broadcast=0,1 --rate-limit private=0,1 --rate-limit who=0,1 to measure all of them.\n");
+    }
+    printf("messages delivered: %ld (%.0f/sec), other replies: %ld\n", results.messagesDelivered,
+           results.messagesDelivered / loadSeconds, results.repliesReceived);
+    printf("bytes received: %ld (%.1f/command)\n", results.bytesReceived, operationsAccepted ? (double)results.bytesReceived / operationsAccepted : 0.0);
+    if (!results.latencies.empty()) {
+        printf("fan-out latency: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+               percentileOf(results.latencies, 0.50) / 1e3, percentileOf(results.latencies, 0.99) / 1e3,
+               percentileOf(results.latencies, 0.999) / 1e3, results.latencies.back() / 1e3);
+    }
+    if (cpuStart >= 0 && cpuEnd >= 0) {
+        double cpuSeconds = cpuEnd - cpuStart;
+        printf("server cpu: %.2f s, %.2f us/command", cpuSeconds, operationsAccepted ? cpuSeconds * 1e6 / operationsAccepted : 0.0);
+        printf(", %.2f us/delivered message\n", results.messagesDelivered ? cpuSeconds * 1e6 / results.messagesDelivered : 0.0);
+    }
+    else { printf("server cpu: unknown, pass --server-pid\n"); }
+}
+
+// Reads the options of the load benchmark, starting at args[first]. Exits with the usage message on bad options.
+void parseLoadArguments(int argv, char *args[], int first, struct loadConfiguration *configuration) {
+    if (argv < first + PORTAMOUNT) { printUsage(); }
+    for (int i = 0; i < PORTAMOUNT; i++) { configuration->ports[i] = atoi(args[first + i]); }
+    configuration->connections = DEFAULTCONNECTIONS;
+    configuration->duration = DEFAULTDURATION;
+    configuration->rate = DEFAULTRATE;
+    configuration->messageSize = DEFAULTMESSAGESIZE;
+    configuration->mix[OPERATION_MSG_ALL] = 70;
+    configuration->mix[OPERATION_MSG_PRIVATE] = 20;
+    configuration->mix[OPERATION_WHO] = 5;
+    configuration->mix[OPERATION_ID] = 5;
+    configuration->serverPid = 0;
+    configuration->binary = false;
+
+    for (int i = first + PORTAMOUNT; i < argv; i++) {
+        string option = args[i];
+        if (option == "--binary") {
+            configuration->binary = true;
+            continue;
+        }
+        if (i + 1 >= argv) { printUsage(); }
+        if (option == "--connections") { configuration->connections = atoi(args[++i]); }
+        else if (option == "--duration") { configuration->duration = atoi(args[++i]); }
+        else if (option == "--rate") { configuration->rate = atoi(args[++i]); }
+        else if (option == "--message-size") { configuration->messageSize = atoi(args[++i]); }
+        else if (option == "--server-pid") { configuration->serverPid = atoi(args[++i]); }
+        else if (option == "--mix") {
+            if (sscanf(args[++i], "%d,%d,%d,%d", &configuration->mix[OPERATION_MSG_ALL], &configuration->mix[OPERATION_MSG_PRIVATE],
+                       &configuration->mix[OPERATION_WHO], &configuration->mix[OPERATION_ID]) != OPERATIONCOUNT) { printUsage(); }
+        }
+        else { printUsage(); }
+    }
+
+    int mixTotal = 0;
+    for (int i = 0; i < OPERATIONCOUNT; i++) {
+        if (configuration->mix[i] < 0) { printUsage(); }
+        mixTotal += configuration->mix[i];
+    }
+    if (configuration->connections < 2 || configuration->duration <= 0 || configuration->rate <= 0 || mixTotal == 0) { printUsage(); }
+}
+
+// Opens many connections to a local chatserver at once, each knocking and logging in, and keeps them open.
+// Reports how long it took, the percentiles of the time each connection took and, given the server's pid, the
+// server's CPU use per connection.
+void benchmarkConnect(const struct connectConfiguration *configuration) {
+    // Every connection needs a descriptor.
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    int sequence[PORTAMOUNT];
+    if (!discoverKnockSequence(configuration->ports, sequence)) {
+        fprintf(stderr, "None of the knocking sequences was accepted.\n");
+        exit(1);
+    }
+
+    vector<struct connectingClient> clients(configuration->connections);
+    for (size_t i = 0; i < clients.size(); i++) { clients[i].socketFd = -1; }
+    vector<int64_t> setupTimes;
+    int epollFileDescriptor = epoll_create1(0);
+    int started = 0;
+    int finished = 0;
+    int failed = 0;
+
+    double cpuStart = processCpuSeconds(configuration->serverPid);
+    int64_t benchmarkStart = monotonicNanoseconds();
+    int64_t lastProgress = benchmarkStart;
+    struct epoll_event readyEvents[MAXEPOLLEVENTS];
+    while (finished < configuration->connections) {
+        // Keep up to the given number of connections on their way in.
+        while (started < configuration->connections && started - finished < configuration->concurrency) {
+            struct connectingClient *client = &clients[started];
+            client->index = started++;
+            client->started = monotonicNanoseconds();
+            client->knock = 0;
+            if (!startKnock(client, sequence, epollFileDescriptor)) {
+                failed++;
+                finished++;
+            }
+        }
+
+        int readyCount = epoll_wait(epollFileDescriptor, readyEvents, MAXEPOLLEVENTS, 100);
+        int64_t timeNow = monotonicNanoseconds();
+        if (readyCount > 0) { lastProgress = timeNow; }
+        else if (timeNow - lastProgress > (int64_t)CONNECTSTALLSECONDS * 1000000000) {
+            fprintf(stderr, "No progress for %d s, giving up on %d connections.\n", CONNECTSTALLSECONDS, started - finished);
+            failed += started - finished;
+            break;
+        }
+
+        for (int i = 0; i < readyCount; i++) {
+            struct connectingClient *client = &clients[readyEvents[i].data.u64];
+            int result = advanceClient(client, sequence, epollFileDescriptor);
+            if (result == 0) { continue; }
+            finished++;
+            if (result > 0) { setupTimes.push_back(monotonicNanoseconds() - client->started); }
+            else { failed++; }
+        }
+    }
+    double elapsedSeconds = (monotonicNanoseconds() - benchmarkStart) / 1e9;
+    double cpuEnd = processCpuSeconds(configuration->serverPid);
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i].socketFd >= 0) { close(clients[i].socketFd); }
+    }
+    close(epollFileDescriptor);
+
+    // Report.
+    sort(setupTimes.begin(), setupTimes.end());
+    long slowConnections = setupTimes.end() - upper_bound(setupTimes.begin(), setupTimes.end(), (int64_t)1000000000);
+    printf("connections: %zu logged in, %d failed, in %.2f s (%.0f/sec)\n", setupTimes.size(), failed, elapsedSeconds,
+           setupTimes.size() / elapsedSeconds);
+    if (!setupTimes.empty()) {
+        printf("setup time: p50 %.1f ms, p99 %.1f ms, p999 %.1f ms, max %.1f ms\n",
+               percentileOf(setupTimes, 0.50) / 1e6, percentileOf(setupTimes, 0.99) / 1e6,
+               percentileOf(setupTimes, 0.999) / 1e6, setupTimes.back() / 1e6);
+        printf("connections slower than 1 s (a retransmitted SYN): %ld\n", slowConnections);
+    }
+    if (cpuStart >= 0 && cpuEnd >= 0) {
+        double cpuSeconds = cpuEnd - cpuStart;
+        printf("server cpu: %.2f s, %.2f us/connection\n", cpuSeconds, setupTimes.empty() ? 0.0 : cpuSeconds * 1e6 / setupTimes.size());
+    }
+    else { printf("server cpu: unknown, pass --server-pid\n"); }
+}
+
+// Reads the options of the connect benchmark, starting at args[first]. Exits with the usage message on bad options.
+void parseConnectArguments(int argv, char *args[], int first, struct connectConfiguration *configuration) {
+    if (argv < first + PORTAMOUNT) { printUsage(); }
+    for (int i = 0; i < PORTAMOUNT; i++) { configuration->ports[i] = atoi(args[first + i]); }
+    configuration->connections = DEFAULTCONNECTCONNECTIONS;
+    configuration->concurrency = DEFAULTCONNECTCONCURRENCY;
+    configuration->serverPid = 0;
+
+    for (int i = first + PORTAMOUNT; i < argv; i++) {
+        string option = args[i];
+        if (i + 1 >= argv) { printUsage(); }
+        if (option == "--connections") { configuration->connections = atoi(args[++i]); }
+        else if (option == "--concurrency") { configuration->concurrency = atoi(args[++i]); }
+        else if (option == "--server-pid") { configuration->serverPid = atoi(args[++i]); }
+        else { printUsage(); }
+    }
+    if (configuration->connections < 1 || configuration->concurrency < 1) { printUsage(); }
+}
+
+// Starts the client's next knock with a non-blocking connect and watches the socket for the server's answer.
+// Returns false if the knock could not be started.
+bool startKnock(struct connectingClient *client, const int *sequence, int epollFileDescriptor) {
+    struct sockaddr_in localAddress;
+    memset(&localAddress, 0, sizeof localAddress);
+    localAddress.sin_family = AF_INET;
+    localAddress.sin_addr.s_addr = htonl(sourceAddressFor(client->index + 1));
+    struct sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof serverAddress);
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serverAddress.sin_port = htons(sequence[client->knock]);
+
+    client->socketFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    client->replyBytes = 0;
+    client->loggingIn = false;
+    if (client->socketFd < 0) { return false; }
+    if (bind(client->socketFd, (struct sockaddr *)&localAddress, sizeof localAddress) < 0 ||
+        (connect(client->socketFd, (struct sockaddr *)&serverAddress, sizeof serverAddress) < 0 && errno != EINPROGRESS)) {
+        close(client->socketFd);
+        client->socketFd = -1;
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.u64 = client->index;
+    epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, client->socketFd, &event);
+    return true;
+}
+
+// Handles the server's answer on the client's socket. Returns 1 once the client has logged in, -1 if it failed
+// and 0 while it is still on its way.
+int advanceClient(struct connectingClient *client, const int *sequence, int epollFileDescriptor) {
+    size_t expectedBytes = replyLength(client->reply, client->replyBytes);
+    ssize_t bytesReceived = recv(client->socketFd, client->reply + client->replyBytes, expectedBytes - client->replyBytes, 0);
+    if (bytesReceived < 0 && (errno == EAGAIN || errno == EINTR)) { return 0; }
+
+    // The server closes every knock but the last one. The next knock is made once it has.
+    if (client->knock < PORTAMOUNT - 1) {
+        close(client->socketFd);
+        client->knock++;
+        return startKnock(client, sequence, epollFileDescriptor) ? 0 : -1;
+    }
+
+    if (bytesReceived <= 0) {
+        close(client->socketFd);
+        client->socketFd = -1;
+        return -1;
+    }
+    client->replyBytes += bytesReceived;
+    if (client->replyBytes < replyLength(client->reply, client->replyBytes)) { return 0; }
+
+    // The last knock is answered with KNOCK SUCCESS, and CONNECT with SUCCESS.
+    string_view reply = replyPayload(string_view(client->reply, client->replyBytes));
+    client->replyBytes = 0;
+    if (!client->loggingIn && reply == "KNOCK SUCCESS" &&
+        sendFrame(client->socketFd, "CONNECT bench" + to_string(getpid()) + "_" + to_string(client->index))) {
+        client->loggingIn = true;
+        return 0;
+    }
+    if (client->loggingIn && reply == "SUCCESS") {
+        epoll_ctl(epollFileDescriptor, EPOLL_CTL_DEL, client->socketFd, NULL);
+        return 1;
+    }
+    close(client->socketFd);
+    client->socketFd = -1;
+    return -1;
+}
+
+// Knocks <sequence> from the source address <sourceAddress> and returns the connected socket, or -1 if the knock
+// failed. Each knock waits for the server to close it, so the server has seen it before the next one is made.
+int knockFrom(uint32_t sourceAddress, const int *sequence) {
+    struct sockaddr_in localAddress;
+    memset(&localAddress, 0, sizeof localAddress);
+    localAddress.sin_family = AF_INET;
+    localAddress.sin_addr.s_addr = htonl(sourceAddress);
+    struct sockaddr_in serverAddress;
+    memset(&serverAddress, 0, sizeof serverAddress);
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; i < PORTAMOUNT; i++) {
+        int socketFd = socket(AF_INET, SOCK_STREAM, 0);
+        serverAddress.sin_port = htons(sequence[i]);
+        if (socketFd < 0) { return -1; }
+        if (bind(socketFd, (struct sockaddr *)&localAddress, sizeof localAddress) < 0 ||
+            connect(socketFd, (struct sockaddr *)&serverAddress, sizeof serverAddress) < 0) {
+            close(socketFd);
+            return -1;
+        }
+
+        // The server answers the last knock with KNOCK SUCCESS or KNOCK FAIL, and closes the others.
+        string reply;
+        if (receiveReply(socketFd, reply) && i == PORTAMOUNT - 1 && reply == "KNOCK SUCCESS") { return socketFd; }
+        close(socketFd);
+    }
+    return -1;
+}
+
+// Finds the knocking sequence among the permutations of <ports> and writes it to <sequence>. Returns false if
+// none of them is accepted.
+bool discoverKnockSequence(const int *ports, int *sequence) {
+    int permutation[PORTAMOUNT] = { ports[0], ports[1], ports[2] };
+    sort(permutation, permutation + PORTAMOUNT);
+    do {
+        int socketFd = knockFrom(sourceAddressFor(0), permutation);
+        if (socketFd >= 0) {
+            close(socketFd);
+            memcpy(sequence, permutation, sizeof permutation);
+            return true;
+        }
+    } while (next_permutation(permutation, permutation + PORTAMOUNT));
+    return false;
+}
+
+// Returns the loopback address the <index>th connection knocks from, in host byte order. Knock state is kept per
+// address, so every connection gets its own.
+uint32_t sourceAddressFor(int index) {
+    // The addresses start at 127.1.0.1 and skip the .0 and .255 host numbers.
+    uint32_t block = index / 254;
+    return (127u << 24) | ((1 + block / 256) << 16) | ((block % 256) << 8) | (index % 254 + 1);
+}
+
+// Sends one command of the mix over a random connection.
+void sendOperation(vector<struct benchConnection> &connections, const struct loadConfiguration *configuration, mt19937 *randomGenerator, struct loadResults *results, int epollFileDescriptor) {
+    int mixTotal = 0;
+    for (int i = 0; i < OPERATIONCOUNT; i++) { mixTotal += configuration->mix[i]; }
+    int pick = uniform_int_distribution<int>(0, mixTotal - 1)(*randomGenerator);
+    int operation = 0;
+    while (pick >= configuration->mix[operation]) { pick -= configuration->mix[operation++]; }
+
+    uniform_int_distribution<size_t> connectionDistribution(0, connections.size() - 1);
+    size_t senderIndex = connectionDistribution(*randomGenerator);
+    struct benchConnection *sender = &connections[senderIndex];
+
+    // The timestamp goes first so it survives any padding.
+    string text = TIMESTAMPMARKER + to_string(monotonicNanoseconds()) + " ";
+    if ((int)text.length() < configuration->messageSize) { text.append(configuration->messageSize - text.length(), 'x'); }
+
+    size_t receiverIndex = connectionDistribution(*randomGenerator);
+    if (receiverIndex == senderIndex) { receiverIndex = (receiverIndex + 1) % connections.size(); }
+    if (configuration->binary) {
+        switch (operation) {
+            case OPERATION_MSG_ALL: queueBinaryFrame(sender, BINARY_MSG_ALL, 0, text, epollFileDescriptor); break;
+            case OPERATION_MSG_PRIVATE: queueBinaryFrame(sender, BINARY_MSG_USER, connections[receiverIndex].userId, text, epollFileDescriptor); break;
+            case OPERATION_WHO: queueBinaryFrame(sender, BINARY_WHO, 0, "", epollFileDescriptor); break;
+            case OPERATION_ID: queueBinaryFrame(sender, BINARY_ID, 0, "", epollFileDescriptor); break;
+        }
+    }
+    else {
+        switch (operation) {
+            case OPERATION_MSG_ALL: queueFrame(sender, "MSG ALL " + text, epollFileDescriptor); break;
+            case OPERATION_MSG_PRIVATE: queueFrame(sender, "MSG " + connections[receiverIndex].userName + " " + text, epollFileDescriptor); break;
+            case OPERATION_WHO: queueFrame(sender, "WHO", epollFileDescriptor); break;
+            case OPERATION_ID: queueFrame(sender, "ID", epollFileDescriptor); break;
+        }
+    }
+    results->operationsSent[operation]++;
+}
+
+// Appends <payload> as a frame to the connection's outbound data and sends what the socket accepts.
+void queueFrame(struct benchConnection *connection, const string &payload, int epollFileDescriptor) {
+    appendFrame(connection->outbound, payload);
+    flushConnection(connection, epollFileDescriptor);
+}
+
+// Appends a binary frame to the connection's outbound data and sends what the socket accepts.
+void queueBinaryFrame(struct benchConnection *connection, enum binaryOpcode opcode, uint64_t userId, const string &payload, int epollFileDescriptor) {
+    appendBinaryFrame(connection->outbound, opcode, userId, payload);
+    flushConnection(connection, epollFileDescriptor);
+}
+
+// Sends as much of the connection's outbound data as the socket accepts, watching for writability while some is left.
+void flushConnection(struct benchConnection *connection, int epollFileDescriptor) {
+    while (!connection->outbound.empty()) {
+        ssize_t bytesSent = send(connection->socketFd, connection->outbound.data(), connection->outbound.length(), MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno == EINTR) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { connection->outbound.clear(); }
+            break;
+        }
+        connection->outbound.erase(0, bytesSent);
+    }
+
+    bool watchWritable = !connection->outbound.empty();
+    if (watchWritable != connection->watchingWritable) {
+        struct epoll_event event;
+        event.events = EPOLLIN | (watchWritable ? (uint32_t)EPOLLOUT : 0u);
+        epoll_ctl(epollFileDescriptor, EPOLL_CTL_MOD, connection->socketFd, &event);
+        connection->watchingWritable = watchWritable;
+    }
+}
+
+// Reads what the server sent on a connection and accounts for every complete message. The server's keepalive PING is
+// answered with PONG, so connections which mostly receive are not disconnected as idle.
+void readConnection(struct benchConnection *connection, const struct loadConfiguration *configuration, struct loadResults *results, int epollFileDescriptor) {
+    char readBuffer[READBUFFERSIZE];
+    ssize_t bytesReceived;
+    while ((bytesReceived = recv(connection->socketFd, readBuffer, sizeof readBuffer, 0)) > 0) {
+        int64_t timeNow = monotonicNanoseconds();
+        connection->inbound.append(readBuffer, bytesReceived);
+        results->bytesReceived += bytesReceived;
+
+        // Every server message is a reply, and the messages of other users are marked as such in its header.
+        size_t replyStart = 0;
+        string_view message;
+        bool isMessage;
+        while (nextReply(connection->inbound, &replyStart, &message, &isMessage)) {
+            size_t timestamp = isMessage ? message.find(TIMESTAMPMARKER) : string_view::npos;
+            if (!isMessage && message == "PING") {
+                if (configuration->binary) { queueBinaryFrame(connection, BINARY_TEXT, 0, "PONG", epollFileDescriptor); }
+                else { queueFrame(connection, "PONG", epollFileDescriptor); }
+            }
+            else if (!isMessage && message.compare(0, 13, "RATE LIMITED ") == 0) { results->rateLimitedReplies++; }
+            else if (timestamp != string_view::npos) {
+                results->messagesDelivered++;
+                results->latencies.push_back(timeNow - atoll(message.data() + timestamp + strlen(TIMESTAMPMARKER)));
+            }
+            else { results->repliesReceived++; }
+        }
+        connection->inbound.erase(0, replyStart);
+    }
+}
+
+// Sends <payload> as a frame and waits for the reply. Returns false if the reply is not SUCCESS.
+bool sendCommandExpectingSuccess(int socketFd, const string &payload) {
+    string reply;
+    return sendFrame(socketFd, payload) && receiveReply(socketFd, reply) && reply == "SUCCESS";
+}
+
+// Logs in as <userName> with the binary protocol and stores the user id the server answers with in <userId>.
+// Returns false if the login failed.
+bool connectBinary(int socketFd, const string &userName, uint64_t *userId) {
+    string reply;
+    if (!sendFrame(socketFd, "CONNECT " + userName + " " BINARYPROTOCOLNAME) || !receiveReply(socketFd, reply)) { return false; }
+    return sscanf(reply.c_str(), "SUCCESS %" SCNu64, userId) == 1;
+}
+
+// Returns the length of the reply whose first <replyBytes> bytes are in <reply>, as far as it is known: one
+// byte more than has been received until the header is complete. Payloads are cut off at MINBUFFERSIZE bytes.
+size_t replyLength(const char *reply, size_t replyBytes) {
+    uint32_t payloadLength;
+    size_t headerLength;
+    bool isMessage;
+    if (!decodeReplyHeader(reply, replyBytes, &payloadLength, &headerLength, &isMessage)) { return min(replyBytes + 1, (size_t)MAXREPLYHEADERSIZE); }
+    return headerLength + min((size_t)payloadLength, (size_t)MINBUFFERSIZE);
+}
+
+// Returns the monotonic clock in nanoseconds.
+int64_t monotonicNanoseconds() {
+    struct timespec timeNow;
+    clock_gettime(CLOCK_MONOTONIC, &timeNow);
+    return (int64_t)timeNow.tv_sec * 1000000000 + timeNow.tv_nsec;
+}
+
+// Returns the CPU time <pid> has used, in seconds, or -1 if it cannot be read.
+double processCpuSeconds(pid_t pid) {
+    if (pid <= 0) { return -1; }
+    FILE *statFile = fopen(("/proc/" + to_string(pid) + "/stat").c_str(), "r");
+    if (statFile == NULL) { return -1; }
+    char statLine[1024];
+    bool haveLine = fgets(statLine, sizeof statLine, statFile) != NULL;
+    fclose(statFile);
+    if (!haveLine) { return -1; }
+
+    // The command name may contain spaces, so fields are counted from the closing parenthesis. utime and
+    // stime are the 14th and 15th fields.
+    const char *fields = strrchr(statLine, ')');
+    unsigned long userTicks, systemTicks;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &userTicks, &systemTicks) != 2) { return -1; }
+    return (double)(userTicks + systemTicks) / sysconf(_SC_CLK_TCK);
+}
+
+// Returns the <percentile> of the sorted <values>.
+int64_t percentileOf(const vector<int64_t> &values, double percentile) {
+    size_t index = (size_t)(percentile * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+/* ### Baselines ### */
+
+// The original command splitter of checkAPI, kept as the baseline: ABCDEFGH... A, B, CDEFGH...
+void splitString(vector<string> &inputCommands, string input) {
+    string tmp = "";
+    int counter = 0;
+    for (size_t i = 0; i < input.length(); i++) {
+        if (input[i] == ' ' && counter < 2) {
+            inputCommands.push_back(tmp);
+            tmp = "";
+            counter++;
+        }
+        else { tmp += input[i]; }
+    }
+    inputCommands.push_back(tmp);
+}
+
+// The original verb matching of checkAPI on top of splitString. Returns the verb matched.
+enum commandVerb legacyParse(const string &input) {
+    vector<string> inputCommands;
+    splitString(inputCommands, input);
+
+    if (inputCommands[0] == "ID") { return VERB_ID; }
+    else if (inputCommands[0] == "LEAVE") { return VERB_LEAVE; }
+    else if (inputCommands[0] == "WHO") { return VERB_WHO; }
+    else if (inputCommands[0] == "MSG") { return VERB_MSG; }
+    else if (inputCommands[0] == "CHANGE") { return VERB_CHANGE; }
+    else if (inputCommands[0] == "CONNECT") { return VERB_CONNECT; }
+    else if (inputCommands[0] == "RECV") { return VERB_RECV; }
+    else if (inputCommands[0] == "STATS") { return VERB_STATS; }
+    return VERB_UNKNOWN;
+}
+
+// The original encoding of a server reply, kept as the baseline: <text> padded with null characters to
+// <legacySize> bytes, or followed by a single null character if <legacySize> is 0.
+string legacyReply(const string &text, size_t legacySize) {
+    string reply = text;
+    reply.resize(legacySize == 0 ? text.length() + 1 : legacySize, '\0');
+    return reply;
+}
+
+/* ### Helpers ### */
+
+// Prints how to run chatbench and exits.
+void printUsage() {
+    cout << "Usage: chatbench <benchmark> [options]" << endl;
+    cout << "  parse [rounds]    Compares the per command cost of the old and new command parsers and the binary protocol." << endl;
+    cout << "  wire [users]      Compares the bytes sent in reply to each command with the old and new reply encodings." << endl;
+    cout << "  load <port> <port> <port> [options]" << endl;
+    cout << "                    Drives a mix of commands through many connections to a local chatserver." << endl;
+    cout << "    --connections N       Connections to open, each from its own loopback address (default 100)." << endl;
+    cout << "    --duration S          Seconds to send for (default 10)." << endl;
+    cout << "    --rate R              Commands sent per second over all connections (default 200)." << endl;
+    cout << "    --mix A,P,W,I         Weights of MSG ALL, private MSG, WHO and ID (default 70,20,5,5)." << endl;
+    cout << "    --message-size B      Length of the message text (default 64)." << endl;
+    cout << "    --server-pid PID      Reports the server's CPU time per command and per delivered message." << endl;
+    cout << "    --binary              Logs in with CONNECT <name> BINARY and sends binary frames." << endl;
+    cout << "  connect <port> <port> <port> [options]" << endl;
+    cout << "                    Knocks and logs in many connections to a local chatserver at once." << endl;
+    cout << "    --connections N       Connections to open, each from its own loopback address (default 10000)." << endl;
+    cout << "    --concurrency C       Connections on their way in at any time (default 1000)." << endl;
+    cout << "    --server-pid PID      Reports the server's CPU time per connection." << endl;
+    exit(1);
+}
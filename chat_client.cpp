@@ -16,15 +16,24 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 
 // Data structure includes
 #include <vector>
+#include <deque>
 #include <string>
+#include <algorithm>
+#include <fstream>
 
 // Other includes
 #include <bits/stdc++.h>
 #include <iostream>
 
+// Protocol includes
+#include "chat_protocol.h"
+
 /* ### Constants ### */
 
 // Buffer sizes
@@ -36,15 +45,52 @@
 
 // Other sizes
 #define NUMBEROFPORTSTOKNOCK 3
-#define ONESEC 1000000
+
+// How long a knock may take, in milliseconds, before the server is considered unreachable.
+#define KNOCKTIMEOUT 2000
+
+// The file in the home directory where the last successful knocking sequence of each server is kept.
+#define KNOCKCACHEFILE ".chatclient_knocks"
 
 /* ### Namespace ### */
 using namespace std;
 
+/* ### Structs ### */
+
+// What became of a single knock, or of a whole knocking sequence.
+enum knockResult
+{
+    KNOCK_CLOSED,
+    KNOCK_SUCCEEDED,
+    KNOCK_FAILED,
+    KNOCK_TIMED_OUT,
+    KNOCK_UNREACHABLE
+};
+
+// The commands whose reply is still on its way from the server, oldest first.
+enum pendingReply
+{
+    REPLY_ID,
+    REPLY_WHO,
+    REPLY_STATS,
+    REPLY_JOIN,
+    REPLY_PART
+};
+
 /* ### Global variables ### */
 int socketDescriptor;
 string user;
 
+// Input typed by the user and data from the server that has not been handled yet.
+string stdinBuffer;
+string serverBuffer;
+
+// The replies the server owes us. Messages from other users may arrive before them.
+deque<enum pendingReply> pendingReplies;
+
+// Set after esc, while the user is asked if he really wants to leave.
+bool confirmingLeave = false;
+
 /* ### Split functions ### */
 
 // Split string by first space.
@@ -65,33 +111,70 @@ void printErrorAndQuit(string errorMsg);
 // Print the standard interface line.
 void printLine();
 
+// Print the prompt the user types his commands at.
+void printPrompt();
+// Print a message or reply from the server on its own line and repeat the prompt after it.
+void printServerMessage(const string &message, bool isChatMessage);
+
+/* ### Input functions ### */
+
+// Read what is available on stdin into stdinBuffer. Returns false when stdin is closed.
+bool readStdin();
+// Take the next complete line out of stdinBuffer. Returns false if no complete line has been typed yet.
+bool takeLine(string &line);
+// Block until the user has typed a line. Returns false if stdin is closed first.
+bool waitForLine(string &line);
+// Read what is available on the server socket and print every complete message, answering PING with PONG.
+// Returns false when the server has closed the connection.
+bool readServer();
+
 /* ### Other functions ### */
 
 // Use API call CONNECT to validate the user name.
 bool userNameIsValid(string input);
-// Use API call ID to get and print the server ID.
-void getAndPrintServerId();
-// Use API call WHO get and print all users currently connected to the server.
-void getAndPrintServerUsers();
+// Use API call ID to ask for the server ID. It is printed when the reply arrives.
+void requestServerId();
+// Use API call WHO to ask for all users currently connected to the server. They are printed when the reply arrives.
+void requestServerUsers();
 // Use API calls MSG ALL or MSG to send a message to a specific person or all persons.
 void sendMessage(string message, bool sendPrivate);
-// Use API calls RECV to enter a receiving mode.
-// Enter receive mode to receive messages from other connected users.
-// The user must enter a time in seconds that he wiches to be in receive mode.
-// After the receive mode, the user is free to make other commands.
-void receiveMode();
 // Use API calls CHANGE ID to change ID on server.
 void changeServerId(string groupInitials);
-// Use API calls LEAVE to leave the server and exit the program in a safe way.
-bool leaveServerAndQuit();
+// Use API call STATS to ask for the outbound queue statistics of every user. They are printed when the reply arrives.
+void requestQueueStats();
+// Use API calls JOIN or PART to join or leave a room. Whether it worked is printed when the reply arrives.
+void changeRoomMembership(string roomName, bool join);
+// Use API calls LEAVE to leave the server. Is called with the answer the user gave when asked if he is sure.
+// Returns true if the user is leaving.
+bool leaveServerAndQuit(const string &answer);
 // Only connect to the server if the knocking sequence is correct. The function takes in
 // the ports inputted as arguments and tries to connect to the server with all possible
-// port sequences. If timeout occurs or non of the sequences manages to connect,
-// the function returns false. If the sequence is correct and a connection is made,
-// the function returns true and the socket descriptor of the server is set.
+// port sequences, starting with the one that worked last time. If timeout occurs or non
+// of the sequences manages to connect, the function returns false. If the sequence is
+// correct and a connection is made, the function returns true and the socket descriptor
+// of the server is set.
 bool connectToServerByPortKnocking(int portArray[]);
+// Knock on the ports of <sequence> in order. On success the socket descriptor of the server is set.
+enum knockResult knockSequence(const int sequence[]);
+// Knock on <port> and wait until the server has handled the knock: it resets the connection of every
+// knock but the last, which it answers. If the server answers with KNOCK SUCCESS, <connectedSocket>
+// is set to the still open connection.
+enum knockResult knockOnPort(int port, int *connectedSocket);
+// Wait until <socketFd> is ready for <events>, for at most KNOCKTIMEOUT milliseconds.
+bool waitForSocket(int socketFd, short events);
+// Read the cached knocking sequence for the server listening on <portArray> into <sequence>. Returns
+// false if there is none.
+bool readCachedKnockSequence(const int portArray[], int sequence[]);
+// Remember <sequence> as the knocking sequence of the server listening on <portArray>.
+void cacheKnockSequence(const int portArray[], const int sequence[]);
+// The key of a server in the knock cache: its ports in increasing order.
+string knockCacheKey(const int portArray[]);
+// The path of the knock cache file.
+string knockCachePath();
 // Run the chatroom by calling functions that use the chat server API.
 void runChatRoom(string input);
+// Interpret one line typed by the user. Returns false once the user has left.
+bool handleInputLine(string input);
 
 
 // Client start point.
@@ -108,7 +191,7 @@ int main(int argv, char *args[])
     string input;
     while (true) {
         printBeginPromptUserMessage();
-        getline(cin, input);
+        if (!waitForLine(input)) { printErrorAndQuit("No username entered."); }
         if (userNameIsValid(input)) { break; }
         else { cout << "Username is not valid, try again." << endl; }
     }
@@ -181,10 +264,14 @@ void printCommands() {
     cout << " Input any of the following commands." << endl << endl;
     cout << " snd <message>                 (send message to all users on the chat)" << endl;
     cout << " sndpr <username> <message>    (send a message to a specific user on the chat)" << endl;
-    cout << " recv <time in sec>            (Receive messages from users for a given time)" << endl;
+    cout << " join <#room>                  (join a room, e.g. join #general)" << endl;
+    cout << " part <#room>                  (leave a room)" << endl;
+    cout << " sndrm <#room> <message>       (send a message to everyone in a room you have joined)" << endl;
+    cout << " hist [#room] <count>          (see the last <count> messages to everyone or to a room)" << endl;
     cout << " lst                           (list all users on the chat)" << endl;
     cout << " sid                           (see the id of server)" << endl;
     cout << " changesid <group initials>    (generate new server id with <group initials>)" << endl;
+    cout << " stats                         (see how many messages are queued for each user)" << endl;
     cout << " esc                           (Leave and disconnect from chat)" << endl << endl;
     cout << " man/help                      (see list of commands available)" << endl;
     printLine();
@@ -194,6 +281,42 @@ void printLine() {
     cout << "=================================================================================" << endl;
 }
 
+// Print the prompt the user types his commands at.
+void printPrompt() {
+    cout << user << ": " << flush;
+}
+
+// Print a message or reply from the server on its own line and repeat the prompt after it.
+// Messages of other users, which the server marks as such in the reply header, are printed as they are.
+// Replies are matched to the oldest command still waiting for one. A command refused by the server's
+// rate limits is answered with "RATE LIMITED <class>" instead, which takes the place of the reply to lst.
+void printServerMessage(const string &message, bool isChatMessage) {
+    cout << "\r";
+    bool isRateLimited = message.compare(0, 13, "RATE LIMITED ") == 0;
+    if (isRateLimited && message == "RATE LIMITED who" && !pendingReplies.empty() && pendingReplies.front() == REPLY_WHO) { pendingReplies.pop_front(); }
+    if (isChatMessage || isRateLimited || pendingReplies.empty()) { cout << message << endl; }
+    else {
+        enum pendingReply reply = pendingReplies.front();
+        pendingReplies.pop_front();
+        printLine();
+        if (reply == REPLY_ID) { cout << "SERVER ID:" << endl << message << endl; }
+        else if (reply == REPLY_WHO) {
+            vector<string> receivedUserNamesVector;
+            spaceStringSplitter(receivedUserNamesVector, message);
+            cout << "CONNECTED USERS:" << endl;
+            for (size_t i = 0; i < receivedUserNamesVector.size(); i++) { cout << receivedUserNamesVector[i] << endl; }
+        }
+        else if (reply == REPLY_JOIN) { cout << "JOIN ROOM: " << message << endl; }
+        else if (reply == REPLY_PART) { cout << "LEAVE ROOM: " << message << endl; }
+        else {
+            cout << "QUEUE STATISTICS:" << endl;
+            cout << message;
+        }
+        printLine();
+    }
+    printPrompt();
+}
+
 // Print error message and exit the program.
 void printErrorAndQuit(string errorMsg) {
     cout << errorMsg << endl;
@@ -201,70 +324,80 @@ void printErrorAndQuit(string errorMsg) {
     exit(1);
 }
 
-/* ### Other functions ### */
+/* ### Input functions ### */
 
-// Use API call CONNECT to validate the user name.
-bool userNameIsValid(string input) {
-    // Create the correct string to send to server.
-    input = "CONNECT " + input;
-    char sendBuffer[input.length() + 1];
-    char receiveBuffer[MINBUFFERSIZE];
-
-    // Zero out("clean") buffers.
-    memset(sendBuffer, 0, sizeof sendBuffer);
-    memset(receiveBuffer, 0, sizeof receiveBuffer);
-
-    strcpy(sendBuffer, input.c_str());
-    send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
-
-    // Receive response from server if username is valid.
-    recv(socketDescriptor, receiveBuffer, sizeof receiveBuffer, 0);
-
-    if ((string)receiveBuffer == "SUCCESS") { return true; }
-    return false;
+// Read what is available on stdin into stdinBuffer. Returns false when stdin is closed.
+bool readStdin() {
+    char readBuffer[XXLARGEBUFFERSIZE];
+    ssize_t bytesRead = read(STDIN_FILENO, readBuffer, sizeof readBuffer);
+    if (bytesRead <= 0) { return bytesRead < 0 && errno == EINTR; }
+    stdinBuffer.append(readBuffer, bytesRead);
+    return true;
 }
 
-// Use API call ID to get and print the server ID.
-void getAndPrintServerId() {
-    // Create the correct string to send to server.
-    char sendBuffer[MINBUFFERSIZE] = "ID";
-    char receiveBuffer[XLARGEBUFFERSIZE];
-    send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
-
-    // Receive response from server containing the server id and print out.
-    recv(socketDescriptor, receiveBuffer, sizeof receiveBuffer, 0);
-
-    printLine();
-    fprintf(stderr, "SERVER ID:\n%s\n", receiveBuffer);
-    printLine();
+// Take the next complete line out of stdinBuffer. Returns false if no complete line has been typed yet.
+bool takeLine(string &line) {
+    size_t lineEnd = stdinBuffer.find('\n');
+    if (lineEnd == string::npos) { return false; }
+    line = stdinBuffer.substr(0, lineEnd);
+    stdinBuffer.erase(0, lineEnd + 1);
+    return true;
+}
 
-    // Zero out("clean") buffers.
-    memset(sendBuffer, 0, sizeof sendBuffer);
-    memset(receiveBuffer, 0, sizeof receiveBuffer);
+// Block until the user has typed a line. Returns false if stdin is closed first.
+bool waitForLine(string &line) {
+    while (!takeLine(line)) {
+        if (!readStdin()) { return false; }
+    }
+    return true;
 }
 
-// Use API call WHO get and print all users currently connected to the server.
-void getAndPrintServerUsers() {
-    // Create the correct string to send to server.
-    char sendBuffer[MINBUFFERSIZE] = "WHO";
+// Read what is available on the server socket and print every complete message, answering PING with PONG.
+// Returns false when the server has closed the connection.
+bool readServer() {
     char receiveBuffer[XXLARGEBUFFERSIZE];
-    vector<string> receivedUserNamesVector;
-    send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
+    ssize_t bytesReceived = recv(socketDescriptor, receiveBuffer, sizeof receiveBuffer, 0);
+    if (bytesReceived < 0 && errno == EINTR) { return true; }
+    if (bytesReceived <= 0) { return false; }
+    serverBuffer.append(receiveBuffer, bytesReceived);
+
+    // Every server message is a reply, see chat_protocol.h. An incomplete one stays buffered until the rest arrives.
+    size_t replyStart = 0;
+    string_view message;
+    bool isMessage;
+    while (nextReply(serverBuffer, &replyStart, &message, &isMessage)) {
+        // The server sends PING when we have been quiet for a while and disconnects us unless we answer.
+        if (!isMessage && message == "PING") { sendFrame(socketDescriptor, "PONG"); }
+        else { printServerMessage(string(message), isMessage); }
+    }
+    serverBuffer.erase(0, replyStart);
+    return true;
+}
+
+/* ### Other functions ### */
 
-    // Receive response from server containing the users currently connected.
-    recv(socketDescriptor, receiveBuffer, sizeof receiveBuffer, 0);
+// Use API call CONNECT to validate the user name.
+bool userNameIsValid(string input) {
+    // Create the correct string to send to server.
+    input = "CONNECT " + input;
+    sendFrame(socketDescriptor, input);
 
-    // Split string by all spaces.
-    spaceStringSplitter(receivedUserNamesVector, receiveBuffer);
+    // Receive response from server if username is valid. A PING sent while the name was being typed comes first.
+    string reply;
+    while (receiveReply(socketDescriptor, reply) && reply == "PING") { sendFrame(socketDescriptor, "PONG"); }
+    return reply == "SUCCESS";
+}
 
-    printLine();
-    cout << "CONNECTED USERS:" << endl;
-    for (size_t i = 0; i < receivedUserNamesVector.size(); i++) { cout << receivedUserNamesVector[i] << endl; }
-    printLine();
+// Use API call ID to ask for the server ID. It is printed when the reply arrives.
+void requestServerId() {
+    sendFrame(socketDescriptor, "ID");
+    pendingReplies.push_back(REPLY_ID);
+}
 
-    // Zero out("clean") buffers.
-    memset(sendBuffer, 0, sizeof sendBuffer);
-    memset(receiveBuffer, 0, sizeof receiveBuffer);
+// Use API call WHO to ask for all users currently connected to the server. They are printed when the reply arrives.
+void requestServerUsers() {
+    sendFrame(socketDescriptor, "WHO");
+    pendingReplies.push_back(REPLY_WHO);
 }
 
 // Use API calls MSG ALL or MSG to send a message to a specific person or all persons.
@@ -272,160 +405,292 @@ void sendMessage(string message, bool sendPrivate) {
     if (!sendPrivate) { message = "MSG ALL " + message; }
     if (sendPrivate) { message = "MSG " + message; }
 
-    char sendBuffer[message.length() + 1];
-
-    // Zero out("clean") buffer.
-    memset(sendBuffer, 0, sizeof sendBuffer);
-
-    strcpy(sendBuffer, message.c_str());
-
-    send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
-}
-
-// Use API calls RECV to enter a receiving mode.
-// Enter receive mode to receive messages from other connected users.
-// The user must enter a time in seconds that he wiches to be in receive mode.
-// After the receive mode, the user is free to make other commands.
-void receiveMode(int timeOut) {
-    cout << "Entering recieve mode for " << timeOut << " seconds." << endl;
-    // Create the correct string to send to server.
-    char sendBuffer[MINBUFFERSIZE] = "RECV";
-    send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
-
-    // Zero out("clean") buffer.
-    memset(sendBuffer, 0, sizeof sendBuffer);
-
-    time_t timeStarted, timeElapsed;
-    time(&timeStarted);
-    // Loop will run until the timeout is reached.
-    while (true) {
-        if(difftime(time(&timeElapsed), timeStarted) >= timeOut) {
-            cout << "Exiting receive mode.." << endl;
-            return;
-        }
-
-        char receiveBuffer[XXLARGEBUFFERSIZE];
-        int bytesReceieved = recv(socketDescriptor, receiveBuffer, sizeof receiveBuffer, MSG_DONTWAIT);
-        // Message is written out if something is received from the server.
-        if(bytesReceieved > 0) { cout << receiveBuffer << endl; }
-        memset(receiveBuffer, 0, sizeof receiveBuffer);
-    }
+    sendFrame(socketDescriptor, message);
 }
 
 // Use API calls CHANGE ID to change ID on server.
 void changeServerId(string groupInitials) {
     // Create the correct string to send to server.
     string changeIdCommand = "CHANGE ID " + groupInitials;
-    char sendBuffer[MEDBUFFERSIZE];
-    memset(sendBuffer, 0, sizeof sendBuffer);
-    strcpy(sendBuffer, changeIdCommand.c_str());
+    sendFrame(socketDescriptor, changeIdCommand);
+}
 
-    send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
+// Use API call STATS to ask for the outbound queue statistics of every user. They are printed when the reply arrives.
+void requestQueueStats() {
+    sendFrame(socketDescriptor, "STATS");
+    pendingReplies.push_back(REPLY_STATS);
 }
 
-// Use API calls LEAVE to leave the server and exit the program in a safe way.
-bool leaveServerAndQuit() {
-    string answer = "";
+// Use API calls JOIN or PART to join or leave a room. Whether it worked is printed when the reply arrives.
+void changeRoomMembership(string roomName, bool join) {
+    sendFrame(socketDescriptor, (join ? "JOIN " : "PART ") + roomName);
+    pendingReplies.push_back(join ? REPLY_JOIN : REPLY_PART);
+}
 
-    while (true) {
-        cout << "Are you sure you want to leave? (y/n)" << endl;
-        cout << user << ": ";
-        cin >> answer;
-        if (answer == "y") {
-            char sendBuffer[MINBUFFERSIZE] = "LEAVE";
-            send(socketDescriptor, sendBuffer, sizeof sendBuffer, 0);
-            return true;
-        }
-        else if (answer == "n"){ return false; }
-        else { cout << "Invalid command. Try again." << endl; }
+// Use API calls LEAVE to leave the server. Is called with the answer the user gave when asked if he is sure.
+// Returns true if the user is leaving.
+bool leaveServerAndQuit(const string &answer) {
+    if (answer == "y") {
+        sendFrame(socketDescriptor, "LEAVE");
+        return true;
     }
+    else if (answer == "n") { confirmingLeave = false; }
+    else { cout << "Invalid command. Try again." << endl << "Are you sure you want to leave? (y/n)" << endl; }
     return false;
 }
 
 // Only connect to the server if the knocking sequence is correct. The function takes in
 // the ports inputted as arguments and tries to connect to the server with all possible
-// port sequences. If timeout occurs or non of the sequences maneges to connect,
-// the function returns false. If the sequence is correct and a connection is made,
-// the function returns true and the socket descriptor of the server is set.
+// port sequences, starting with the one that worked last time. If timeout occurs or non
+// of the sequences manages to connect, the function returns false. If the sequence is
+// correct and a connection is made, the function returns true and the socket descriptor
+// of the server is set.
+// The server tracks knocks per IP address, so the sequences are tried one after another. Each
+// knock only waits until the server has handled it, instead of sleeping.
 bool connectToServerByPortKnocking(int portArray[]) {
     cout << "Connecting to chat server..." << endl;
-    // Create the address of the socket
+
+    // All sequences, with the cached one first.
+    vector<vector<int> > sequences;
+    int cachedSequence[NUMBEROFPORTSTOKNOCK];
+    if (readCachedKnockSequence(portArray, cachedSequence)) {
+        sequences.push_back(vector<int>(cachedSequence, cachedSequence + NUMBEROFPORTSTOKNOCK));
+    }
+    vector<int> permutation(portArray, portArray + NUMBEROFPORTSTOKNOCK);
+    sort(permutation.begin(), permutation.end());
+    do {
+        if (sequences.empty() || permutation != sequences[0]) { sequences.push_back(permutation); }
+    } while (next_permutation(permutation.begin(), permutation.end()));
+
+    for (size_t i = 0; i < sequences.size(); i++) {
+        enum knockResult result = knockSequence(&sequences[i][0]);
+        if (result == KNOCK_SUCCEEDED) {
+            cacheKnockSequence(portArray, &sequences[i][0]);
+            return true;
+        }
+        else if (result == KNOCK_TIMED_OUT) { printErrorAndQuit("Timeout: Took to long time to connect."); }
+        else if (result == KNOCK_UNREACHABLE) { return false; }
+    }
+    return false;
+}
+
+// Knock on the ports of <sequence> in order. On success the socket descriptor of the server is set.
+enum knockResult knockSequence(const int sequence[]) {
+    bool restarted = false;
+    for (int i = 0; i < NUMBEROFPORTSTOKNOCK; i++) {
+        enum knockResult result = knockOnPort(sequence[i], &socketDescriptor);
+        if (i == NUMBEROFPORTSTOKNOCK - 1) { return result == KNOCK_CLOSED ? KNOCK_FAILED : result; }
+        if (result == KNOCK_CLOSED) { continue; }
+
+        // Only the last knock should be answered. If an earlier one is, the server still counted knocks
+        // of an earlier, unfinished attempt and has now reset, so the sequence is started over once.
+        if (result != KNOCK_FAILED || restarted) { return result; }
+        restarted = true;
+        i = -1;
+    }
+    return KNOCK_FAILED;
+}
+
+// Knock on <port> and wait until the server has handled the knock: it resets the connection of every
+// knock but the last, which it answers. If the server answers with KNOCK SUCCESS, <connectedSocket>
+// is set to the still open connection.
+enum knockResult knockOnPort(int port, int *connectedSocket) {
     struct sockaddr_in socketAddress;
+    memset(&socketAddress, 0, sizeof socketAddress);
     socketAddress.sin_family = AF_INET;
     socketAddress.sin_addr.s_addr = INADDR_ANY;
+    socketAddress.sin_port = htons(port);
+
+    int knockSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (knockSocket < 0) { return KNOCK_UNREACHABLE; }
+    int socketFlags = fcntl(knockSocket, F_GETFL);
+    fcntl(knockSocket, F_SETFL, socketFlags | O_NONBLOCK);
+
+    // Wait for the connection to be established.
+    int connectError = 0;
+    socklen_t connectErrorSize = sizeof connectError;
+    if (connect(knockSocket, (struct sockaddr *)&socketAddress, sizeof socketAddress) < 0) {
+        if (errno != EINPROGRESS || !waitForSocket(knockSocket, POLLOUT)) { connectError = -1; }
+        else { getsockopt(knockSocket, SOL_SOCKET, SO_ERROR, &connectError, &connectErrorSize); }
+    }
+    // The server resets knocks it has counted, which may happen before we get to see the connection made.
+    if (connectError == ECONNRESET) {
+        close(knockSocket);
+        return KNOCK_CLOSED;
+    }
+    if (connectError != 0) {
+        close(knockSocket);
+        return KNOCK_UNREACHABLE;
+    }
 
-    for (int i = 0; i < NUMBEROFPORTSTOKNOCK; i++) {
-        for (int j = 0; j < NUMBEROFPORTSTOKNOCK; j++) {
-            for (int k = 0; k < NUMBEROFPORTSTOKNOCK; k++) {
-                if (portArray[i] != portArray[j] && portArray[j] != portArray[k] && portArray[i] != portArray[k]) {
-                    // Knock 1
-                    socketDescriptor = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-                    socketAddress.sin_port = htons(portArray[i]);
-                    connect(socketDescriptor, (struct sockaddr *)&socketAddress, sizeof socketAddress);
-                    usleep(ONESEC);
-                    close(socketDescriptor);
-
-                    // Knock 2
-                    socketDescriptor = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-                    socketAddress.sin_port = htons(portArray[j]);
-                    connect(socketDescriptor, (struct sockaddr *)&socketAddress, sizeof socketAddress);
-                    usleep(ONESEC);
-                    close(socketDescriptor);
-
-                    // Knock 3
-                    socketDescriptor = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-                    socketAddress.sin_port = htons(portArray[k]);
-                    connect(socketDescriptor, (struct sockaddr *)&socketAddress, sizeof socketAddress);
-
-                    // After three knocks a message is received from the server, stating if the
-                    // knocking sequence is a success or not. If it was not a success a sleep is set for 1 sec
-                    // and the descriptor is closed. Then another sequence is tried.
-                    char receiveBuffer[LARGEBUFFERSIZE];
-                    recv(socketDescriptor, &receiveBuffer, sizeof receiveBuffer, 0);
-
-                    if((string)receiveBuffer == "KNOCK SUCCESS") { return true; }
-                    else if((string)receiveBuffer == "TIMEOUT FAIL") {
-                        close(socketDescriptor);
-                        printErrorAndQuit("Timeout: Took to long time to connect.");
-                    }
-                    else {
-                        usleep(ONESEC);
-                        close(socketDescriptor);
-                    }
-                }
-            }
+    // Wait for the server to close the knock or to answer it with a reply. The answers are shorter than 64
+    // bytes, so their header is a single byte. Nothing past the reply is read, as the connection is kept if
+    // the knock succeeded.
+    char receiveBuffer[1 + MINBUFFERSIZE];
+    size_t bytesReceived = 0;
+    size_t replyLength = 1;
+    while (bytesReceived < replyLength) {
+        if (!waitForSocket(knockSocket, POLLIN)) {
+            close(knockSocket);
+            return KNOCK_UNREACHABLE;
+        }
+        ssize_t received = recv(knockSocket, receiveBuffer + bytesReceived, replyLength - bytesReceived, 0);
+        if (received < 0 && (errno == EAGAIN || errno == EINTR)) { continue; }
+        if (received <= 0) { break; }
+        bytesReceived += received;
+        uint32_t payloadLength;
+        size_t headerLength;
+        bool isMessage;
+        if (bytesReceived == 1 && decodeReplyHeader(receiveBuffer, 1, &payloadLength, &headerLength, &isMessage)) {
+            replyLength += min(payloadLength, (uint32_t)MINBUFFERSIZE);
         }
     }
+
+    string reply(receiveBuffer + 1, bytesReceived > 1 ? bytesReceived - 1 : 0);
+    if (reply == "KNOCK SUCCESS") {
+        fcntl(knockSocket, F_SETFL, socketFlags);
+        *connectedSocket = knockSocket;
+        return KNOCK_SUCCEEDED;
+    }
+    close(knockSocket);
+    if (bytesReceived == 0) { return KNOCK_CLOSED; }
+    if (reply == "TIMEOUT FAIL") { return KNOCK_TIMED_OUT; }
+    return KNOCK_FAILED;
+}
+
+// Wait until <socketFd> is ready for <events>, for at most KNOCKTIMEOUT milliseconds.
+bool waitForSocket(int socketFd, short events) {
+    struct pollfd pollDescriptor;
+    pollDescriptor.fd = socketFd;
+    pollDescriptor.events = events;
+    int readyCount;
+    do { readyCount = poll(&pollDescriptor, 1, KNOCKTIMEOUT); } while (readyCount < 0 && errno == EINTR);
+    return readyCount > 0;
+}
+
+// Read the cached knocking sequence for the server listening on <portArray> into <sequence>. Returns
+// false if there is none.
+bool readCachedKnockSequence(const int portArray[], int sequence[]) {
+    ifstream cacheFile(knockCachePath().c_str());
+    string key = knockCacheKey(portArray);
+    string line;
+    while (getline(cacheFile, line)) {
+        if (line.compare(0, key.length(), key) != 0) { continue; }
+        istringstream sequenceStream(line.substr(key.length()));
+        for (int i = 0; i < NUMBEROFPORTSTOKNOCK; i++) { sequenceStream >> sequence[i]; }
+        if (sequenceStream) { return true; }
+    }
     return false;
 }
 
+// Remember <sequence> as the knocking sequence of the server listening on <portArray>.
+void cacheKnockSequence(const int portArray[], const int sequence[]) {
+    // Keep the sequences of the other servers.
+    string key = knockCacheKey(portArray);
+    vector<string> lines;
+    ifstream cacheFile(knockCachePath().c_str());
+    string line;
+    while (getline(cacheFile, line)) {
+        if (line.compare(0, key.length(), key) != 0) { lines.push_back(line); }
+    }
+    cacheFile.close();
+
+    ostringstream newLine;
+    newLine << key << sequence[0] << " " << sequence[1] << " " << sequence[2];
+    lines.push_back(newLine.str());
+
+    ofstream newCacheFile(knockCachePath().c_str(), ios::trunc);
+    for (size_t i = 0; i < lines.size(); i++) { newCacheFile << lines[i] << endl; }
+}
+
+// The key of a server in the knock cache: its ports in increasing order.
+string knockCacheKey(const int portArray[]) {
+    vector<int> ports(portArray, portArray + NUMBEROFPORTSTOKNOCK);
+    sort(ports.begin(), ports.end());
+    ostringstream key;
+    key << ports[0] << " " << ports[1] << " " << ports[2] << " : ";
+    return key.str();
+}
+
+// The path of the knock cache file.
+string knockCachePath() {
+    const char *home = getenv("HOME");
+    return string(home != NULL ? home : ".") + "/" + KNOCKCACHEFILE;
+}
+
 // Run the chatroom by calling functions that use the chat server API.
+// A single poll loop waits for both the user and the server, so messages from other users are printed
+// as soon as they arrive, even while the user is typing.
 void runChatRoom(string input) {
     user = input;
-    vector<string> inputCommands;
     printLoggedInMessage();
     printCommands();
 
+    // Receive messages from other users from now on.
+    sendFrame(socketDescriptor, "RECV");
+    printPrompt();
+
+    struct pollfd pollDescriptors[2];
+    pollDescriptors[0].fd = STDIN_FILENO;
+    pollDescriptors[0].events = POLLIN;
+    pollDescriptors[1].fd = socketDescriptor;
+    pollDescriptors[1].events = POLLIN;
+
     // Run loop until user chooses the esc option to leave the chatserver.
     while (true) {
-        cout << user << ": ";
-        getline(cin, input);
-        // Use split function to splitting string on spaces and placing them in order in the vector inputCommands.
-        customInputStringSplitter(inputCommands, input);
-
-        // Various function calls depending on input from user.
-        if (inputCommands.size() > 2) { cout << "Invalid input, try again(input man/help to se list of commands)." << endl; }
-        if (inputCommands[0] == "man" || inputCommands[0] == "help") { printCommands(); }
-        else if (inputCommands[0] == "snd") { if (inputCommands[1].size() > 0) { sendMessage(inputCommands[1], false); } }
-        else if (inputCommands[0] == "sndpr") { if (inputCommands[1].size() > 0) { sendMessage(inputCommands[1], true); } }
-        else if (inputCommands[0] == "lst") { getAndPrintServerUsers(); }
-        else if (inputCommands[0] == "sid") { getAndPrintServerId(); }
-        else if (inputCommands[0] == "changesid") { changeServerId(inputCommands[1]); }
-        else if (inputCommands[0] == "esc") {if (leaveServerAndQuit()) { break;} }
-        else if (inputCommands[0] == "recv") { if(atoi(inputCommands[1].c_str()) > 0) { receiveMode(atoi(inputCommands[1].c_str())); } }
-        else { cout << "Invalid input, try again(input man/help to se list of commands)." << endl; }
-
-        // After each command, the vector needs to be cleared.
-        inputCommands.clear();
+        if (poll(pollDescriptors, 2, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            printErrorAndQuit("Poll failed.");
+        }
+
+        if (pollDescriptors[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (!readServer()) { printErrorAndQuit("\nThe server closed the connection."); }
+        }
+
+        if (pollDescriptors[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Leave the chat if stdin is closed.
+            if (!readStdin()) {
+                sendFrame(socketDescriptor, "LEAVE");
+                return;
+            }
+            while (takeLine(input)) {
+                if (!handleInputLine(input)) { return; }
+            }
+        }
+    }
+}
+
+// Interpret one line typed by the user. Returns false once the user has left.
+bool handleInputLine(string input) {
+    if (confirmingLeave) {
+        if (leaveServerAndQuit(input)) { return false; }
+        printPrompt();
+        return true;
+    }
+
+    // Use split function to splitting string on spaces and placing them in order in the vector inputCommands.
+    vector<string> inputCommands;
+    customInputStringSplitter(inputCommands, input);
+    if (inputCommands.size() < 2) { inputCommands.push_back(""); }
+
+    // Various function calls depending on input from user.
+    if (inputCommands[0] == "man" || inputCommands[0] == "help") { printCommands(); }
+    else if (inputCommands[0] == "snd") { if (inputCommands[1].size() > 0) { sendMessage(inputCommands[1], false); } }
+    else if (inputCommands[0] == "sndpr") { if (inputCommands[1].size() > 0) { sendMessage(inputCommands[1], true); } }
+    else if (inputCommands[0] == "sndrm") { if (inputCommands[1].size() > 0 && inputCommands[1][0] == '#') { sendMessage(inputCommands[1], true); } }
+    else if (inputCommands[0] == "hist") { if (inputCommands[1].size() > 0) { sendFrame(socketDescriptor, "HISTORY " + inputCommands[1]); } }
+    else if (inputCommands[0] == "join") { changeRoomMembership(inputCommands[1], true); }
+    else if (inputCommands[0] == "part") { changeRoomMembership(inputCommands[1], false); }
+    else if (inputCommands[0] == "lst") { requestServerUsers(); }
+    else if (inputCommands[0] == "sid") { requestServerId(); }
+    else if (inputCommands[0] == "changesid") { changeServerId(inputCommands[1]); }
+    else if (inputCommands[0] == "stats") { requestQueueStats(); }
+    else if (inputCommands[0] == "esc") {
+        confirmingLeave = true;
+        cout << "Are you sure you want to leave? (y/n)" << endl;
+        return true;
     }
+    else if (inputCommands[0] != "") { cout << "Invalid input, try again(input man/help to se list of commands)." << endl; }
+    printPrompt();
+    return true;
 }
@@ -0,0 +1,337 @@
+/* ###################################### */
+/* #    TSAM - Project 2: Chatserver    # */
+/* #                                    # */
+/* #    Þórir Ármann Valdimarsson       # */
+/* #    Smári Freyr Guðmundsson         # */
+/* #    Snorri Arinbjarnar              # */
+/* #                                    # */
+/* ###################################### */
+
+// Wire protocol shared by chatserver, chatclient and chatbench.
+
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+// Standard includes
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+// System includes
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+// Data structure includes
+#include <string>
+#include <string_view>
+
+/* ### Constants ### */
+
+// Every command sent over the chat connection is a frame: a four byte payload length in
+// network byte order followed by that many bytes of command text. Several frames may be
+// sent in one write and a frame may arrive split over several reads.
+#define FRAMEHEADERSIZE 4
+
+// Frames announcing a larger payload than this are treated as a protocol violation.
+#define MAXFRAMEPAYLOADSIZE 65536
+
+// Everything the server sends, its replies, the messages it delivers and its answers to knocks, is a
+// reply: a variable length integer, seven bits per byte with the lowest bits first and the top bit set
+// on every byte but the last, followed by the payload. The integer is the payload length shifted left
+// by one, with REPLYMESSAGEBIT set if the payload is a message from another user rather than an answer
+// to one of the client's own commands, so clients never have to guess which it is from the text. A
+// payload shorter than 64 bytes costs a single byte of header, no more than the null character the
+// server used to end its messages with. Replies are not bounded in length, as WHO and STATS grow with
+// the number of users.
+#define MAXREPLYHEADERSIZE 5
+#define REPLYMESSAGEBIT 1
+
+// A client which logs in with CONNECT <name> BINARY sends every later command as a binary frame instead:
+// a BINARYHEADERSIZE byte header followed by the payload. The header's fields are little-endian:
+//   byte 0      opcode, one of binaryOpcode
+//   byte 1      flags, reserved and sent as 0
+//   bytes 2-3   reserved and sent as 0
+//   bytes 4-7   payload length, at most MAXFRAMEPAYLOADSIZE
+//   bytes 8-15  the user id of the receiver of BINARY_MSG_USER, and 0 for every other opcode
+// User ids are told by the answers to CONNECT <name> BINARY, "SUCCESS <id>", and LOOKUP <name>, "USER <name> <id>".
+#define BINARYHEADERSIZE 16
+#define BINARYPROTOCOLNAME "BINARY"
+
+/* ### Framing functions ### */
+
+// Writes the frame header for a payload of <payloadLength> bytes into <header>.
+inline void encodeFrameHeader(uint32_t payloadLength, char *header) {
+    uint32_t networkLength = htonl(payloadLength);
+    memcpy(header, &networkLength, FRAMEHEADERSIZE);
+}
+
+// Reads the payload length out of the frame header at <header>.
+inline uint32_t decodeFrameHeader(const char *header) {
+    uint32_t networkLength;
+    memcpy(&networkLength, header, FRAMEHEADERSIZE);
+    return ntohl(networkLength);
+}
+
+// Appends <payload> as a complete frame to <frames>. Appending several commands to the
+// same string and sending it once batches them into a single syscall.
+inline void appendFrame(std::string &frames, std::string_view payload) {
+    char header[FRAMEHEADERSIZE];
+    encodeFrameHeader(payload.length(), header);
+    frames.append(header, FRAMEHEADERSIZE);
+    frames.append(payload);
+}
+
+// Sends <length> bytes from <buffer>, retrying until everything is written. Returns false if the
+// connection failed before that.
+inline bool sendAll(int socketDescriptor, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t bytesSent = send(socketDescriptor, buffer, length, MSG_NOSIGNAL);
+        if (bytesSent < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        buffer += bytesSent;
+        length -= bytesSent;
+    }
+    return true;
+}
+
+// Frames <payload> and sends it over <socketDescriptor>.
+inline bool sendFrame(int socketDescriptor, std::string_view payload) {
+    std::string frame;
+    appendFrame(frame, payload);
+    return sendAll(socketDescriptor, frame.data(), frame.length());
+}
+
+// Receives exactly <length> bytes into <buffer>, blocking until they are there. Returns false if the
+// connection was closed or failed before that.
+inline bool receiveAll(int socketDescriptor, char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t bytesReceived = recv(socketDescriptor, buffer, length, MSG_WAITALL);
+        if (bytesReceived < 0 && errno == EINTR) { continue; }
+        if (bytesReceived <= 0) { return false; }
+        buffer += bytesReceived;
+        length -= bytesReceived;
+    }
+    return true;
+}
+
+/* ### Binary protocol ### */
+
+// The commands of the binary protocol. Their payloads are:
+// BINARY_TEXT      a text command, e.g. JOIN #room, for the commands which have no opcode of their own
+// BINARY_MSG_ALL   the message to everyone
+// BINARY_MSG_USER  the private message, the receiver being given by the header's user id
+// BINARY_MSG_ROOM  the room name's length as one byte, the room name and the message
+// BINARY_WHO, BINARY_ID, BINARY_RECV and BINARY_LEAVE  nothing
+// BINARY_LOOKUP    the username to look the user id of up
+enum binaryOpcode
+{
+    BINARY_TEXT,
+    BINARY_MSG_ALL,
+    BINARY_MSG_USER,
+    BINARY_MSG_ROOM,
+    BINARY_WHO,
+    BINARY_ID,
+    BINARY_RECV,
+    BINARY_LEAVE,
+    BINARY_LOOKUP,
+    BINARYOPCODECOUNT
+};
+
+// The header of a binary frame, see BINARYHEADERSIZE.
+struct binaryHeader
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t payloadLength;
+    uint64_t userId;
+};
+
+// Reads the binary frame header at <bytes> into <header>.
+inline void decodeBinaryHeader(const char *bytes, struct binaryHeader *header) {
+    uint32_t payloadLength;
+    uint64_t userId;
+    memcpy(&payloadLength, bytes + 4, sizeof payloadLength);
+    memcpy(&userId, bytes + 8, sizeof userId);
+    header->opcode = (uint8_t)bytes[0];
+    header->flags = (uint8_t)bytes[1];
+    header->payloadLength = le32toh(payloadLength);
+    header->userId = le64toh(userId);
+}
+
+// Appends a binary frame with <opcode>, <userId> and <payload> to <frames>.
+inline void appendBinaryFrame(std::string &frames, enum binaryOpcode opcode, uint64_t userId, std::string_view payload) {
+    char header[BINARYHEADERSIZE] = {0};
+    uint32_t payloadLength = htole32(payload.length());
+    userId = htole64(userId);
+    header[0] = (char)opcode;
+    memcpy(header + 4, &payloadLength, sizeof payloadLength);
+    memcpy(header + 8, &userId, sizeof userId);
+    frames.append(header, BINARYHEADERSIZE);
+    frames.append(payload);
+}
+
+/* ### Reply functions ### */
+
+// Appends the header of a reply with a payload of <payloadLength> bytes to <replies>. The payload is a message
+// from another user if <isMessage> is true.
+inline void appendReplyHeader(std::string &replies, size_t payloadLength, bool isMessage) {
+    uint64_t header = ((uint64_t)payloadLength << 1) | (isMessage ? REPLYMESSAGEBIT : 0);
+    while (header >= 0x80) {
+        replies.push_back((char)(header | 0x80));
+        header >>= 7;
+    }
+    replies.push_back((char)header);
+}
+
+// Appends <payload> as a complete reply to <replies>.
+inline void appendReply(std::string &replies, std::string_view payload) {
+    appendReplyHeader(replies, payload.length(), false);
+    replies.append(payload);
+}
+
+// Turns everything from <payloadStart> to the end of <replies> into a reply by inserting its header in
+// front of it. Is used for payloads whose length is not known until they have been assembled.
+inline void insertReplyHeader(std::string &replies, size_t payloadStart) {
+    std::string header;
+    appendReplyHeader(header, replies.length() - payloadStart, false);
+    replies.insert(payloadStart, header);
+}
+
+// Reads the reply header at the start of the <available> bytes at <data>. Returns false if it is not
+// complete yet. Otherwise stores the payload length in <payloadLength>, the header's own length in
+// <headerLength> and whether the payload is a message from another user in <isMessage>.
+inline bool decodeReplyHeader(const char *data, size_t available, uint32_t *payloadLength, size_t *headerLength, bool *isMessage) {
+    uint64_t header = 0;
+    for (size_t i = 0; i < available && i < MAXREPLYHEADERSIZE; i++) {
+        header |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+        if ((data[i] & 0x80) == 0) {
+            *payloadLength = header >> 1;
+            *headerLength = i + 1;
+            *isMessage = (header & REPLYMESSAGEBIT) != 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the payload of the complete reply <reply>.
+inline std::string_view replyPayload(std::string_view reply) {
+    uint32_t payloadLength = 0;
+    size_t headerLength = 0;
+    bool isMessage;
+    decodeReplyHeader(reply.data(), reply.length(), &payloadLength, &headerLength, &isMessage);
+    return reply.substr(headerLength, payloadLength);
+}
+
+// Finds the complete reply starting at <*replyStart> in <replies>. Returns false if it has not been
+// received in full yet. Otherwise points <payload> at its payload, stores whether it is a message from
+// another user in <isMessage> and moves <*replyStart> past it.
+inline bool nextReply(const std::string &replies, size_t *replyStart, std::string_view *payload, bool *isMessage) {
+    uint32_t payloadLength;
+    size_t headerLength;
+    size_t available = replies.length() - *replyStart;
+    if (!decodeReplyHeader(replies.data() + *replyStart, available, &payloadLength, &headerLength, isMessage) ||
+        available - headerLength < payloadLength) { return false; }
+    *payload = std::string_view(replies.data() + *replyStart + headerLength, payloadLength);
+    *replyStart += headerLength + payloadLength;
+    return true;
+}
+
+// Receives one reply from <socketDescriptor>, blocking until it is complete, and stores its payload in
+// <payload>. Nothing after the reply is read. Returns false if the connection was closed or failed first.
+inline bool receiveReply(int socketDescriptor, std::string &payload) {
+    // The header is read a byte at a time, as its length is only known once its last byte is there.
+    char header[MAXREPLYHEADERSIZE];
+    size_t headerBytes = 0;
+    uint32_t payloadLength;
+    size_t headerLength;
+    bool isMessage;
+    do {
+        if (headerBytes == MAXREPLYHEADERSIZE || !receiveAll(socketDescriptor, header + headerBytes, 1)) { return false; }
+        headerBytes++;
+    } while (!decodeReplyHeader(header, headerBytes, &payloadLength, &headerLength, &isMessage));
+    payload.resize(payloadLength);
+    return receiveAll(socketDescriptor, &payload[0], payload.length());
+}
+
+/* ### Command parsing ### */
+
+// The commands a client can send. VERB_UNKNOWN is anything else.
+enum commandVerb
+{
+    VERB_UNKNOWN,
+    VERB_ID,
+    VERB_LEAVE,
+    VERB_WHO,
+    VERB_MSG,
+    VERB_CHANGE,
+    VERB_CONNECT,
+    VERB_RECV,
+    VERB_STATS,
+    VERB_JOIN,
+    VERB_PART,
+    VERB_HISTORY,
+    VERB_LOOKUP,
+    VERB_PONG
+};
+
+// A parsed command. A command is split thus: VERB ARGUMENT TEXT..., the first two words being separated
+// by single spaces and the text being the rest of the command, spaces included. Missing parts are empty.
+// The views point into the buffer the command was parsed from and are only valid as long as it is.
+struct parsedCommand
+{
+    enum commandVerb verb;
+    std::string_view argument;
+    std::string_view text;
+};
+
+// Returns the verb spelled by <word>. Dispatches on the length first, so at most three comparisons are made.
+inline enum commandVerb parseVerb(std::string_view word) {
+    switch (word.length()) {
+        case 2: if (word == "ID") { return VERB_ID; } break;
+        case 3:
+            if (word == "MSG") { return VERB_MSG; }
+            if (word == "WHO") { return VERB_WHO; }
+            break;
+        case 4:
+            if (word == "RECV") { return VERB_RECV; }
+            if (word == "JOIN") { return VERB_JOIN; }
+            if (word == "PART") { return VERB_PART; }
+            if (word == "PONG") { return VERB_PONG; }
+            break;
+        case 5:
+            if (word == "LEAVE") { return VERB_LEAVE; }
+            if (word == "STATS") { return VERB_STATS; }
+            break;
+        case 6:
+            if (word == "CHANGE") { return VERB_CHANGE; }
+            if (word == "LOOKUP") { return VERB_LOOKUP; }
+            break;
+        case 7:
+            if (word == "CONNECT") { return VERB_CONNECT; }
+            if (word == "HISTORY") { return VERB_HISTORY; }
+            break;
+    }
+    return VERB_UNKNOWN;
+}
+
+// Splits off the word at the front of <input> up to the next space and removes it, and the space, from <input>.
+inline std::string_view takeWord(std::string_view &input) {
+    size_t space = input.find(' ');
+    std::string_view word = input.substr(0, space);
+    input.remove_prefix(space == std::string_view::npos ? input.length() : space + 1);
+    return word;
+}
+
+// Parses the command in <input> into <command> without copying or allocating.
+inline void parseCommand(std::string_view input, struct parsedCommand *command) {
+    command->verb = parseVerb(takeWord(input));
+    command->argument = takeWord(input);
+    command->text = input;
+}
+
+#endif
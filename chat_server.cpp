@@ -16,22 +16,50 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 // Data structure includes
 #include <vector>
-#include <map>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <random>
+
+// Thread includes
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <charconv>
+#include <unordered_map>
+#include <memory_resource>
 #include <string>
 #include <string.h>
 
 // Time includes
 #include <time.h>
+#include <chrono>
 
 // Stream includes
 #include <iostream>
 #include <sstream>
 
+// Protocol includes
+#include "chat_protocol.h"
+
 /* ### Constants ### */
 
 // Buffer sizes
@@ -48,16 +76,191 @@
 
 #define PORTAMOUNT 3
 
-#define MAXCLIENTSALLOWED 8
+// Connections waiting to be accepted on each listening socket. --backlog changes it, and the kernel
+// caps it at net.core.somaxconn.
+#define DEFAULTLISTENBACKLOG 4096
 
 #define PORTLOWERBOUND 30000
 #define PORTUPPERBOUND 60000
 
+// Event loop
+#define MAXEPOLLEVENTS 64
+
+// Per-connection read buffers start at INITIALREADBUFFERSIZE and double when full, up to
+// the smallest power of two that can hold one maximum sized frame.
+#define INITIALREADBUFFERSIZE 4096
+#define MAXREADBUFFERSIZE 131072
+
+// Default bounds of a connection's outbound queue. They can be changed on the command line
+// with --max-queued-messages and --max-queued-bytes.
+#define DEFAULTMAXQUEUEDMESSAGES 1024
+#define DEFAULTMAXQUEUEDBYTES 1048576
+
+// The most queued messages handed to the kernel in a single sendmsg() call.
+#define MAXIOVECSPERSEND 64
+
+// The io_uring backend chosen with --io-backend io_uring. Each reactor's ring has RINGENTRIES submission queue
+// entries. Client sockets receive into RINGRECEIVEBUFFERS buffers of RINGRECEIVEBUFFERSIZE bytes, which the kernel
+// takes from the reactor's buffer ring as data arrives. RINGENTRIES and RINGRECEIVEBUFFERS must be powers of two.
+// The user data of every submission is its ringOperation shifted left by RINGOPERATIONSHIFT, plus the index of the
+// listening socket or connection slot it is for.
+#define RINGENTRIES 4096
+#define RINGRECEIVEBUFFERS 1024
+#define RINGRECEIVEBUFFERSIZE 4096
+#define RINGBUFFERGROUP 0
+#define RINGOPERATIONSHIFT 32
+
+// Reactor threads. The server runs one by default, --threads changes it.
+#define MAXREACTORTHREADS 64
+
+// The user directory is split into this many independently locked shards.
+#define USERDIRECTORYSHARDS 64
+
+// Usernames are at most MAXUSERNAMELENGTH characters long. They are kept inline in the user's
+// registry slot and in the user directory, so logging in does not allocate a string.
+#define MAXUSERNAMELENGTH 31
+
+// The user list kept for WHO. WHO SINCE is answered with the changes if the version asked about is
+// among the last USERLISTCHANGES logins and logouts, which must be a power of two, and with the
+// whole list otherwise. A page of WHO <offset> <count> holds at most MAXWHOPAGESIZE users.
+#define USERLISTCHANGES 1024
+#define MAXWHOPAGESIZE 1024
+
+// Marks a socket file descriptor which has no slot in a reactor's connection pool or user registry.
+#define NOSLOT UINT32_MAX
+
+// The user ids of the binary protocol. The lowest USERIDREACTORBITS bits of an id are the index of the reactor
+// thread the user is connected to, the next USERIDSLOTBITS bits his registry slot and the top 32 bits the slot's
+// generation, so a message can be routed by its id without looking the user up and an id outlives its user
+// without reaching the next user of the slot.
+#define USERIDREACTORBITS 8
+#define USERIDSLOTBITS 24
+
+// Port knocking. The knock state of at most KNOCKTABLECAPACITY addresses is kept; once
+// KNOCKTABLEMAXLOAD addresses are knocking, the oldest knock is evicted to make room.
+// A knocking sequence must be completed within KNOCKWINDOWSECONDS of its first knock.
+// Expiry is driven by a timer in reactor 0's timer wheel.
+#define KNOCKTABLECAPACITY 4096
+#define KNOCKTABLEMAXLOAD 3072
+#define KNOCKWINDOWSECONDS 120
+#define KNOCKADDRESSSIZE 16
+#define NOKNOCKINDEX -1
+
+// Timers. Every reactor keeps its timers in a hierarchical timer wheel of TIMERWHEELLEVELS levels of
+// TIMERWHEELSLOTS slots. A slot of the first level is one tick of TIMERTICKMILLISECONDS, and a slot of
+// every further level as long as the whole level below it, so the wheel reaches about 46 hours ahead.
+#define TIMERTICKMILLISECONDS 10
+#define TIMERWHEELLEVELS 4
+#define TIMERWHEELBITS 6
+#define TIMERWHEELSLOTS (1 << TIMERWHEELBITS)
+#define NOTIMER UINT32_MAX
+
+// Keepalive. A connection which has sent nothing for DEFAULTPINGINTERVAL seconds is sent PING, which a
+// client answers with PONG, and one which has sent nothing for DEFAULTIDLETIMEOUT seconds is disconnected.
+// They can be changed with --ping-interval and --idle-timeout.
+#define DEFAULTPINGINTERVAL 60
+#define DEFAULTIDLETIMEOUT 180
+
+// Server Id generation. Like fortune -s, only fortunes up to SHORTFORTUNELENGTH characters
+// are used. A client may change the Id at most once every DEFAULTCHANGEIDINTERVAL seconds,
+// which can be changed with --change-id-interval.
+#define SHORTFORTUNELENGTH 160
+#define DEFAULTCHANGEIDINTERVAL 10
+
+// Rate limits. Every connection has a token bucket for each class of commands, holding up to
+// the class's burst of commands and refilled at its rate per second. The defaults can be changed
+// with --rate-limit. Buckets count in RATETOKENUNITS per command, so that rates of less than one
+// command per timer tick are refilled exactly enough.
+#define DEFAULTBROADCASTRATE 20
+#define DEFAULTBROADCASTBURST 40
+#define DEFAULTPRIVATERATE 50
+#define DEFAULTPRIVATEBURST 100
+#define DEFAULTWHORATE 10
+#define DEFAULTWHOBURST 20
+#define RATETOKENUNITS 1000000
+
+// Rooms. Room names start with ROOMPREFIX and are at most MAXROOMNAMELENGTH characters long.
+// A user can be in at most MAXROOMSPERUSER rooms at once.
+#define ROOMPREFIX '#'
+#define MAXROOMNAMELENGTH 64
+#define MAXROOMSPERUSER 32
+
+// Message history. The last BROADCASTHISTORYSIZE messages to everyone and the last
+// ROOMHISTORYSIZE messages of each room are kept. Both must be powers of two.
+#define BROADCASTHISTORYSIZE 1024
+#define ROOMHISTORYSIZE 128
+
+// Message log. The file given by --message-log starts with MESSAGELOGMAGIC, followed by one record per
+// message. The log is synced to disk at most once every MESSAGELOGSYNCINTERVALMS milliseconds, all
+// messages logged in between being written and synced together. On startup the history is restored from at most the last MESSAGELOGRESTORERECORDS records,
+// so restarting takes as long with a large log as with a small one.
+#define MESSAGELOGMAGIC "CHATLOG1"
+#define MESSAGELOGMAGICSIZE 8
+#define MESSAGELOGRESTORERECORDS 65536
+#define MESSAGELOGSYNCINTERVALMS 10
+#define LOGRECORDOVERHEAD 10
+#define LOGRECORDBROADCAST 1
+#define LOGRECORDROOM 2
+
+// Metrics. Latency histograms have 2^LATENCYSUBBUCKETBITS buckets for every power of two of nanoseconds from
+// 2^MINLATENCYEXPONENT ns (256 ns) up to 2^MAXLATENCYEXPONENT ns (about 69 s), plus one bucket below and one above
+// that range, so every bucket is at most a quarter as wide as the values in it. The metrics endpoint given by
+// --metrics-port waits at most METRICSREQUESTTIMEOUTSECONDS for a request.
+#define LATENCYSUBBUCKETBITS 2
+#define MINLATENCYEXPONENT 8
+#define MAXLATENCYEXPONENT 36
+#define LATENCYBUCKETS (((MAXLATENCYEXPONENT - MINLATENCYEXPONENT) << LATENCYSUBBUCKETBITS) + 2)
+#define COMMANDVERBCOUNT (VERB_PONG + 1)
+#define RATECLASSCOUNT RATE_NONE
+#define METRICSREQUESTTIMEOUTSECONDS 1
+
+// Console log. At most CONSOLELOGLINESPERSECOND lines of each reactor are printed each second; the rest are counted
+// and dropped. CONSOLELOGRINGSIZE is the size in bytes of each reactor's ring of lines waiting to be printed.
+#define CONSOLELOGLINESPERSECOND 100
+#define CONSOLELOGRINGSIZE 8192
+
 /* ### Namespace ### */
 using namespace std;
 
 /* ### Data structures ### */
 
+// An immutable, reference counted message as it is sent on the wire. A broadcast is
+// assembled once and the same payload is queued for every receiver, so fan-out costs
+// a reference count increment per receiver instead of an allocation and a copy.
+typedef shared_ptr<const string> sharedPayload;
+
+// What the server does when a client reads slower than messages are queued for him and his
+// outbound queue would exceed its bounds.
+// OVERFLOW_DROP_OLDEST discards the oldest queued messages until the new one fits.
+// OVERFLOW_DISCONNECT disconnects the client.
+// OVERFLOW_COALESCE merges the queued messages into one so the message bound is never hit,
+// and disconnects the client only if the byte bound is exceeded.
+enum overflowPolicy
+{
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_DISCONNECT,
+    OVERFLOW_COALESCE
+};
+
+// How reactor threads wait for and do socket I/O. IO_EPOLL waits for readiness with epoll and makes a syscall for
+// every recv, send and accept. IO_URING hands them to the kernel through an io_uring instead, see RINGENTRIES.
+enum ioBackend
+{
+    IO_EPOLL,
+    IO_URING
+};
+
+// The kinds of io_uring submissions. RING_ACCEPT is the multishot accept of a listening socket, RING_WAKEUP the
+// multishot poll of the mailbox eventfd, RING_RECEIVE the multishot recv of a connection and RING_SEND a sendmsg
+// of a connection's outbound queue.
+enum ringOperation
+{
+    RING_ACCEPT = 1,
+    RING_WAKEUP,
+    RING_RECEIVE,
+    RING_SEND
+};
+
 // There is one configuration for each listening socket. This struct
 // contains the port number and address information which each socket
 // is bound to.
@@ -69,41 +272,601 @@ struct serverConfiguration
 };
 
 // This struct is used to maintain information of a knock-in-progress
-// for a given IP-address. It is used as a value in a map where the
-// keys are IP-addresses trying to connect. timeStarted states when
-// the first connection knock was made. portAttempts is a vector of
-// port numbers that have been attempted.
+// for a given IP-address. It is an entry of the knock table, keyed by
+// the binary IPv6 address of the client, IPv4 clients being mapped to
+// ::ffff:a.b.c.d. startTick states the timer tick at which the first
+// connection knock of the sequence was made. portAttempts holds the
+// attemptCount port numbers that have been attempted. The entries are
+// linked into a list from the oldest to the newest knock by table index.
 struct connectionInProgress
 {
-    vector<int> portAttempts;
-    time_t timeStarted;
+    unsigned char address[KNOCKADDRESSSIZE];
+    bool inUse;
+    int attemptCount;
+    int portAttempts[PORTAMOUNT];
+    uint64_t startTick;
+    int previousByAge;
+    int nextByAge;
+};
+
+// A fixed capacity open addressing hash table of knocks in progress, using
+// linear probing. Memory use does not depend on how many addresses knock,
+// and neither lookups nor insertions allocate. oldestIndex and newestIndex
+// are the ends of the list of entries by age. As every knock has the same
+// window, the oldest one expires first, and expiryTimer is set for it.
+struct knockTable
+{
+    struct connectionInProgress entries[KNOCKTABLECAPACITY];
+    int oldestIndex;
+    int newestIndex;
+    int entryCount;
+    uint32_t expiryTimer;
+};
+
+// What a timer is for. TIMER_KEEPALIVE is a connection's keepalive timer, owned by the connection's slot.
+// TIMER_KNOCKS expires the oldest knocks of the knock table.
+enum timerKind
+{
+    TIMER_KEEPALIVE,
+    TIMER_KNOCKS
+};
+
+// A timer in a reactor's timer wheel, which fires at expiryTick. An armed timer is linked into the list of
+// its wheel slot by index, so it is scheduled and cancelled in constant time.
+struct timerEntry
+{
+    uint64_t expiryTick;
+    uint32_t previous;
+    uint32_t next;
+    uint32_t wheelSlot;
+    bool armed;
+    enum timerKind kind;
+    uint32_t owner;
+};
+
+// A hierarchical timer wheel. slotHeads holds the first timer of every slot, level by level. A timer is in
+// the first level if it fires within TIMERWHEELSLOTS ticks, else in the highest level whose slots are
+// shorter than the time left, and it is moved down a level when the wheel reaches the start of its slot.
+// currentTick is the next tick to be processed. Timers are recycled through freeEntries.
+struct timerWheel
+{
+    vector<struct timerEntry> entries;
+    vector<uint32_t> freeEntries;
+    uint32_t slotHeads[TIMERWHEELLEVELS * TIMERWHEELSLOTS];
+    uint64_t currentTick;
+    size_t armedCount;
+};
+
+// A room a user has joined and his position in the room's member array.
+struct roomMembership
+{
+    string roomName;
+    uint32_t memberIndex;
 };
 
 // Each user which has made a connection is allocated an instance of
 // this struct. It can be used to find out what socketFd belongs to
 // a userName and vice versa. isReceiving tells the server whether a
-// chatUser should be sent messages.
+// chatUser should be sent messages. The remaining fields are maintained
+// by the user registry: generation is bumped every time the slot is
+// released, and receivingIndex is the user's position in the registry's
+// array of receiving users, or -1 if he is not receiving. rooms lists the
+// rooms the user has joined. broadcastSequence is the sequence number of
+// the first message to everyone he has not been sent yet: while he is not
+// receiving it marks where he logged in, afterwards it keeps him from
+// being sent a message twice when he catches up on the history.
 struct chatUser
 {
-    string userName;
+    char userName[MAXUSERNAMELENGTH + 1];
     bool isReceiving;
     int socketFd;
+    bool inUse;
+    uint32_t generation;
+    int receivingIndex;
+    vector<struct roomMembership> rooms;
+    uint64_t broadcastSequence;
+};
+
+// The members of a room connected to one reactor thread, as a dense array of their
+// registry slots. A message to the room only visits these users.
+struct roomSubscribers
+{
+    vector<uint32_t> memberSlots;
+};
+
+// The most recent messages of a channel, as the ready-to-send payloads. Every message is
+// numbered in order, and the message with sequence number s is kept in entries[s % size]
+// until it is overwritten. nextSequence is the number the next message gets. Replaying
+// the history only copies the payload pointers.
+struct messageHistory
+{
+    vector<sharedPayload> entries;
+    uint64_t nextSequence;
+};
+
+// A room with members. reactorMask is the set of reactor threads which have members in the
+// room, one bit per reactor. The room exists while any bit is set, and rooms restored from
+// the message log exist until their last member after the restart leaves.
+struct roomEntry
+{
+    uint64_t reactorMask;
+    struct messageHistory history;
+};
+
+// One shard of the room directory, mapping room names to their entries.
+struct roomShard
+{
+    mutex shardMutex;
+    unordered_map<string, struct roomEntry> rooms;
+};
+
+// Identifies a user in the registry. The handle stays valid while the user is
+// connected, and a handle to a user which has since left is detected by its
+// generation no longer matching the slot's.
+struct userHandle
+{
+    uint32_t slotIndex;
+    uint32_t generation;
+};
+
+// Contains the users connected to one reactor thread. Users live in slots
+// which are recycled through freeSlots when a user leaves, so a user never
+// moves while he is connected. slotBySocketFd is indexed by socket file
+// descriptor and gives the user's slot, or NOSLOT, without hashing or
+// allocating. Lookup by username goes through the user directory.
+// receivingUsers is a dense array of the slots of users with isReceiving
+// set, so a broadcast only visits those users.
+struct userRegistry
+{
+    vector<chatUser> slots;
+    vector<uint32_t> freeSlots;
+    vector<uint32_t> slotBySocketFd;
+    vector<uint32_t> receivingUsers;
+};
+
+// A snapshot of a connection's outbound queue, published by the reactor owning the
+// connection so STATS can read it from any reactor thread.
+struct queueCounters
+{
+    atomic<size_t> queuedMessages;
+    atomic<size_t> queuedBytes;
+    atomic<size_t> peakQueuedMessages;
+    atomic<uint64_t> droppedMessages;
+};
+
+// Where a connected user can be found: the index of the reactor thread which owns
+// his connection and his handle in that reactor's registry.
+struct directoryEntry
+{
+    int reactorIndex;
+    struct userHandle handle;
+    shared_ptr<struct queueCounters> counters;
+};
+
+// A username stored inline and null terminated. It is the user directory's key, so claiming
+// and looking up a name does not allocate.
+struct userNameKey
+{
+    char text[MAXUSERNAMELENGTH + 1];
+};
+
+// Hashes a userNameKey for the user directory.
+struct userNameKeyHash
+{
+    size_t operator()(const struct userNameKey &key) const { return hash<string_view>()(key.text); }
+};
+
+// Compares two userNameKeys for the user directory.
+struct userNameKeyEqual
+{
+    bool operator()(const struct userNameKey &a, const struct userNameKey &b) const { return strcmp(a.text, b.text) == 0; }
+};
+
+// The entries of one user directory shard. Its nodes come from the shard's entryPool.
+typedef pmr::unordered_map<struct userNameKey, struct directoryEntry, userNameKeyHash, userNameKeyEqual> userDirectoryMap;
+
+// Positions of the usernames in the user list. Its nodes come from the list's indexPool.
+typedef pmr::unordered_map<struct userNameKey, uint32_t, userNameKeyHash, userNameKeyEqual> userIndexMap;
+
+// A login or logout, as recorded in the user list. joined is false for a logout.
+struct userListChange
+{
+    bool joined;
+    struct userNameKey userName;
+};
+
+// The names of the users logged in on any reactor thread, kept up to date on every login and
+// logout so WHO never has to go through the user directory. names is dense; a name which is
+// removed is replaced by the last one, and indexByName gives the position of each name.
+// version is bumped on every change, and the change which made version v is kept in
+// changes[v % USERLISTCHANGES] until it is overwritten. replyText is every name separated by
+// spaces, in the order they logged in; a login appends to it and a logout cuts the name out,
+// so it never has to be assembled from names. cachedReply is the reply to a plain WHO as of
+// cachedVersion, so WHO only copies replyText once per change.
+struct userList
+{
+    mutex listMutex;
+    vector<struct userNameKey> names;
+    pmr::unsynchronized_pool_resource indexPool;
+    userIndexMap indexByName{&indexPool};
+    uint64_t version;
+    struct userListChange changes[USERLISTCHANGES];
+    string replyText;
+    sharedPayload cachedReply;
+    uint64_t cachedVersion;
+};
+
+// One shard of the user directory, mapping usernames to directory entries. A username
+// always hashes to the same shard, so claiming a name is atomic across reactor threads.
+// The nodes of users who have left are kept in entryPool and reused for the next users
+// to log in, so logging in and out allocates nothing once the pool has grown. The pool
+// is guarded by shardMutex like the map.
+struct directoryShard
+{
+    mutex shardMutex;
+    pmr::unsynchronized_pool_resource entryPool;
+    userDirectoryMap entries{&entryPool};
+};
+
+// The classes of commands which are rate limited, see RATETOKENUNITS. Messages to everyone and to rooms are
+// broadcasts, as they fan out to many users. RATE_NONE is the class of the commands which are not limited.
+enum rateClass
+{
+    RATE_BROADCAST,
+    RATE_PRIVATE,
+    RATE_WHO,
+    RATE_CHANGEID,
+    RATE_NONE
+};
+
+// A class's rate limit as given: up to burst commands at once and perSecond more every second, perSecond 0
+// meaning no limit. unitsPerTick and capacity are the same in RATETOKENUNITS per timer tick and in total.
+struct rateLimit
+{
+    double perSecond;
+    int burst;
+    uint64_t unitsPerTick;
+    uint64_t capacity;
+};
+
+// A connection's token bucket for one rate class. It is refilled when a command of the class arrives, by
+// what it has earned since lastRefillTick, so it needs no timer.
+struct tokenBucket
+{
+    uint64_t units;
+    uint64_t lastRefillTick;
+};
+
+// A growable ring buffer holding the bytes received from a client which have not
+// yet been parsed into complete frames. The capacity of storage is always a power
+// of two. readIndex and writeIndex only ever increase and are masked on access,
+// so writeIndex - readIndex is the number of buffered bytes.
+struct inputRingBuffer
+{
+    vector<char> storage;
+    size_t readIndex;
+    size_t writeIndex;
+};
+
+// Every socket which has passed the knocking sequence gets an instance of
+// this struct from its reactor's connection pool. The pool is indexed by
+// socket file descriptor so a readiness event can be matched to its connection
+// without scanning. readBuffer holds partially received frames between reads.
+// outboundQueue holds messages waiting to be sent, of which headBytesSent
+// bytes of the first one have already been sent. queuedBytes is the unsent
+// total. The remaining counters are reported by STATS. flushScheduled is set
+// while the connection waits in pendingFlushes. A connection which is closing
+// will be disconnected once the current batch of events has been processed
+// and is not sent anything more. binaryProtocol is set once the connection
+// has logged in with CONNECT <name> BINARY, from when on it sends binary frames.
+// With io_uring, receiveArmed is set while the connection's multishot recv is
+// in the ring and sendInFlight while a sendmsg of its first messagesInFlight
+// queued messages is, which are then not dropped. ringSend holds that sendmsg's
+// arguments. A connection closed while either is set stays released, keeping
+// its slot and queue, until both have completed. lastActivityTick is the timer
+// tick at which the client last sent something, and pingSent is set once it
+// has been sent PING since. keepaliveTimer is the slot's keepalive timer.
+// rateBuckets holds a token bucket for every rate class.
+struct clientConnection
+{
+    int socketFd;
+    bool closing;
+    bool flushScheduled;
+    bool binaryProtocol;
+    bool receiveArmed;
+    bool sendInFlight;
+    bool released;
+    size_t messagesInFlight;
+    unique_ptr<struct ringSend> ringSend;
+    struct inputRingBuffer readBuffer;
+    deque<sharedPayload> outboundQueue;
+    size_t headBytesSent;
+    size_t queuedBytes;
+    size_t peakQueuedMessages;
+    uint64_t droppedMessages;
+    shared_ptr<struct queueCounters> publishedCounters;
+    struct tokenBucket rateBuckets[RATECLASSCOUNT];
+    uint64_t lastActivityTick;
+    bool pingSent;
+    uint32_t keepaliveTimer;
+};
+
+// Handles a binary command, given its header and payload, for the connection <socketFd>.
+typedef void (*binaryCommandHandler)(const struct binaryHeader *header, string_view payload, int socketFd);
+
+// An entry of the binary protocol's dispatch table, indexed by opcode. verb is the verb the command is counted as,
+// and rateClass the class it is rate limited as.
+struct binaryCommand
+{
+    enum commandVerb verb;
+    enum rateClass rateClass;
+    binaryCommandHandler handler;
+};
+
+// The arguments of a connection's sendmsg in an io_uring. They are kept apart from the connection, as the pool the
+// connection lives in may move it while the send is in flight.
+struct ringSend
+{
+    struct msghdr messageHeader;
+    struct iovec messageVectors[MAXIOVECSPERSEND];
+};
+
+// A reactor thread's io_uring, set up with raw system calls. The submission and completion queues are shared with
+// the kernel through ringMemory and the submission entries through entryMemory. submissionTail is the tail the next
+// entry is written at, which the kernel only sees once enterRing stores it. bufferRing holds the receive buffers in
+// receiveBuffers the kernel may pick from, and bufferRingTail is its tail.
+struct ioRing
+{
+    int ringFileDescriptor;
+    void *ringMemory;
+    size_t ringMemorySize;
+    void *entryMemory;
+    size_t entryMemorySize;
+
+    unsigned *submissionHead;
+    unsigned *submissionTailPointer;
+    unsigned submissionMask;
+    unsigned submissionEntries;
+    unsigned *submissionArray;
+    struct io_uring_sqe *submissionQueueEntries;
+    unsigned submissionTail;
+
+    unsigned *completionHead;
+    unsigned *completionTail;
+    unsigned completionMask;
+    struct io_uring_cqe *completionQueueEntries;
+
+    struct io_uring_buf_ring *bufferRing;
+    size_t bufferRingSize;
+    char *receiveBuffers;
+    unsigned short bufferRingTail;
+};
+
+// A fortune in the memory-mapped fortune corpus.
+struct fortuneEntry
+{
+    const char *text;
+    size_t length;
+};
+
+// A message waiting to be written to the message log. kind is LOGRECORDBROADCAST or LOGRECORDROOM, and
+// roomName is empty for a message to everyone. On disk a record is laid out thus, lengths in host byte order:
+// [uint32 record length][uint8 kind][uint8 room name length][room name][message][uint32 record length].
+// The message is logged without the reply header of payload. The length is repeated at the end so the log
+// can be read backwards from its end.
+struct logRecord
+{
+    uint8_t kind;
+    string roomName;
+    sharedPayload payload;
+};
+
+// A histogram of latencies in nanoseconds, see LATENCYBUCKETS. It is written by one reactor thread only.
+struct latencyHistogram
+{
+    atomic<uint64_t> buckets[LATENCYBUCKETS];
+    atomic<uint64_t> totalNanoseconds;
+};
+
+// The counters of one reactor thread, reported by the metrics endpoint. Only the reactor itself writes them, with
+// a plain load and store instead of a locked increment, so counting costs next to nothing. The metrics thread
+// adds up the counters of all reactors. queuedMessages and queuedBytes are the totals of the reactor's outbound
+// queues. With io_uring, receiveCalls and sendCalls count the recvs completed and sendmsgs submitted, and
+// ringEnterCalls the io_uring_enter calls which handed them to the kernel. commandLatency is the time spent
+// handling a command, not counting sending the reply, and fanoutLatency the time spent queueing a message to
+// everyone or to a room for the reactor's receivers. pingsSent and idleDisconnects count the keepalive's PINGs
+// and the connections it has closed, and rateLimitedCommands the commands refused by each rate class's limit.
+struct reactorMetrics
+{
+    atomic<uint64_t> knocks;
+    atomic<uint64_t> failedKnocks;
+    atomic<uint64_t> connectionsOpened;
+    atomic<uint64_t> connectionsClosed;
+    atomic<uint64_t> commands[COMMANDVERBCOUNT];
+    atomic<uint64_t> receiveCalls;
+    atomic<uint64_t> bytesReceived;
+    atomic<uint64_t> sendCalls;
+    atomic<uint64_t> bytesSent;
+    atomic<uint64_t> ringEnterCalls;
+    atomic<int64_t> queuedMessages;
+    atomic<int64_t> queuedBytes;
+    atomic<uint64_t> droppedMessages;
+    atomic<uint64_t> pingsSent;
+    atomic<uint64_t> idleDisconnects;
+    atomic<uint64_t> rateLimitedCommands[RATECLASSCOUNT];
+    struct latencyHistogram commandLatency;
+    struct latencyHistogram fanoutLatency;
+};
+
+// Lines waiting to be printed by the console log thread. Each reactor writes to a ring of its own, which only the
+// console log thread reads, so a reactor logging a line never waits for another thread. The bytes between
+// readIndex and writeIndex, both counted from the start, are lines not yet printed. lineSecond is the second the
+// last linesThisSecond lines were logged in, and suppressedLines the number of lines dropped in total for going
+// over CONSOLELOGLINESPERSECOND or for finding the ring full.
+struct consoleLogRing
+{
+    char bytes[CONSOLELOGRINGSIZE];
+    atomic<uint64_t> writeIndex;
+    atomic<uint64_t> readIndex;
+    time_t lineSecond;
+    int linesThisSecond;
+    atomic<uint64_t> suppressedLines;
+};
+
+// The kinds of work one reactor thread can hand to another.
+// MAILBOX_ADOPT_CONNECTION gives the receiving reactor a socket which has just passed the knocking sequence.
+// MAILBOX_BROADCAST asks it to send payload to all of its receiving users.
+// MAILBOX_PRIVATE_MESSAGE asks it to send payload to the user with the given handle.
+// MAILBOX_ROOM_MESSAGE asks it to send payload to its members of the room roomName.
+enum mailboxItemType
+{
+    MAILBOX_ADOPT_CONNECTION,
+    MAILBOX_BROADCAST,
+    MAILBOX_PRIVATE_MESSAGE,
+    MAILBOX_ROOM_MESSAGE
+};
+
+// An entry in a reactor thread's mailbox. Items are linked through next. sequence
+// is the history sequence number of a broadcast. Items are reused: owner is the reactor
+// whose pool the item was taken from, and which it is given back to once processed.
+struct mailboxItem
+{
+    enum mailboxItemType type;
+    int socketFd;
+    struct userHandle receiver;
+    string roomName;
+    sharedPayload payload;
+    uint64_t sequence;
+    struct reactorThread *owner;
+    struct mailboxItem *next;
+};
+
+// Each reactor thread runs its own event loop over its own connections and users.
+// Reactor 0 runs on the main thread and additionally owns the three listening sockets
+// and the knocking map. Connections which pass the knocking sequence are handed to the
+// reactors in turn. Other threads send work to a reactor by pushing it onto mailboxHead,
+// a lock-free multi-producer single-consumer stack, and writing to wakeupFileDescriptor,
+// an eventfd its epoll instance watches, if the stack was empty.
+struct reactorThread
+{
+    int reactorIndex;
+
+    // The epoll instance the server loop waits on. Reactor 0's initially watches the three
+    // listening sockets but subsequent client socket descriptors will be added to it.
+    // All descriptors are registered edge-triggered, so every readiness event must be
+    // drained until the socket reports EAGAIN.
+    int epollFileDescriptor;
+    int wakeupFileDescriptor;
+
+    // The reactor's io_uring, or NULL if it uses epoll. With io_uring the epoll instance is not used.
+    struct ioRing *ring;
+
+    // The connections currently registered with the epoll instance. They live in slots which
+    // are recycled through freeConnectionSlots when a connection closes, keeping the storage
+    // of their read buffer, outbound queue and counters, so a new connection usually does not
+    // allocate. connectionSlotBySocketFd is indexed by socket file descriptor and gives the
+    // connection's slot, or NOSLOT.
+    vector<struct clientConnection> connectionSlots;
+    vector<uint32_t> freeConnectionSlots;
+    vector<uint32_t> connectionSlotBySocketFd;
+
+    // Registry that contains the users connected to this reactor.
+    struct userRegistry users;
+
+    // The rooms with members connected to this reactor, keyed by room name.
+    unordered_map<string, struct roomSubscribers> rooms;
+
+    // Connections which failed while the server was sending to them. They are disconnected
+    // after the current batch of events, as they may still be referenced by a send loop.
+    vector<int> pendingDisconnects;
+
+    // Connections which have had messages queued during the current batch of events. Their
+    // queues are flushed once the batch has been processed, so everything queued for one
+    // connection in a batch goes out in as few sendmsg() calls as possible.
+    vector<int> pendingFlushes;
+
+    // The reactor's timers. The server loop waits no longer than until the next one is due.
+    struct timerWheel timers;
+
+    atomic<struct mailboxItem *> mailboxHead;
+
+    // The reactor's pool of mailbox items, so posting allocates nothing once the pool has grown.
+    // freeMailboxItems is only used by the reactor itself. The reactors which process its items
+    // push them onto returnedMailboxItems, a lock-free stack the reactor empties in one go when
+    // freeMailboxItems runs out.
+    struct mailboxItem *freeMailboxItems;
+    atomic<struct mailboxItem *> returnedMailboxItems;
+
+    struct reactorMetrics metrics;
 };
 
 /* ### Global variables ### */
 
-// This map uses the IP-address of an incoming connection as a key while
-// its value is the struct described above.
-map<string, struct connectionInProgress> portKnockingMap;
+// This table uses the IP-address of an incoming connection as a key while
+// its value is the struct described above. Only used by reactor 0.
+struct knockTable portKnockingTable;
 
-// Vector that contains the users currently connected to the server.
+// Directory of the users currently connected to the server, across all reactor threads.
 // Each user contains a unique username and a unique socket file descriptor.
-vector<chatUser> currentUsers;
+struct directoryShard userDirectory[USERDIRECTORYSHARDS];
+
+// Directory of the rooms which have members, across all reactor threads. It uses the same
+// number of shards as the user directory.
+struct roomShard roomDirectory[USERDIRECTORYSHARDS];
+
+// The names of the users connected to any reactor thread, for WHO.
+struct userList connectedUsers;
+
+// The history of messages to everyone, shared by all reactor threads.
+mutex broadcastHistoryMutex;
+struct messageHistory broadcastHistory;
+
+// The message log given by --message-log, or -1 if messages are not logged. Reactor threads only add
+// records to pendingLogRecords; the log writer thread writes them out and syncs them in batches.
+// messageLogSize is the length of the log up to the end of its last complete record, and is only changed by
+// the log writer once the server runs. messageLogStopped is set if the log could not be kept whole, after which
+// nothing more is logged.
+string messageLogPath;
+int messageLogDescriptor = -1;
+size_t messageLogSize = 0;
+mutex messageLogMutex;
+condition_variable messageLogCondition;
+vector<struct logRecord> pendingLogRecords;
+bool messageLogStopped = false;
 
 // The server's id. Used to get bonus points.
 // Can be viewed by the client.
 // The client can regenerate a new one as well.
-string Id;
+// It is kept as the ready-to-send reply to ID and replaced as a whole with atomic_store,
+// so reactor threads read it with atomic_load and never wait for a new one to be made.
+sharedPayload idPayload;
+
+// Requests to change the Id are handed to a worker thread, as getting a fortune cookie may
+// mean running an external program. Only the latest request is kept; requests made while
+// the worker is busy are merged into one.
+mutex idRequestMutex;
+condition_variable idRequestCondition;
+bool idRequestPending = false;
+string idRequestGroupInitials;
+
+// Short fortunes from the corpus given by --fortune-file, or the first default corpus found.
+// The file is memory-mapped once at startup. When no corpus is available the fortune
+// program is run instead.
+vector<struct fortuneEntry> fortuneCorpus;
+string fortuneFilePath;
+
+// The rate limit of every rate class, given by --rate-limit and --change-id-interval. Their units are filled in
+// once the arguments have been parsed.
+struct rateLimit rateLimits[RATECLASSCOUNT] = {
+    {DEFAULTBROADCASTRATE, DEFAULTBROADCASTBURST, 0, 0},
+    {DEFAULTPRIVATERATE, DEFAULTPRIVATEBURST, 0, 0},
+    {DEFAULTWHORATE, DEFAULTWHOBURST, 0, 0},
+    {1.0 / DEFAULTCHANGEIDINTERVAL, 1, 0, 0}
+};
+
+// Seconds of silence after which a connection is sent PING and disconnected, or 0 for never.
+int pingInterval = DEFAULTPINGINTERVAL;
+int idleTimeout = DEFAULTIDLETIMEOUT;
 
 // The three ports this server listens to.
 // The main port which will be used if the knocking sequence
@@ -111,469 +874,3786 @@ string Id;
 // the knock process.
 int portA, portB, portC;
 
-// This file descriptor set contains the socket file descriptors currently
-// set on this server. It initially contains the three listening sockets but
-// subsequent client socket descriptors will be added to it.
-fd_set mainFileDescriptorSet;
+// Ports given with --ports, or 0 if the ports are allocated from PORTLOWERBOUND to PORTUPPERBOUND. With
+// --reuse-port the listening sockets are bound with SO_REUSEPORT. The chosen ports are written to the file
+// given with --port-file, if any.
+int requestedPorts[PORTAMOUNT] = {0, 0, 0};
+bool reusePort = false;
+string portFilePath;
+
+// The listen backlog of the listening sockets.
+int listenBacklog = DEFAULTLISTENBACKLOG;
+
+// The loopback port the metrics endpoint listens on, given by --metrics-port, or 0 if there is none.
+int metricsPort = 0;
+
+// The console log rings, one for each reactor by reactor index and, last, one shared by all other threads, which
+// take consoleLogMutex to write to it. The console log thread sleeps reading consoleLogWakeupFileDescriptor, an
+// eventfd, after setting consoleLoggerWaiting, and a thread which logs a line while it is set writes to it.
+struct consoleLogRing consoleLogRings[MAXREACTORTHREADS + 1];
+mutex consoleLogMutex;
+int consoleLogWakeupFileDescriptor = -1;
+atomic<bool> consoleLoggerWaiting;
+
+// The reactor threads and the one running on the current thread.
+int reactorCount = 1;
+vector<struct reactorThread *> reactors;
+thread_local struct reactorThread *localReactor;
+
+// The reactor the next connection to pass the knocking sequence is handed to.
+// Only used by reactor 0.
+int nextReactorIndex = 0;
+
+// The I/O backend given by --io-backend. Reactors whose io_uring cannot be set up use epoll.
+enum ioBackend requestedIoBackend = IO_EPOLL;
+
+// Bounds of every connection's outbound queue and what to do when they are exceeded.
+size_t maxQueuedMessages = DEFAULTMAXQUEUEDMESSAGES;
+size_t maxQueuedBytes = DEFAULTMAXQUEUEDBYTES;
+enum overflowPolicy queueOverflowPolicy = OVERFLOW_DROP_OLDEST;
 
 /* ### Server/Client communication functions ### */
 
 // Processes input from already connected clients. This is essentially the server's API. API commands are
-// interpreted here and corresponding function calls are made.
-void checkAPI(string input, int socketFileDescriptor);
+// parsed in place, without copying <input>, and corresponding function calls are made.
+void checkAPI(string_view input, int socketFileDescriptor);
 
 // Is used in a few cases. Sends a message to <clientSocketDescriptor> whether an action failed or not.
 void sendFeedback(bool success, int clientSocketDescriptor);
 
+// Returns <text> as a reply.
+sharedPayload makeReply(string_view text);
+
+// Returns <text> as a message from another user.
+sharedPayload makeMessage(string_view text);
+
 // This function generates new server id. The fortune and timestamp are generated automatically but the
-// client can pick the groupInitials himself.
+// client can pick the groupInitials himself. Blocks while the fortune is made, so it is only called on startup
+// and by the Id worker thread.
 void setId(string groupInitials);
 
+// Asks the Id worker thread to generate a new server id with <groupInitials>. Returns immediately.
+void requestIdChange(const string &groupInitials);
+
 // This function gets called when the client requests info the server Id. It simply sends the current Id to him.
 void sendIdToClient(int clientSocketDescriptor);
 
-// This function takes the vector of current users, parses the contents into a single white-space separated list
-// of usernames and sends to the client.
-void sendUserListToClient(int clientSocketDescriptor);
+// Sends the client the names of the logged in users. A plain WHO is answered with all of them, separated by spaces.
+// WHO <offset> <count> is answered with a page of the list and WHO SINCE <version> with the changes since that
+// version of the list, see appendUserListPage and appendUserListChanges.
+void sendUserListToClient(int clientSocketDescriptor, string_view argument, string_view text);
 
 // This function loops through all active users, excluding the sender, and sends them message.
-void sendMessageToAllUsers(string message, int clientSocketDescriptor);
+void sendMessageToAllUsers(string_view message, int clientSocketDescriptor);
+
+// This function finds user with socketFd == clientSocketDescriptor and sends him message. Returns false if
+// there is no user named <receivingUser>.
+bool sendMessageToUser(string_view message, int clientSocketDescriptor, string_view receivingUser);
+
+// Sends message to the user with the handle <receiver> on reactor <reactorIndex>. Nothing is sent if he has left.
+void sendMessageToHandle(string_view message, int clientSocketDescriptor, int reactorIndex, struct userHandle receiver);
 
-// This function finds user with socketFd == clientSocketDescriptor and sends him message.
-void sendMessageToUser(string message, int clientSocketDescriptor, string receivingUser);
+// Sends message to every member of <roomName> except the sender, who must be a member himself. Returns false
+// if he is not.
+bool sendMessageToRoom(string_view message, int clientSocketDescriptor, string_view roomName);
 
-// This function removes the user from the main file descriptor set and closes his connection.
+// Sends the client the last <count> messages to everyone, or, if <roomName> is not empty, the last <count>
+// messages of that room, which he must be a member of.
+void sendHistoryToClient(int clientSocketDescriptor, string_view roomName, string_view count);
+
+// This function removes the user from the epoll instance and closes his connection.
 void disconnectUser(int socketFileDescriptor);
 
-/* ### Server-side private functions ### */
+// Sends the outbound queue statistics of every connected user to the client, one user per line.
+void sendQueueStatsToClient(int clientSocketDescriptor);
 
-// This function is only called once upon server initialization. It is used to dynamically allocate listening ports
-// for the server. It scans the ports on the local machine for closed ports. When three consecutive closed ports
-// are found, the global port variables are set and the function terminates. It also configures the addresses as well
-// as binding them to the listening sockets. Finally, it makes the sockets non-blocking and sets their listening flags.
-void initializeServer(struct serverConfiguration *configurations);
+// Sends the client "USER <userName> <id>" with the user id of <userName>, or FAIL if no such user is connected.
+void sendUserIdToClient(int clientSocketDescriptor, string_view userName);
 
-// This function is called when the same IP address has made the third knock. It reads its port attempt vector and
-// determines if the sequence is correct.
-bool checkPortSequence(vector<int> ports);
+/* ### Binary protocol functions ### */
 
-// Is used by checkAPI to split input strings from client thus: ABCDEFGH... A, B, CDEFGH...
-// Is useful to interpret the API commands, to e.g. separate the actual message from the MSG <USER> command.
-void splitString(vector<string> &inputCommands, string input);
+// Processes a binary command from a client which has logged in with CONNECT <name> BINARY. The command is dispatched
+// by its opcode through a table, so nothing is parsed but the fixed-layout header.
+void checkBinaryAPI(const struct binaryHeader *header, string_view payload, int socketFileDescriptor);
 
-// This is used when making sure that we do not create > 1 users with the same user name.
-// Also used to make sure that messages are not sent to non-existent users.
-bool userExists(string user);
+// BINARY_MSG_ALL: sends the payload to everyone.
+void binaryMessageToAll(const struct binaryHeader *header, string_view payload, int socketFd);
 
-// Server start point.
-int main(int argv, char *args[])
-{
-    // Each socket has one configuration.
-    serverConfiguration configurations[3];
+// BINARY_MSG_USER: sends the payload to the user with the header's user id.
+void binaryMessageToUser(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // Open the sockets endpoint for incoming connections and make them non-blocking.
-    configurations[SOCKET01].serverSocketDescriptor = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    configurations[SOCKET02].serverSocketDescriptor = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    configurations[SOCKET03].serverSocketDescriptor = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+// BINARY_MSG_ROOM: sends the message in the payload to the room named in front of it.
+void binaryMessageToRoom(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // Make the sockets reusable.
-    int q = 1;
-    setsockopt(configurations[SOCKET01].serverSocketDescriptor, SOL_SOCKET, SO_REUSEADDR, &q, sizeof(q));
-    setsockopt(configurations[SOCKET02].serverSocketDescriptor, SOL_SOCKET, SO_REUSEADDR, &q, sizeof(q));
-    setsockopt(configurations[SOCKET03].serverSocketDescriptor, SOL_SOCKET, SO_REUSEADDR, &q, sizeof(q));
+// BINARY_WHO: sends the names of everyone logged in.
+void binaryUserList(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // Dynamically allocate three consecutive port numbers.
-    initializeServer(configurations);
+// BINARY_ID: sends the server id.
+void binaryId(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // Set the inital server Id with hardcoded group initials.
-    setId("THSS");
+// BINARY_RECV: puts the user in receive mode.
+void binaryReceive(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // We will use file descriptor sets to maintain our incoming socket connections
-    // The set main is our main file descriptor set. We start by zeroing it out.
-    FD_ZERO(&mainFileDescriptorSet);
+// BINARY_LEAVE: disconnects the user.
+void binaryLeave(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // Add our listening sockets to the set.
-    FD_SET(configurations[SOCKET01].serverSocketDescriptor, &mainFileDescriptorSet);
-    FD_SET(configurations[SOCKET02].serverSocketDescriptor, &mainFileDescriptorSet);
-    FD_SET(configurations[SOCKET03].serverSocketDescriptor, &mainFileDescriptorSet);
+// BINARY_LOOKUP: sends the user id of the user named by the payload.
+void binaryLookup(const struct binaryHeader *header, string_view payload, int socketFd);
 
-    // This address variable is used to peek at incoming connection requests during
-    // the knocking sequence. To access the IP address in order to use it as a key
-    // for the port knocking map.
-    struct sockaddr_in connectingClientAddress;
-    socklen_t connectingClientAddressSize = sizeof connectingClientAddress;
+/* ### Rate limit functions ### */
 
-    // Server loop. Loops continuously and processes connection requests.
-    while (true) {
-        // The select() function alters our main set. Thus we must
-        // keep a copy of it for every iteration of the loop.
-        fd_set mainFileDescriptorSetBackup = mainFileDescriptorSet;
+// Returns the rate class of a parsed text command. MSG counts as a broadcast when it is sent to ALL or to a room.
+enum rateClass rateClassOf(const struct parsedCommand *command);
 
-        // We use select() to handle connections from multiple clients. If a new connection
-        // passes the port knocking, it is accepted and the client's socket file descriptor
-        // is added to the fd_set. It returns when one or more descriptor in the set is ready
-        // to be read.
-        if (select(FD_SETSIZE, &mainFileDescriptorSetBackup, NULL, NULL, NULL) < 0) {
-            perror("SELECT error");
-            exit(1);
-        }
+// Takes a token from the bucket of <rateClass> of the connection <socketFd>, refilling it first, and returns true
+// if there was one. Otherwise the command is counted as rate limited and the client is sent RATE LIMITED and the
+// class's name, a reply made once and shared, so refusing a flood of commands costs next to nothing.
+bool allowCommand(int socketFd, enum rateClass rateClass);
 
-        // One ore more socket descriptors are ready to read. Next step is to loop through the
-        // fd_set and check which ones they are.
-        for (int i = 0; i < FD_SETSIZE; i++) {
-            // Check if socket file descriptor i is set in mainFileDescriptorSetBackup.
-            if (FD_ISSET(i, &mainFileDescriptorSetBackup)) {
-                // If i is one of the listening sockets, that means
-                // we have a new connection. One of our listening
-                // sockets has received a connection request.
-                if (i == configurations[SOCKET01].serverSocketDescriptor || i == configurations[SOCKET02].serverSocketDescriptor || i == configurations[SOCKET03].serverSocketDescriptor) {
-                    // Here we determine which port is being knocked.
-                    int portNum;
-                    for (int j = 0; j < PORTAMOUNT; j++) {
-                        if (configurations[j].serverSocketDescriptor == i) {
-                            cout << "Knock at: " << configurations[j].portNumber << endl;
-                            portNum = configurations[j].portNumber;
-                        }
-                    }
-
-                    // We accept the connection. If the port sequence has not be finished or done incorrectly
-                    // this accepted connection will be closed immediately, see below. We need to accept it
-                    // temporarily during the knocking sequence to access the client's IP address in order to
-                    // maintain his knock sequence status in the knocking map.
-                    // The knocking sequence is portA -> portC -> portB
-                    // Once a correct knocking sequence has been made, the last knock must have been on portB
-                    // (SOCKET02), in that case the connection will not be closed but kept open on that port.
-                    int newClientSocketDescriptor = accept(i, (struct sockaddr *)&connectingClientAddress, &connectingClientAddressSize);
-                    string clientIpAddress = (string)(inet_ntoa(connectingClientAddress.sin_addr));
-
-                    // If the client address is trying to connect for the first time,
-                    // the starting time is set for this IP address.
-                    if (portKnockingMap.count(clientIpAddress) == 0) { time(&portKnockingMap[clientIpAddress].timeStarted); }
-
-                    // The port knocking sequence must be performed within 2 minutes. Here we are
-                    // measuring the elapsed time sinced first knock.
-                    time_t timeNow;
-                    time(&timeNow);
-                    double elapsedTimeInSec = difftime(timeNow, portKnockingMap[clientIpAddress].timeStarted);
-
-                    // If time since the first time the client connected is more or equal then 120 sec(2 min), a message
-                    // is sent to the client that a timeout has occured.
-                    if (elapsedTimeInSec >= 120) {
-                        char fail[MINBUFFERSIZE] = "TIMEOUT FAIL";
-                        send(newClientSocketDescriptor, fail, sizeof fail, 0);
-                        close(newClientSocketDescriptor);
-                        portKnockingMap[clientIpAddress].portAttempts.clear();
-                        break;
-                    }
-
-                    // Insert the client address trying to connect to the map
-                    // and push the port number attempt into its vector.
-                    portKnockingMap[clientIpAddress].portAttempts.push_back(portNum);
-
-                    // If number of attempts are 3 it is time to check if the knocking sequence
-                    // is correct, and send the client a success or failure message of the matter.
-                    if (portKnockingMap[clientIpAddress].portAttempts.size() == PORTAMOUNT) {
-
-                        // If the sequence is correct the client file descriptor is added to the set
-                        // of file descriptors to read from, and a success message is sent to the client.
-                        // Else a fail message is sent.
-                        if (checkPortSequence(portKnockingMap[clientIpAddress].portAttempts)) {
-                            FD_SET(newClientSocketDescriptor, &mainFileDescriptorSet);
-                            cout << "Connected!" << endl;
-                            char welcome[MINBUFFERSIZE] = "KNOCK SUCCESS";
-                            send(newClientSocketDescriptor, welcome, sizeof welcome, 0);
-                        }
-                        else {
-                            char welcome[MINBUFFERSIZE] = "KNOCK FAIL";
-                            send(newClientSocketDescriptor, welcome, sizeof welcome, 0);
-                            close(newClientSocketDescriptor);
-                        }
-
-                        // The vector for this address is cleared so another attempt
-                        // can be made should the client disconnect and reconnect later.
-                        portKnockingMap[clientIpAddress].portAttempts.clear();
-                    }
-                    else {
-                        // The knocking sequence is unfinished. Close connection.
-                        close(newClientSocketDescriptor);
-                    }
-                }
+// Sets a rate class's limit from a --rate-limit argument, CLASS=RATE,BURST. Returns false if it is malformed.
+bool parseRateLimit(const char *argument);
 
-                // If i is not one of the listening sockets, it must be
-                // an outside connection from client already in the fd_set,
-                // containing a message.
-                else if (i != configurations[SOCKET01].serverSocketDescriptor || i != configurations[SOCKET02].serverSocketDescriptor || i != configurations[SOCKET03].serverSocketDescriptor) {
-                    // Receive message from client i.
-                    char receiveBuffer[XXLARGEBUFFERSIZE];
-                    int bytesReceived = recv(i, receiveBuffer, sizeof receiveBuffer, 0);
+// Works out the units of every rate class's limit from its rate and burst.
+void computeRateLimitUnits();
 
-                    // The message will be interpreted and proccessed in checkAPI.
-                    checkAPI(receiveBuffer, i);
-                }
-            }
-        }
-    }
+/* ### Server-side private functions ### */
 
-    // Close connections before termination.
-    for (size_t i = 0; i < currentUsers.size(); i++) {
-       close(currentUsers[i].socketFd);
-    }
+// This function is only called once upon server initialization. It opens the listening sockets and binds them to the
+// ports given with --ports, or else to the first three consecutive ports from PORTLOWERBOUND on which can be bound.
+// The global port variables are set and the ports are written to the port file. Exits if the sockets cannot be bound.
+void initializeServer(struct serverConfiguration *configurations);
 
-    FD_ZERO(&mainFileDescriptorSet);
+// Opens a non-blocking listening socket for <configuration>, binds it to <port> and sets it listening. Returns false,
+// leaving no socket open, if the port cannot be bound or listened on.
+bool bindListeningSocket(struct serverConfiguration *configuration, int port);
 
-    return 0;
-}
+// Writes the three ports to the port file as "portA portB portC", the order the client takes them in. The file is
+// replaced as a whole, so a reader never sees it half written.
+void writePortFile();
 
-/* ### Server/Client communication functions ### */
+// This function is called when the same IP address has made the third knock. It reads its port attempt array and
+// determines if the sequence is correct.
+bool checkPortSequence(const int *ports);
 
-// Processes input from already connected clients. This is essentially the server's API. API commands are
-// interpreted here and corresponding function calls are made.
-void checkAPI(string input, int socketFileDescriptor) {
-    vector<string> inputCommands;
-    splitString(inputCommands, input);
-
-    if (inputCommands[0] == "ID") { sendIdToClient(socketFileDescriptor); }
-    else if (inputCommands[0] == "LEAVE") { disconnectUser(socketFileDescriptor); }
-    else if (inputCommands[0] == "WHO") { sendUserListToClient(socketFileDescriptor); }
-    else if (inputCommands[0] == "MSG" && userExists(inputCommands[1])) { sendMessageToUser(inputCommands[2], socketFileDescriptor, inputCommands[1]); }
-    else if (inputCommands[0] == "MSG" && inputCommands[1] == "ALL") { sendMessageToAllUsers(inputCommands[2], socketFileDescriptor); }
-    else if (inputCommands[0] == "CHANGE" && inputCommands[1] == "ID" &&inputCommands[2] != "") { setId(inputCommands[2]); }
-    else if (inputCommands[0] == "CONNECT") {
-        if (inputCommands[1] != "") {
-            if (!userExists(inputCommands[1])) {
-                chatUser newUser;
-                newUser.userName = inputCommands[1];
-                newUser.socketFd = socketFileDescriptor;
-                newUser.isReceiving = false;
-                currentUsers.push_back(newUser);
-                sendFeedback(true, socketFileDescriptor);
-            }
-            else { sendFeedback(false, socketFileDescriptor); }
-        }
-        else { sendFeedback(false, socketFileDescriptor); }
-    }
-    else if (inputCommands[0] == "RECV") {
-        for (size_t i = 0; i < currentUsers.size(); i++) {
-            if (currentUsers[i].socketFd == socketFileDescriptor) {
-                currentUsers[i].isReceiving = true;
-                break;
-            }
-        }
-    }
-}
+// Closes a knock which has been counted with a reset instead of the usual closing handshake, so the socket is
+// freed at once and leaves nothing in TIME_WAIT.
+void resetConnection(int socketFd);
 
-// Is used in a few cases. Sends a message to <clientSocketDescriptor> whether an action failed or not.
-void sendFeedback(bool success, int clientSocketDescriptor) {
-    if (success) {
-        char sendBackBuffer[MINBUFFERSIZE] = "SUCCESS";
-        send(clientSocketDescriptor, sendBackBuffer, sizeof sendBackBuffer, 0);
-    }
-    else {
-        char sendBackBuffer[MINBUFFERSIZE] = "FAIL";
-        send(clientSocketDescriptor, sendBackBuffer, sizeof sendBackBuffer, 0);
-    }
-}
+// Adds a socket to the local reactor's epoll instance, edge-triggered, watching for incoming data and for
+// the socket becoming writable again.
+void watchFileDescriptor(int fileDescriptor);
 
-// This function generates new server id. The fortune and timestamp are generated automatically but the
-// client can pick the groupInitials himself.
-void setId(string groupInitials) {
-    // Clear before change.
-    Id = "";
+// Creates a reactor thread's epoll instance and wakeup eventfd, and its io_uring if --io-backend asks for one.
+// Does not start the thread.
+struct reactorThread *createReactor(int reactorIndex);
 
-    // Get our fortune cookie.
-    FILE *stream = popen("fortune -s", "r");
-    char inStream[XLARGEBUFFERSIZE];
-    while (fgets(inStream, XLARGEBUFFERSIZE, stream) != NULL)
-    {
-        Id.append(inStream);
-    }
-    pclose(stream);
+// Runs the server loop of <reactor> on the calling thread. Reactor 0 is passed the listening socket
+// configurations, the others NULL.
+void runReactor(struct reactorThread *reactor, struct serverConfiguration *configurations);
 
-    // Add the timestamp.
-    time_t timeStamp;
-    time(&timeStamp);
-    stringstream timeStream;
-    timeStream << timeStamp;
-    Id += ctime(&timeStamp);
+// Registers a socket which has passed the knocking sequence with the local reactor and tells the client.
+void adoptConnection(int socketFd);
 
-    // Add the group's initals.
-    Id += groupInitials;
-}
+// Returns the connection of <socketFd> on the local reactor, or NULL if it has none.
+struct clientConnection *findConnection(int socketFd);
 
-// This function gets called when the client requests info the server Id. It simply sends the current Id to him.
-void sendIdToClient(int clientSocketDescriptor) {
-    char sendIdBuffer[XLARGEBUFFERSIZE];
-    strcpy(sendIdBuffer, Id.c_str());
-    if (send(clientSocketDescriptor, sendIdBuffer, sizeof sendIdBuffer, 0) < 0) { perror("ID_SEND failure"); }
-}
+// Takes a slot for <socketFd> from the local reactor's connection pool, reusing a released one if there is one,
+// and resets it.
+struct clientConnection *acquireConnection(int socketFd);
 
-// This function takes the vector of current users, parses the contents into a single white-space separated list
-// of usernames and sends to the client.
-void sendUserListToClient(int clientSocketDescriptor) {
-    string userListStringified = "";
-    for (size_t i = 0; i < currentUsers.size(); i++) {
+// Returns the slot of <socketFd> to the local reactor's connection pool. Its queued messages are dropped but the
+// storage of its buffers is kept for the next connection. With io_uring this waits for its recv and send to complete.
+void releaseConnection(int socketFd);
 
-        // Format the user list into a sendable string.
-        userListStringified.append(currentUsers[i].userName);
-        if (i != (currentUsers.size() - 1)) { userListStringified.append(" "); }
-    }
+// Empties the connection in <slotIndex> and puts the slot on the local reactor's free list.
+void freeConnectionSlot(uint32_t slotIndex);
 
-    // Send it.
-    char sendUsersBuffer[userListStringified.length() + 1];
-    memset(sendUsersBuffer, 0, sizeof sendUsersBuffer);
-    strcpy(sendUsersBuffer, userListStringified.c_str());
-    if (send(clientSocketDescriptor, sendUsersBuffer, sizeof sendUsersBuffer, 0) < 0) { perror("USERLIST_SEND failure"); }
-}
+// Returns the slot <table> gives <socketFd>, or NOSLOT.
+uint32_t slotForSocketFd(const vector<uint32_t> *table, int socketFd);
 
-// This function loops through all active users, excluding the sender, and sends them message.
-void sendMessageToAllUsers(string message, int clientSocketDescriptor) {
-    // Find user sending the message.
-    string sendingUser = "";
-    for (size_t i = 0; i < currentUsers.size(); i++) {
-        if (currentUsers[i].socketFd == clientSocketDescriptor) { sendingUser = currentUsers[i].userName; }
-    }
+// Sets the slot <table> gives <socketFd>, growing the table if needed.
+void setSlotForSocketFd(vector<uint32_t> *table, int socketFd, uint32_t slotIndex);
 
-    // Assemble the message.
-    message = sendingUser + ": " + message;
+// Is called when one of the listening sockets is readable. Accepts every pending connection on it and updates
+// the knocking state of each connecting IP address. A connection which completes the sequence is kept open.
+void acceptKnocks(struct serverConfiguration *configuration);
 
-    char sendMessageBuffer[message.length() + 1];
-    strcpy(sendMessageBuffer, message.c_str());
+// Updates the knocking state of the IP address in <clientAddress> with a connection accepted on the listening
+// socket of <configuration>. A connection which completes the sequence is kept open, any other is closed.
+void handleKnock(struct serverConfiguration *configuration, int socketFd, const struct sockaddr_storage *clientAddress);
 
-    // Send loop.
-    for (size_t i = 0; i < currentUsers.size(); i++) {
-        if (currentUsers[i].isReceiving && currentUsers[i].socketFd != clientSocketDescriptor) {
-            if (send(currentUsers[i].socketFd, sendMessageBuffer, sizeof sendMessageBuffer, 0) < 0) { perror("server failure: failed to send message"); }
-        }
+// Is called when a client socket is readable. Reads until the socket is drained, appending to the connection's
+// read buffer, and hands every complete frame to checkAPI. A closed or failed socket, or a frame larger than
+// MAXFRAMEPAYLOADSIZE, disconnects the user.
+void readFromClient(int socketFileDescriptor);
+
+// Hands every complete frame in the connection's read buffer to checkAPI or checkBinaryAPI. A single read may
+// contain many pipelined commands, and the last one may be incomplete, in which case it stays buffered. The header
+// size is looked up for every frame, as CONNECT may switch to the binary protocol. Returns false if the connection
+// has been closed, by LEAVE or for a frame larger than MAXFRAMEPAYLOADSIZE.
+bool processFrames(struct clientConnection *connection);
+
+// Returns the number of bytes currently held by the ring buffer.
+size_t ringBufferSize(struct inputRingBuffer *ringBuffer);
+
+// Returns a pointer to the largest contiguous free region of the ring buffer and stores its length in
+// <writableLength>. The buffer is doubled if it is full and still below MAXREADBUFFERSIZE. A length of
+// zero means the buffer is full and cannot grow.
+char *ringBufferWritableRegion(struct inputRingBuffer *ringBuffer, size_t *writableLength);
+
+// Returns a pointer to the first <length> buffered bytes, rearranging the storage first if they wrap around
+// its end. <length> must not exceed ringBufferSize.
+const char *ringBufferContiguous(struct inputRingBuffer *ringBuffer, size_t length);
+
+// Reads the command line options. Exits with a usage message if an option is not recognized.
+void parseArguments(int argv, char *args[]);
+
+/* ### Knock table functions ### */
+
+// Empties the knock table. Is called once on startup.
+void initializeKnockTable();
+
+// Writes the knock table key of a client address into <key>, KNOCKADDRESSSIZE bytes.
+void knockAddressFromSocketAddress(const struct sockaddr_storage *socketAddress, unsigned char *key);
+
+// Returns the knock in progress for <address>, or NULL if there is none.
+struct connectionInProgress *findKnockState(const unsigned char *address);
+
+// Starts a knock in progress for <address> at timer tick <tickNow>, evicting the oldest one if the table is too
+// full. <address> must not be in the table already. Must be called on reactor 0.
+struct connectionInProgress *createKnockState(const unsigned char *address, uint64_t tickNow);
+
+// Removes a knock in progress from the table. Other entries may be moved, so no pointers into the table may be
+// used after this.
+void removeKnockState(struct connectionInProgress *knockState);
+
+// Removes every knock in progress whose window has passed and sets the knock table's timer for the oldest
+// knock left. Is called when that timer fires.
+void expireKnockStates();
+
+/* ### Server Id functions ### */
+
+// Memory-maps the fortune file at <path>, a list of fortunes separated by lines holding a single %, and indexes
+// its short fortunes into fortuneCorpus. Returns false if the file cannot be read or holds no short fortunes.
+bool loadFortuneCorpus(const string &path);
+
+// Returns a short fortune. It is sampled from fortuneCorpus if it is loaded, otherwise fortune -s is run.
+string getFortune(mt19937 *randomGenerator);
+
+// Runs on its own thread. Waits for Id change requests and carries them out.
+void runIdWorker();
+
+/* ### Outbound queue functions ### */
+
+// Appends a payload to the outbound queue of the connection owning <socketFd> and schedules the queue to be
+// flushed after the current batch of events. Applies the overflow policy if the queue exceeds its bounds.
+void queueMessage(int socketFd, const sharedPayload &payload);
+
+// Sends as much of the connection's outbound queue as the socket accepts without blocking, gathering up to
+// MAXIOVECSPERSEND messages into each sendmsg() call. Is called for every connection in pendingFlushes and
+// when a socket becomes writable again. With io_uring it queues a single send instead, see submitSend.
+void flushOutboundQueue(struct clientConnection *connection);
+
+// Points <messageVectors> at up to MAXIOVECSPERSEND payloads from the front of the connection's outbound queue,
+// starting with the unsent part of the head. Returns the number of vectors used.
+size_t gatherOutboundQueue(struct clientConnection *connection, struct iovec *messageVectors);
+
+// Pops every payload which was sent completely by a send of <bytesSent> bytes from the connection's outbound
+// queue. The remainder of a partially sent one stays at the head.
+void consumeSentBytes(struct clientConnection *connection, size_t bytesSent);
+
+// Flushes the outbound queue of every connection which had messages queued during the current batch of events.
+void processPendingFlushes();
+
+// Copies the connection's queue statistics into its published counters. The change in its queue length and
+// size is added to the local reactor's totals.
+void publishQueueCounters(struct clientConnection *connection);
+
+// Applies queueOverflowPolicy to a connection whose outbound queue exceeds maxQueuedMessages or maxQueuedBytes.
+void enforceQueueLimits(struct clientConnection *connection);
+
+// Marks the connection for disconnection after the current batch of events.
+void scheduleDisconnect(struct clientConnection *connection);
+
+// Disconnects every connection scheduled by scheduleDisconnect.
+void processPendingDisconnects();
+
+/* ### Reactor mailbox functions ### */
+
+// Returns a mailbox item of type <type> from the local reactor's pool, allocating one only if the pool is empty.
+struct mailboxItem *takeMailboxItem(enum mailboxItemType type);
+
+// Gives a processed mailbox item back to the pool of the reactor it was taken from. May be called from any reactor.
+void returnMailboxItem(struct mailboxItem *item);
+
+// Pushes <item> onto the mailbox of <reactor> and wakes it up if the mailbox was empty. May be called from
+// any thread. The mailbox takes ownership of the item.
+void postToReactor(struct reactorThread *reactor, struct mailboxItem *item);
+
+// Takes every item out of the local reactor's mailbox and processes them in the order they were posted.
+void drainMailbox();
+
+/* ### io_uring functions ### */
+
+// Sets up an io_uring with RINGENTRIES submission queue entries and registers its buffer ring of receive buffers.
+// Returns NULL if the kernel lacks anything the io_uring backend needs.
+struct ioRing *createIoRing();
+
+// Unmaps and closes what createIoRing set up of <ring> and frees it.
+void destroyIoRing(struct ioRing *ring);
+
+// Returns a cleared submission queue entry of the local reactor's ring carrying <userData>. If the queue is full,
+// the entries in it are handed to the kernel first.
+struct io_uring_sqe *nextSubmission(uint64_t userData);
+
+// Hands every entry written since the last call to the kernel. Then waits until a completion arrives or
+// <timeoutMilliseconds> have passed, forever if it is -1, unless it is 0.
+void enterRing(struct ioRing *ring, int timeoutMilliseconds);
+
+// Runs the server loop of <reactor> with its io_uring instead of epoll. See runReactor.
+void runRingReactor(struct reactorThread *reactor, struct serverConfiguration *configurations);
+
+// Hands the completion to the function for its ringOperation.
+void handleCompletion(const struct io_uring_cqe *completion, struct serverConfiguration *configurations);
+
+// Submits a multishot accept on the listening socket of configurations[<listenerIndex>].
+void armAccept(struct serverConfiguration *configurations, int listenerIndex);
+
+// Submits a multishot poll of the local reactor's wakeup eventfd.
+void armWakeup();
+
+// Submits a multishot recv of the connection, which receives into the buffer ring.
+void armReceive(struct clientConnection *connection);
+
+// Submits a sendmsg of up to MAXIOVECSPERSEND messages from the front of the connection's outbound queue, unless
+// one is in flight already. It is handed to the kernel with the other submissions of the batch.
+void submitSend(struct clientConnection *connection);
+
+// Is called for every connection a multishot accept has accepted. Looks up the client's address, which the accept
+// does not report, and counts the knock.
+void completeAccept(struct serverConfiguration *configurations, int listenerIndex, const struct io_uring_cqe *completion);
+
+// Is called for every recv of the connection in <slotIndex>. Hands the data to processFrames and gives the buffer
+// back to the buffer ring. A closed or failed socket disconnects the user.
+void completeReceive(uint32_t slotIndex, const struct io_uring_cqe *completion);
+
+// Is called when the sendmsg of the connection in <slotIndex> has completed. Pops what was sent and schedules
+// another flush if more messages have been queued in the meantime.
+void completeSend(uint32_t slotIndex, const struct io_uring_cqe *completion);
+
+// Copies <length> received bytes into the connection's read buffer and processes the frames in it. Returns false
+// if the connection has been closed.
+bool receiveIntoConnection(struct clientConnection *connection, const char *data, size_t length);
+
+// Puts the receive buffer <bufferId> back into the local reactor's buffer ring.
+void recycleReceiveBuffer(struct ioRing *ring, unsigned short bufferId);
+
+/* ### User registry functions ### */
+
+// Claims <userName> in the user directory and adds the user to the local reactor's registry. Returns false,
+// changing nothing, if the name is already taken or longer than MAXUSERNAMELENGTH. The caller must make sure the
+// socket is not registered yet.
+bool registerUser(string_view userName, int socketFd);
+
+// Removes the user owning <socketFd> from the local registry and the directory, if there is one. His slot
+// is recycled.
+void unregisterUser(int socketFd);
+
+// Looks a username up in the user directory. Returns false if no such user is connected, otherwise fills in
+// <entry> if it is not NULL.
+bool lookupUserName(string_view userName, struct directoryEntry *entry);
+
+// Returns the directory shard <userName> belongs to.
+struct directoryShard *directoryShardFor(string_view userName);
+
+// Copies <userName>, which must not be longer than MAXUSERNAMELENGTH, into a user directory key.
+struct userNameKey makeUserNameKey(string_view userName);
+
+// Returns the user owning the given socket, or NULL if the socket has not made a CONNECT.
+struct chatUser *findUserBySocket(int socketFd);
+
+// Returns the local user a handle refers to, or NULL if that user has left.
+struct chatUser *findUserByHandle(struct userHandle handle);
+
+// Returns the binary protocol's user id of the user with <handle> on reactor <reactorIndex>, see USERIDREACTORBITS.
+uint64_t makeUserId(int reactorIndex, struct userHandle handle);
+
+// Splits <userId> into the reactor index and handle it was made of. Returns false if it names no reactor.
+bool splitUserId(uint64_t userId, int *reactorIndex, struct userHandle *handle);
+
+// Marks the user as receiving and adds him to the array of receiving users. He is first sent the messages to
+// everyone he missed since he logged in, as far as the history goes back.
+void setUserReceiving(struct chatUser *user);
+
+/* ### User list functions ### */
+
+// Adds <userName> to the user list and records the login. The caller must hold the lock of the user's directory
+// shard.
+void addToUserList(const struct userNameKey &userName);
+
+// Removes <userName> from the user list and records the logout. The caller must hold the lock of the user's
+// directory shard.
+void removeFromUserList(const struct userNameKey &userName);
+
+// Bumps the user list's version and records the login or logout of <userName> as the change to it. The caller
+// must hold the user list's lock.
+void recordUserListChange(bool joined, const struct userNameKey &userName);
+
+// Cuts <userName> and a space next to it out of the user list's reply text. The caller must hold the user list's
+// lock.
+void removeFromUserListReply(const struct userNameKey &userName);
+
+// Returns the reply to a plain WHO: every username, separated by spaces. It is made from the reply text when WHO is
+// first asked for after the list has changed, and shared until it changes again.
+sharedPayload userListReply();
+
+// Appends the user list's version and length and up to <count> usernames from position <offset> on to <reply>,
+// separated by spaces.
+void appendUserListPage(uint64_t offset, uint64_t count, string *reply);
+
+// Appends the user list's version to <reply>, followed by the logins (+name) and logouts (-name) made since
+// version <sinceVersion>, oldest first. If they are no longer all known, it is followed by * and every username.
+void appendUserListChanges(uint64_t sinceVersion, string *reply);
+
+// Appends the usernames from position <first> up to <last> to <reply>, separated by spaces. The caller must hold
+// the user list's lock.
+void appendUserNames(size_t first, size_t last, string *reply);
+
+/* ### Message history functions ### */
+
+// Makes <history> empty, keeping <size> messages.
+void initializeHistory(struct messageHistory *history, size_t size);
+
+// Adds <payload> to <history> and returns its sequence number. The caller must hold the history's lock.
+uint64_t appendToHistory(struct messageHistory *history, const sharedPayload &payload);
+
+// Appends the messages of <history> from sequence number <fromSequence> on, as far as they are still kept,
+// to <messages>. The caller must hold the history's lock.
+void copyHistory(const struct messageHistory *history, uint64_t fromSequence, vector<sharedPayload> *messages);
+
+/* ### Message log functions ### */
+
+// Opens the message log at messageLogPath, creating it if needed, cuts off a record left half written by a crash
+// and restores the message history from the end of the log. Exits if the file is not a message log.
+void openMessageLog();
+
+// Rebuilds the history of messages to everyone and of the rooms from the records in <log>, which is <logSize> bytes
+// long and ends with a complete record. Returns the number of records restored.
+size_t restoreFromMessageLog(const char *log, size_t logSize);
+
+// Returns the length of the record which ends at <recordEnd> in <log>, or 0 if there is no valid record there.
+uint32_t logRecordEndingAt(const char *log, size_t recordEnd);
+
+// Returns the length of the record which starts at <recordStart> in <log>, <logSize> bytes long, or 0 if there is
+// no complete and valid record there.
+uint32_t logRecordStartingAt(const char *log, size_t logSize, size_t recordStart);
+
+// Hands <payload> to the log writer thread. Does nothing if there is no message log. The caller must hold the lock
+// of the history the message was added to, so the log keeps the messages of each channel in order.
+void logMessage(uint8_t kind, const string &roomName, const sharedPayload &payload);
+
+// Runs on its own thread. Writes the records added by logMessage to the message log and syncs them to disk, a
+// batch at a time.
+void runLogWriter();
+
+/* ### Room functions ### */
+
+// Adds the user to the room <roomName>, creating it if it does not exist. Returns false if the name is not a
+// valid room name, the user is already in the room or is in too many rooms.
+bool joinRoom(struct chatUser *user, string_view roomName);
+
+// Removes the user from the room <roomName>. Returns false if he is not in it. A room without members is
+// removed.
+bool partRoom(struct chatUser *user, string_view roomName);
+
+// Removes the user from every room he is in. Is called when he leaves the server.
+void partAllRooms(struct chatUser *user);
+
+// Queues <payload> for every member of the room <roomName> connected to the local reactor, except the one
+// using <excludedSocketFd>.
+void sendToLocalRoomMembers(const string &roomName, const sharedPayload &payload, int excludedSocketFd);
+
+// Adds <payload> to the history of <roomName> and returns the reactor threads which have members in the room,
+// one bit per reactor.
+uint64_t appendToRoomHistory(const string &roomName, const sharedPayload &payload);
+
+// Returns true if <roomName> starts with ROOMPREFIX and is a valid room name.
+bool isRoomName(string_view roomName);
+
+// Returns the room directory shard <roomName> belongs to.
+struct roomShard *roomShardFor(const string &roomName);
+
+/* ### Timer wheel functions ### */
+
+// Returns the current timer tick, counted in TIMERTICKMILLISECONDS from an arbitrary point in the past.
+uint64_t currentTimerTick();
+
+// Returns the number of ticks in <seconds> seconds.
+uint64_t secondsToTicks(int seconds);
+
+// Empties the local reactor's timer wheel and sets it to the current tick.
+void initializeTimerWheel();
+
+// Returns a new, unarmed timer of the local reactor which will be handed to the function for <kind> with
+// <owner> when it fires.
+uint32_t createTimer(enum timerKind kind, uint32_t owner);
+
+// Arms <timer> to fire at <expiryTick>, moving it if it is armed already. A tick which has passed fires it
+// on the next tick. Takes constant time.
+void scheduleTimer(uint32_t timer, uint64_t expiryTick);
+
+// Disarms <timer> if it is armed. Takes constant time.
+void cancelTimer(uint32_t timer);
+
+// Processes every tick up to and including <tickNow>, moving timers down the levels of the wheel as it
+// reaches the start of their slots and firing the timers of each tick.
+void advanceTimers(uint64_t tickNow);
+
+// Returns the milliseconds the server loop may wait before advanceTimers has something to do, or -1 if the
+// local reactor has no armed timers.
+int timerTimeoutMilliseconds();
+
+// Hands a timer which has fired to the function for its kind.
+void fireTimer(enum timerKind kind, uint32_t owner);
+
+// Is called when the keepalive timer of the connection in <slotIndex> fires. Sends the connection PING once it
+// has been silent for pingInterval seconds, disconnects it once it has been silent for idleTimeout seconds and
+// schedules the timer again.
+void checkKeepalive(uint32_t slotIndex);
+
+// Schedules the connection's keepalive timer for the next time checkKeepalive may have something to do,
+// counting from the last time the client sent something.
+void scheduleKeepalive(struct clientConnection *connection);
+
+/* ### Metrics functions ### */
+
+// Adds <amount> to a counter of the local reactor. Only the reactor owning the counter may call this.
+void countMetric(atomic<uint64_t> *counter, uint64_t amount);
+
+// Adds <amount>, which may be negative, to a gauge of the local reactor. Only the reactor owning the gauge may
+// call this.
+void adjustMetric(atomic<int64_t> *gauge, int64_t amount);
+
+// Adds a latency of <nanoseconds> to a histogram of the local reactor.
+void recordLatency(struct latencyHistogram *histogram, uint64_t nanoseconds);
+
+// Returns the index of the histogram bucket <nanoseconds> falls into.
+int latencyBucket(uint64_t nanoseconds);
+
+// Returns the smallest latency in nanoseconds which falls above the histogram bucket <bucket>.
+uint64_t latencyBucketLimit(int bucket);
+
+// Returns the time of the monotonic clock in nanoseconds.
+uint64_t monotonicNanoseconds();
+
+// Opens the metrics endpoint on the loopback address at metricsPort. Exits if the port cannot be bound.
+int openMetricsListener();
+
+// Runs on its own thread. Answers every request made to the metrics endpoint with the metrics of all reactors.
+void runMetricsServer(int listeningSocket);
+
+// Returns the metrics of all reactors in the Prometheus text format.
+string renderMetrics();
+
+// Appends a histogram with the given bucket counts and total to <metrics> in the Prometheus text format, with its
+// limits in seconds.
+void appendHistogram(stringstream &metrics, const char *name, const char *help, const uint64_t *buckets, uint64_t totalNanoseconds);
+
+/* ### Console log functions ### */
+
+// Formats a line like printf and hands it to the console log thread through the local reactor's console log ring.
+// Returns at once. Lines over CONSOLELOGLINESPERSECOND in a second are dropped and counted instead.
+void logToConsole(const char *format, ...);
+
+// Logs <message> followed by the description of errno, like perror.
+void logSystemError(const char *message);
+
+// Copies the lines waiting in <ring> to the end of <batch> and frees their space. Returns whether there were any.
+bool drainConsoleLogRing(struct consoleLogRing *ring, string &batch);
+
+// Returns the number of lines the console log has dropped in total.
+uint64_t countSuppressedConsoleLines();
+
+// Runs on its own thread. Prints the lines handed to logToConsole, a batch at a time.
+void runConsoleLogger();
+
+// Server start point.
+int main(int argv, char *args[])
+{
+    parseArguments(argv, args);
+
+    // A client which resets his connection must not kill the server through SIGPIPE.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every connection needs a descriptor, so allow as many as the system lets us.
+    struct rlimit fileLimit;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    // Each socket has one configuration.
+    serverConfiguration configurations[3];
+
+    // Lines logged while the server runs are printed on a thread of their own.
+    consoleLogWakeupFileDescriptor = eventfd(0, EFD_CLOEXEC);
+    if (consoleLogWakeupFileDescriptor == -1) {
+        perror("Console log eventfd failure");
+        exit(EXIT_FAILURE);
+    }
+    thread consoleLoggerThread(runConsoleLogger);
+    consoleLoggerThread.detach();
+
+    // Open the listening sockets on the given ports or on three consecutive free ones.
+    initializeServer(configurations);
+    int metricsListener = metricsPort != 0 ? openMetricsListener() : -1;
+
+    initializeKnockTable();
+    initializeHistory(&broadcastHistory, BROADCASTHISTORYSIZE);
+
+    // Restore the history from the message log and start writing new messages to it.
+    if (messageLogPath != "") {
+        openMessageLog();
+        thread logWriterThread(runLogWriter);
+        logWriterThread.detach();
+    }
+
+    // Load the fortune corpus so Ids can be made without running fortune.
+    if (fortuneFilePath != "") {
+        if (!loadFortuneCorpus(fortuneFilePath)) { cout << "Could not load fortune file " << fortuneFilePath << endl; }
+    }
+    else {
+        const char *defaultFortuneFiles[] = {"/usr/share/games/fortunes/fortunes", "/usr/share/fortune/fortunes", "/usr/share/fortunes/fortunes"};
+        for (size_t i = 0; i < sizeof defaultFortuneFiles / sizeof defaultFortuneFiles[0]; i++) {
+            if (loadFortuneCorpus(defaultFortuneFiles[i])) { break; }
+        }
+    }
+
+    // Set the inital server Id with hardcoded group initials. Later
+    // changes are made on the Id worker thread.
+    setId("THSS");
+    thread idWorkerThread(runIdWorker);
+    idWorkerThread.detach();
+
+    // Every reactor thread has its own epoll instance to maintain its incoming socket connections.
+    for (int i = 0; i < reactorCount; i++) { reactors.push_back(createReactor(i)); }
+
+    // The metrics endpoint reads the counters of every reactor, so it is started once they all exist.
+    if (metricsListener >= 0) {
+        thread metricsThread(runMetricsServer, metricsListener);
+        metricsThread.detach();
+    }
+
+    // Add our listening sockets to the epoll instance of reactor 0. With io_uring, reactor 0 arms multishot
+    // accepts on them when it starts instead.
+    localReactor = reactors[0];
+    if (localReactor->ring == NULL) {
+        watchFileDescriptor(configurations[SOCKET01].serverSocketDescriptor);
+        watchFileDescriptor(configurations[SOCKET02].serverSocketDescriptor);
+        watchFileDescriptor(configurations[SOCKET03].serverSocketDescriptor);
+    }
+
+    // Start the other reactors on threads of their own and run reactor 0 on this one.
+    vector<thread> reactorThreads;
+    for (int i = 1; i < reactorCount; i++) { reactorThreads.push_back(thread(runReactor, reactors[i], (struct serverConfiguration *)NULL)); }
+    runReactor(reactors[0], configurations);
+
+    for (size_t i = 0; i < reactorThreads.size(); i++) { reactorThreads[i].join(); }
+
+    return 0;
+}
+
+/* ### Server/Client communication functions ### */
+
+// Processes input from already connected clients. This is essentially the server's API. API commands are
+// interpreted here and corresponding function calls are made.
+void checkAPI(string_view input, int socketFileDescriptor) {
+    struct parsedCommand command;
+    parseCommand(input, &command);
+    countMetric(&localReactor->metrics.commands[command.verb], 1);
+    if (!allowCommand(socketFileDescriptor, rateClassOf(&command))) { return; }
+
+    switch (command.verb) {
+        case VERB_ID: sendIdToClient(socketFileDescriptor); break;
+        case VERB_LEAVE: disconnectUser(socketFileDescriptor); break;
+        case VERB_WHO: sendUserListToClient(socketFileDescriptor, command.argument, command.text); break;
+        case VERB_MSG:
+            // A user named ALL takes precedence over the broadcast.
+            if (isRoomName(command.argument)) { sendMessageToRoom(command.text, socketFileDescriptor, command.argument); }
+            else if (!sendMessageToUser(command.text, socketFileDescriptor, command.argument) && command.argument == "ALL") {
+                sendMessageToAllUsers(command.text, socketFileDescriptor);
+            }
+            break;
+        case VERB_JOIN:
+        case VERB_PART: {
+            struct chatUser *user = findUserBySocket(socketFileDescriptor);
+            bool success = user != NULL && (command.verb == VERB_JOIN ? joinRoom(user, command.argument) : partRoom(user, command.argument));
+            sendFeedback(success, socketFileDescriptor);
+            break;
+        }
+        case VERB_CHANGE:
+            // How often each connection may do this is limited by the RATE_CHANGEID class.
+            if (command.argument == "ID" && command.text != "") { requestIdChange(string(command.text)); }
+            break;
+        case VERB_CONNECT:
+            // A connection can only be logged in as one user at a time. Usernames cannot look like room names.
+            if (command.argument != "" && command.argument[0] != ROOMPREFIX && findUserBySocket(socketFileDescriptor) == NULL &&
+                registerUser(command.argument, socketFileDescriptor)) {
+                if (command.text == BINARYPROTOCOLNAME) {
+                    // Every command after this one is a binary frame. The user is told his id.
+                    struct chatUser *user = findUserBySocket(socketFileDescriptor);
+                    struct userHandle handle = {(uint32_t)(user - localReactor->users.slots.data()), user->generation};
+                    findConnection(socketFileDescriptor)->binaryProtocol = true;
+                    queueMessage(socketFileDescriptor, makeReply("SUCCESS " + to_string(makeUserId(localReactor->reactorIndex, handle))));
+                }
+                else { sendFeedback(true, socketFileDescriptor); }
+            }
+            else { sendFeedback(false, socketFileDescriptor); }
+            break;
+        case VERB_RECV: {
+            struct chatUser *user = findUserBySocket(socketFileDescriptor);
+            if (user != NULL) { setUserReceiving(user); }
+            break;
+        }
+        case VERB_STATS: sendQueueStatsToClient(socketFileDescriptor); break;
+        case VERB_HISTORY:
+            // HISTORY n or HISTORY #room n.
+            if (isRoomName(command.argument)) { sendHistoryToClient(socketFileDescriptor, command.argument, command.text); }
+            else { sendHistoryToClient(socketFileDescriptor, "", command.argument); }
+            break;
+        case VERB_LOOKUP: sendUserIdToClient(socketFileDescriptor, command.argument); break;
+        // The answer to PING. Receiving it has already counted as activity, so there is nothing left to do.
+        case VERB_PONG: break;
+        case VERB_UNKNOWN: break;
+    }
+}
+
+// Is used in a few cases. Sends a message to <clientSocketDescriptor> whether an action failed or not.
+void sendFeedback(bool success, int clientSocketDescriptor) {
+    // The replies never change, so they are assembled once and shared by every connection.
+    static const sharedPayload successReply = makeReply("SUCCESS");
+    static const sharedPayload failReply = makeReply("FAIL");
+    queueMessage(clientSocketDescriptor, success ? successReply : failReply);
+}
+
+// Returns <text> as a reply.
+sharedPayload makeReply(string_view text) {
+    shared_ptr<string> reply = make_shared<string>();
+    reply->reserve(MAXREPLYHEADERSIZE + text.length());
+    appendReply(*reply, text);
+    return reply;
+}
+
+// Returns <text> as a message from another user.
+sharedPayload makeMessage(string_view text) {
+    shared_ptr<string> message = make_shared<string>();
+    message->reserve(MAXREPLYHEADERSIZE + text.length());
+    appendReplyHeader(*message, text.length(), true);
+    message->append(text);
+    return message;
+}
+
+// This function generates new server id. The fortune and timestamp are generated automatically but the
+// client can pick the groupInitials himself.
+void setId(string groupInitials) {
+    static mt19937 randomGenerator(random_device{}());
+
+    // Get our fortune cookie.
+    string Id = getFortune(&randomGenerator);
+
+    // Add the timestamp.
+    time_t timeStamp;
+    time(&timeStamp);
+    char timeBuffer[MEDBUFFERSIZE];
+    Id += ctime_r(&timeStamp, timeBuffer);
+
+    // Add the group's initals.
+    Id += groupInitials;
+
+    // Build the reply once and publish it.
+    atomic_store(&idPayload, makeReply(Id));
+}
+
+// Asks the Id worker thread to generate a new server id with <groupInitials>. Returns immediately.
+void requestIdChange(const string &groupInitials) {
+    lock_guard<mutex> requestLock(idRequestMutex);
+    idRequestPending = true;
+    idRequestGroupInitials = groupInitials;
+    idRequestCondition.notify_one();
+}
+
+// This function gets called when the client requests info the server Id. It simply sends the current Id to him.
+void sendIdToClient(int clientSocketDescriptor) {
+    queueMessage(clientSocketDescriptor, atomic_load(&idPayload));
+}
+
+// Sends the client the names of the logged in users. A plain WHO is answered with all of them, separated by spaces.
+// WHO <offset> <count> is answered with a page of the list and WHO SINCE <version> with the changes since that
+// version of the list, see appendUserListPage and appendUserListChanges.
+void sendUserListToClient(int clientSocketDescriptor, string_view argument, string_view text) {
+    // Clients which poll the whole list are all sent the same cached reply.
+    uint64_t first, second;
+    bool textIsNumber = from_chars(text.data(), text.data() + text.length(), second).ec == errc();
+    if (argument == "" || !textIsNumber) {
+        queueMessage(clientSocketDescriptor, userListReply());
+        return;
+    }
+
+    shared_ptr<string> reply = make_shared<string>();
+    if (argument == "SINCE") { appendUserListChanges(second, reply.get()); }
+    else if (from_chars(argument.data(), argument.data() + argument.length(), first).ec == errc()) { appendUserListPage(first, second, reply.get()); }
+    else {
+        queueMessage(clientSocketDescriptor, userListReply());
+        return;
+    }
+    insertReplyHeader(*reply, 0);
+    queueMessage(clientSocketDescriptor, sharedPayload(reply));
+}
+
+// This function loops through all active users, excluding the sender, and sends them message.
+// Users on other reactor threads are reached by posting the message to each of those reactors.
+void sendMessageToAllUsers(string_view message, int clientSocketDescriptor) {
+    // Find user sending the message.
+    string_view sendingUser = "";
+    struct chatUser *sender = findUserBySocket(clientSocketDescriptor);
+    if (sender != NULL) { sendingUser = sender->userName; }
+
+    // Assemble the message once, as a reply. Every receiver shares this payload.
+    size_t messageLength = sendingUser.length() + 2 + message.length();
+    shared_ptr<string> assembledMessage = make_shared<string>();
+    assembledMessage->reserve(MAXREPLYHEADERSIZE + messageLength);
+    appendReplyHeader(*assembledMessage, messageLength, true);
+    assembledMessage->append(sendingUser).append(": ").append(message);
+    sharedPayload payload = assembledMessage;
+
+    // Keep it for users who catch up later.
+    uint64_t sequence;
+    {
+        lock_guard<mutex> historyLock(broadcastHistoryMutex);
+        sequence = appendToHistory(&broadcastHistory, payload);
+        logMessage(LOGRECORDBROADCAST, "", payload);
+    }
+
+    // Send loop. Only users in receive mode are visited.
+    uint64_t fanoutStart = monotonicNanoseconds();
+    struct userRegistry *users = &localReactor->users;
+    for (size_t i = 0; i < users->receivingUsers.size(); i++) {
+        struct chatUser *receiver = &users->slots[users->receivingUsers[i]];
+        if (receiver->socketFd != clientSocketDescriptor) { queueMessage(receiver->socketFd, payload); }
+    }
+    recordLatency(&localReactor->metrics.fanoutLatency, monotonicNanoseconds() - fanoutStart);
+
+    // The other reactors fan the same payload out to their own receiving users.
+    for (int i = 0; i < reactorCount; i++) {
+        if (reactors[i] == localReactor) { continue; }
+        struct mailboxItem *item = takeMailboxItem(MAILBOX_BROADCAST);
+        item->payload = payload;
+        item->sequence = sequence;
+        postToReactor(reactors[i], item);
+    }
+}
+
+// This function finds user with socketFd == clientSocketDescriptor and sends him message. Returns false if
+// there is no user named <receivingUser>.
+bool sendMessageToUser(string_view message, int clientSocketDescriptor, string_view receivingUser) {
+    // Find where the receiving user is connected.
+    struct directoryEntry receiver;
+    if (!lookupUserName(receivingUser, &receiver)) { return false; }
+    sendMessageToHandle(message, clientSocketDescriptor, receiver.reactorIndex, receiver.handle);
+    return true;
+}
+
+// Sends message to the user with the handle <receiver> on reactor <reactorIndex>. Nothing is sent if he has left,
+// which the reactor he was connected to finds out by his handle's generation.
+void sendMessageToHandle(string_view message, int clientSocketDescriptor, int reactorIndex, struct userHandle receiver) {
+    // Find user sending the message.
+    string_view sendingUser = "";
+    struct chatUser *sender = findUserBySocket(clientSocketDescriptor);
+    if (sender != NULL) { sendingUser = sender->userName; }
+
+    // Assemble the message as a reply.
+    size_t messageLength = 10 + sendingUser.length() + 2 + message.length();
+    shared_ptr<string> assembledMessage = make_shared<string>();
+    assembledMessage->reserve(MAXREPLYHEADERSIZE + messageLength);
+    appendReplyHeader(*assembledMessage, messageLength, true);
+    assembledMessage->append("<PRIVATE> ").append(sendingUser).append(": ").append(message);
+
+    // Send the message, or hand it to the reactor the receiver is connected to.
+    if (reactorIndex == localReactor->reactorIndex) {
+        struct chatUser *receivingChatUser = findUserByHandle(receiver);
+        if (receivingChatUser != NULL) { queueMessage(receivingChatUser->socketFd, sharedPayload(assembledMessage)); }
+    }
+    else {
+        struct mailboxItem *item = takeMailboxItem(MAILBOX_PRIVATE_MESSAGE);
+        item->receiver = receiver;
+        item->payload = assembledMessage;
+        postToReactor(reactors[reactorIndex], item);
+    }
+}
+
+// Sends message to every member of <roomName> except the sender, who must be a member himself. Returns false
+// if he is not. Members on other reactor threads are reached by posting the message to the reactors which
+// have members in the room.
+bool sendMessageToRoom(string_view message, int clientSocketDescriptor, string_view roomName) {
+    struct chatUser *sender = findUserBySocket(clientSocketDescriptor);
+    if (sender == NULL) { return false; }
+    // The room name the sender keeps in his membership is the key to the room maps, so it is never copied.
+    const string *room = NULL;
+    for (size_t i = 0; i < sender->rooms.size() && room == NULL; i++) {
+        if (sender->rooms[i].roomName == roomName) { room = &sender->rooms[i].roomName; }
+    }
+    if (room == NULL) { return false; }
+
+    // Assemble the message once, as a reply. Every member shares this payload.
+    size_t messageLength = 1 + roomName.length() + 2 + strlen(sender->userName) + 2 + message.length();
+    shared_ptr<string> assembledMessage = make_shared<string>();
+    assembledMessage->reserve(MAXREPLYHEADERSIZE + messageLength);
+    appendReplyHeader(*assembledMessage, messageLength, true);
+    assembledMessage->append("<").append(roomName).append("> ").append(sender->userName).append(": ").append(message);
+    sharedPayload payload = assembledMessage;
+
+    uint64_t reactorMask = appendToRoomHistory(*room, payload);
+    sendToLocalRoomMembers(*room, payload, clientSocketDescriptor);
+
+    for (int i = 0; i < reactorCount; i++) {
+        if (reactors[i] == localReactor || (reactorMask & (1ULL << i)) == 0) { continue; }
+        struct mailboxItem *item = takeMailboxItem(MAILBOX_ROOM_MESSAGE);
+        item->roomName = *room;
+        item->payload = payload;
+        postToReactor(reactors[i], item);
+    }
+    return true;
+}
+
+// Sends the client the last <count> messages to everyone, or, if <roomName> is not empty, the last <count>
+// messages of that room, which he must be a member of. Only logged in users can ask for the history.
+void sendHistoryToClient(int clientSocketDescriptor, string_view roomName, string_view count) {
+    struct chatUser *user = findUserBySocket(clientSocketDescriptor);
+    uint64_t messageCount;
+    if (user == NULL || from_chars(count.data(), count.data() + count.length(), messageCount).ec != errc()) { return; }
+
+    vector<sharedPayload> messages;
+    if (roomName.empty()) {
+        lock_guard<mutex> historyLock(broadcastHistoryMutex);
+        uint64_t nextSequence = broadcastHistory.nextSequence;
+        copyHistory(&broadcastHistory, nextSequence - min(messageCount, nextSequence), &messages);
+    }
+    else {
+        bool isMember = false;
+        for (size_t i = 0; i < user->rooms.size() && !isMember; i++) { isMember = user->rooms[i].roomName == roomName; }
+        if (!isMember) { return; }
+
+        string room(roomName);
+        struct roomShard *shard = roomShardFor(room);
+        lock_guard<mutex> shardLock(shard->shardMutex);
+        struct messageHistory *history = &shard->rooms[room].history;
+        copyHistory(history, history->nextSequence - min(messageCount, history->nextSequence), &messages);
+    }
+
+    for (size_t i = 0; i < messages.size(); i++) { queueMessage(clientSocketDescriptor, messages[i]); }
+}
+
+// This function removes the user from the epoll instance and closes his connection.
+void disconnectUser(int socketFileDescriptor) {
+    // Remove the user from the epoll instance. With io_uring the socket is shut down instead, which ends the
+    // connection's recv and send. Entries not yet handed to the kernel name the descriptor by its number, so
+    // they are submitted before it is closed and the number can be reused.
+    struct ioRing *ring = localReactor->ring;
+    if (ring != NULL) {
+        if (ring->submissionTail != __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE)) { enterRing(ring, 0); }
+        shutdown(socketFileDescriptor, SHUT_RDWR);
+    }
+    else { epoll_ctl(localReactor->epollFileDescriptor, EPOLL_CTL_DEL, socketFileDescriptor, NULL); }
+    releaseConnection(socketFileDescriptor);
+    countMetric(&localReactor->metrics.connectionsClosed, 1);
+
+    // Update the user list.
+    unregisterUser(socketFileDescriptor);
+
+    // Close connection.
+    close(socketFileDescriptor);
+}
+
+// Sends the outbound queue statistics of every connected user to the client, one user per line.
+void sendQueueStatsToClient(int clientSocketDescriptor) {
+    stringstream statsStream;
+    for (int i = 0; i < USERDIRECTORYSHARDS; i++) {
+        lock_guard<mutex> shardLock(userDirectory[i].shardMutex);
+        userDirectoryMap::iterator entry;
+        for (entry = userDirectory[i].entries.begin(); entry != userDirectory[i].entries.end(); entry++) {
+            struct queueCounters *counters = entry->second.counters.get();
+            statsStream << entry->first.text << " queued=" << counters->queuedMessages.load(memory_order_relaxed);
+            statsStream << " bytes=" << counters->queuedBytes.load(memory_order_relaxed);
+            statsStream << " peak=" << counters->peakQueuedMessages.load(memory_order_relaxed);
+            statsStream << " dropped=" << counters->droppedMessages.load(memory_order_relaxed) << "\n";
+        }
+    }
+
+    queueMessage(clientSocketDescriptor, makeReply(statsStream.str()));
+}
+
+// Sends the client "USER <userName> <id>" with the user id of <userName>, or FAIL if no such user is connected.
+void sendUserIdToClient(int clientSocketDescriptor, string_view userName) {
+    struct directoryEntry entry;
+    if (!lookupUserName(userName, &entry)) {
+        sendFeedback(false, clientSocketDescriptor);
+        return;
+    }
+    string reply = "USER ";
+    reply.append(userName).append(" ").append(to_string(makeUserId(entry.reactorIndex, entry.handle)));
+    queueMessage(clientSocketDescriptor, makeReply(reply));
+}
+
+/* ### Binary protocol functions ### */
+
+// Processes a binary command from a client which has logged in with CONNECT <name> BINARY. The command is dispatched
+// by its opcode through a table, so nothing is parsed but the fixed-layout header. BINARY_TEXT hands the payload to
+// checkAPI, which counts the command itself.
+void checkBinaryAPI(const struct binaryHeader *header, string_view payload, int socketFileDescriptor) {
+    static const struct binaryCommand binaryCommands[BINARYOPCODECOUNT] = {
+        {VERB_UNKNOWN, RATE_NONE, NULL},
+        {VERB_MSG, RATE_BROADCAST, binaryMessageToAll},
+        {VERB_MSG, RATE_PRIVATE, binaryMessageToUser},
+        {VERB_MSG, RATE_BROADCAST, binaryMessageToRoom},
+        {VERB_WHO, RATE_WHO, binaryUserList},
+        {VERB_ID, RATE_NONE, binaryId},
+        {VERB_RECV, RATE_NONE, binaryReceive},
+        {VERB_LEAVE, RATE_NONE, binaryLeave},
+        {VERB_LOOKUP, RATE_NONE, binaryLookup}
+    };
+
+    if (header->opcode == BINARY_TEXT) {
+        checkAPI(payload, socketFileDescriptor);
+        return;
+    }
+    if (header->opcode >= BINARYOPCODECOUNT) {
+        countMetric(&localReactor->metrics.commands[VERB_UNKNOWN], 1);
+        return;
+    }
+    const struct binaryCommand *command = &binaryCommands[header->opcode];
+    countMetric(&localReactor->metrics.commands[command->verb], 1);
+    if (!allowCommand(socketFileDescriptor, command->rateClass)) { return; }
+    command->handler(header, payload, socketFileDescriptor);
+}
+
+// BINARY_MSG_ALL: sends the payload to everyone.
+void binaryMessageToAll(const struct binaryHeader *, string_view payload, int socketFd) {
+    sendMessageToAllUsers(payload, socketFd);
+}
+
+// BINARY_MSG_USER: sends the payload to the user with the header's user id. Ids which name no reactor are ignored.
+void binaryMessageToUser(const struct binaryHeader *header, string_view payload, int socketFd) {
+    int reactorIndex;
+    struct userHandle receiver;
+    if (splitUserId(header->userId, &reactorIndex, &receiver)) { sendMessageToHandle(payload, socketFd, reactorIndex, receiver); }
+}
+
+// BINARY_MSG_ROOM: sends the message in the payload to the room named in front of it. A payload too short for the
+// room name it announces is ignored.
+void binaryMessageToRoom(const struct binaryHeader *, string_view payload, int socketFd) {
+    if (payload.empty() || (uint8_t)payload[0] >= payload.length()) { return; }
+    size_t roomNameLength = (uint8_t)payload[0];
+    sendMessageToRoom(payload.substr(1 + roomNameLength), socketFd, payload.substr(1, roomNameLength));
+}
+
+// BINARY_WHO: sends the names of everyone logged in.
+void binaryUserList(const struct binaryHeader *, string_view, int socketFd) {
+    sendUserListToClient(socketFd, "", "");
+}
+
+// BINARY_ID: sends the server id.
+void binaryId(const struct binaryHeader *, string_view, int socketFd) {
+    sendIdToClient(socketFd);
+}
+
+// BINARY_RECV: puts the user in receive mode.
+void binaryReceive(const struct binaryHeader *, string_view, int socketFd) {
+    struct chatUser *user = findUserBySocket(socketFd);
+    if (user != NULL) { setUserReceiving(user); }
+}
+
+// BINARY_LEAVE: disconnects the user.
+void binaryLeave(const struct binaryHeader *, string_view, int socketFd) {
+    disconnectUser(socketFd);
+}
+
+// BINARY_LOOKUP: sends the user id of the user named by the payload.
+void binaryLookup(const struct binaryHeader *, string_view payload, int socketFd) {
+    sendUserIdToClient(socketFd, payload);
+}
+
+/* ### Rate limit functions ### */
+
+// The names of the rate classes, as used by --rate-limit, RATE LIMITED and the metrics.
+static const char *rateClassNames[RATECLASSCOUNT] = {"broadcast", "private", "who", "change-id"};
+
+// Returns the rate class of a parsed text command. MSG counts as a broadcast when it is sent to ALL or to a room.
+enum rateClass rateClassOf(const struct parsedCommand *command) {
+    switch (command->verb) {
+        case VERB_MSG: return command->argument == "ALL" || isRoomName(command->argument) ? RATE_BROADCAST : RATE_PRIVATE;
+        case VERB_WHO: return RATE_WHO;
+        case VERB_CHANGE: return RATE_CHANGEID;
+        default: return RATE_NONE;
+    }
+}
+
+// Takes a token from the bucket of <rateClass> of the connection <socketFd>, refilling it first, and returns true
+// if there was one. Otherwise the command is counted as rate limited and the client is sent RATE LIMITED and the
+// class's name, a reply made once and shared, so refusing a flood of commands costs next to nothing.
+bool allowCommand(int socketFd, enum rateClass rateClass) {
+    if (rateClass == RATE_NONE || rateLimits[rateClass].capacity == 0) { return true; }
+    struct clientConnection *connection = findConnection(socketFd);
+    if (connection == NULL) { return true; }
+
+    // The timer wheel's tick is read once per wakeup of the server loop, which is as precise as needed here.
+    const struct rateLimit *limit = &rateLimits[rateClass];
+    struct tokenBucket *bucket = &connection->rateBuckets[rateClass];
+    uint64_t tickNow = localReactor->timers.currentTick;
+    uint64_t elapsedTicks = tickNow - bucket->lastRefillTick;
+    bucket->lastRefillTick = tickNow;
+    uint64_t refillUnits = elapsedTicks > limit->capacity / limit->unitsPerTick ? limit->capacity : elapsedTicks * limit->unitsPerTick;
+    bucket->units = min(limit->capacity, bucket->units + refillUnits);
+
+    if (bucket->units >= RATETOKENUNITS) {
+        bucket->units -= RATETOKENUNITS;
+        return true;
+    }
+
+    static const sharedPayload limitedReplies[RATECLASSCOUNT] = {
+        makeReply(string("RATE LIMITED ") + rateClassNames[RATE_BROADCAST]),
+        makeReply(string("RATE LIMITED ") + rateClassNames[RATE_PRIVATE]),
+        makeReply(string("RATE LIMITED ") + rateClassNames[RATE_WHO]),
+        makeReply(string("RATE LIMITED ") + rateClassNames[RATE_CHANGEID])
+    };
+    countMetric(&localReactor->metrics.rateLimitedCommands[rateClass], 1);
+    queueMessage(socketFd, limitedReplies[rateClass]);
+    return false;
+}
+
+// Sets a rate class's limit from a --rate-limit argument, CLASS=RATE,BURST. Returns false if it is malformed.
+bool parseRateLimit(const char *argument) {
+    char className[16];
+    double perSecond;
+    int burst;
+    if (sscanf(argument, "%15[^=]=%lf,%d", className, &perSecond, &burst) != 3 || perSecond < 0 || burst < 1) { return false; }
+
+    for (int i = 0; i < RATECLASSCOUNT; i++) {
+        if (strcmp(className, rateClassNames[i]) == 0) {
+            rateLimits[i].perSecond = perSecond;
+            rateLimits[i].burst = burst;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Works out the units of every rate class's limit from its rate and burst.
+void computeRateLimitUnits() {
+    for (int i = 0; i < RATECLASSCOUNT; i++) {
+        struct rateLimit *limit = &rateLimits[i];
+        if (limit->perSecond <= 0) {
+            limit->unitsPerTick = 0;
+            limit->capacity = 0;
+            continue;
+        }
+        limit->unitsPerTick = max((uint64_t)1, (uint64_t)llround(limit->perSecond * RATETOKENUNITS * TIMERTICKMILLISECONDS / 1000));
+        limit->capacity = (uint64_t)limit->burst * RATETOKENUNITS;
+    }
+}
+
+/* ### Server-side private functions ### */
+
+// This function is only called once upon server initialization. It opens the listening sockets and binds them to the
+// ports given with --ports, or else to the first three consecutive ports from PORTLOWERBOUND on which can be bound.
+// The global port variables are set and the ports are written to the port file. Exits if the sockets cannot be bound.
+void initializeServer(struct serverConfiguration *configurations) {
+    bool bound = false;
+    if (requestedPorts[SOCKET01] != 0) {
+        portA = requestedPorts[SOCKET01];
+        portB = requestedPorts[SOCKET02];
+        portC = requestedPorts[SOCKET03];
+        bound = bindListeningSocket(&configurations[SOCKET01], portA);
+        if (bound && !(bound = bindListeningSocket(&configurations[SOCKET02], portB))) { close(configurations[SOCKET01].serverSocketDescriptor); }
+        if (bound && !(bound = bindListeningSocket(&configurations[SOCKET03], portC))) {
+            close(configurations[SOCKET01].serverSocketDescriptor);
+            close(configurations[SOCKET02].serverSocketDescriptor);
+        }
+    }
+    else {
+        // Find three available and consecutive ports. Binding and listening is the test: a port which is in use
+        // fails at once. With SO_REUSEADDR two sockets which are not listening yet may both bind the same port, so
+        // a port only counts as ours once its socket listens, and then no one else can take it. When one of the
+        // three fails, the search goes on after it.
+        int i = PORTLOWERBOUND;
+        while (!bound && i <= PORTUPPERBOUND - 2) {
+            portA = i;
+            portB = i + 1;
+            portC = i + 2;
+            if (!bindListeningSocket(&configurations[SOCKET01], portA)) { i += 1; }
+            else if (!bindListeningSocket(&configurations[SOCKET02], portB)) {
+                close(configurations[SOCKET01].serverSocketDescriptor);
+                i += 2;
+            }
+            else if (!bindListeningSocket(&configurations[SOCKET03], portC)) {
+                close(configurations[SOCKET01].serverSocketDescriptor);
+                close(configurations[SOCKET02].serverSocketDescriptor);
+                i += 3;
+            }
+            else { bound = true; }
+        }
+    }
+
+    if (!bound) {
+        cout << "Could not bind the listening ports" << endl;
+        exit(1);
+    }
+
+    configurations[SOCKET01].portNumber = portA;
+    configurations[SOCKET02].portNumber = portB;
+    configurations[SOCKET03].portNumber = portC;
+
+    if (requestedPorts[SOCKET01] != 0) { cout << "Listening on the given ports: "; }
+    else { cout << "Three consecutive closed ports found: "; }
+    cout << "PortA = " << portA << ", PortB = " << portB << ", PortC = " << portC << endl << endl;
+    if (portFilePath != "") { writePortFile(); }
+}
+
+// Opens a non-blocking listening socket for <configuration>, binds it to <port> and sets it listening. Returns false,
+// leaving no socket open, if the port cannot be bound or listened on.
+bool bindListeningSocket(struct serverConfiguration *configuration, int port) {
+    configuration->serverSocketDescriptor = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (configuration->serverSocketDescriptor < 0) {
+        perror("SOCKET failure");
+        exit(1);
+    }
+
+    // Make the socket reusable.
+    int q = 1;
+    setsockopt(configuration->serverSocketDescriptor, SOL_SOCKET, SO_REUSEADDR, &q, sizeof(q));
+    if (reusePort) { setsockopt(configuration->serverSocketDescriptor, SOL_SOCKET, SO_REUSEPORT, &q, sizeof(q)); }
+
+    // Assign name to socket by binding the address to it.
+    memset(&configuration->serverSocketAddress, 0, sizeof configuration->serverSocketAddress);
+    configuration->serverSocketAddress.sin_family = AF_INET;
+    configuration->serverSocketAddress.sin_addr.s_addr = INADDR_ANY;
+    configuration->serverSocketAddress.sin_port = htons(port);
+    if (bind(configuration->serverSocketDescriptor, (struct sockaddr *)&configuration->serverSocketAddress, sizeof configuration->serverSocketAddress) < 0) {
+        close(configuration->serverSocketDescriptor);
+        return false;
+    }
+
+    // Mark the socket as open for connections. Another server which has bound the same port with SO_REUSEADDR
+    // and listened first makes this fail with EADDRINUSE, which means the port is taken. Every client knocks on
+    // all three ports, so they all get the same backlog; a full backlog drops SYNs and makes clients wait a
+    // second to retry.
+    if (listen(configuration->serverSocketDescriptor, listenBacklog) < 0) {
+        close(configuration->serverSocketDescriptor);
+        return false;
+    }
+    return true;
+}
+
+// Writes the three ports to the port file as "portA portB portC", the order the client takes them in. The file is
+// replaced as a whole, so a reader never sees it half written.
+void writePortFile() {
+    string temporaryPath = portFilePath + ".tmp";
+    FILE *portFile = fopen(temporaryPath.c_str(), "w");
+    if (portFile == NULL || fprintf(portFile, "%d %d %d\n", portA, portB, portC) < 0 || fclose(portFile) != 0 ||
+        rename(temporaryPath.c_str(), portFilePath.c_str()) < 0) {
+        perror("PORT FILE failure");
+        exit(1);
+    }
+}
+
+// This function is called when the same IP address has made the third knock. It reads its port attempt vector and
+// determines if the sequence is correct.
+bool checkPortSequence(const int *ports) {
+    // The sequence is portA -> portC -> portB.
+    return ports[SOCKET01] == portA && ports[SOCKET02] == portC && ports[SOCKET03] == portB;
+}
+
+// Closes a knock which has been counted with a reset instead of the usual closing handshake, so the socket is
+// freed at once and leaves nothing in TIME_WAIT.
+void resetConnection(int socketFd) {
+    struct linger lingerOption;
+    lingerOption.l_onoff = 1;
+    lingerOption.l_linger = 0;
+    setsockopt(socketFd, SOL_SOCKET, SO_LINGER, &lingerOption, sizeof lingerOption);
+    close(socketFd);
+}
+
+// Adds a socket to the local reactor's epoll instance, edge-triggered, watching for incoming data and for
+// the socket becoming writable again.
+void watchFileDescriptor(int fileDescriptor) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fileDescriptor;
+    if (epoll_ctl(localReactor->epollFileDescriptor, EPOLL_CTL_ADD, fileDescriptor, &event) < 0) { logSystemError("EPOLL_CTL_ADD failure"); }
+}
+
+// Creates a reactor thread's epoll instance and wakeup eventfd, and its io_uring if --io-backend asks for one.
+// Does not start the thread.
+struct reactorThread *createReactor(int reactorIndex) {
+    struct reactorThread *reactor = new reactorThread();
+    reactor->reactorIndex = reactorIndex;
+    reactor->mailboxHead.store(NULL);
+    reactor->freeMailboxItems = NULL;
+    reactor->returnedMailboxItems.store(NULL);
+
+    reactor->epollFileDescriptor = epoll_create1(0);
+    reactor->wakeupFileDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->epollFileDescriptor < 0 || reactor->wakeupFileDescriptor < 0) {
+        perror("EPOLL_CREATE error");
+        exit(1);
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = reactor->wakeupFileDescriptor;
+    epoll_ctl(reactor->epollFileDescriptor, EPOLL_CTL_ADD, reactor->wakeupFileDescriptor, &event);
+
+    // A kernel without everything the io_uring backend needs leaves the reactor on epoll.
+    reactor->ring = NULL;
+    if (requestedIoBackend == IO_URING) {
+        reactor->ring = createIoRing();
+        if (reactor->ring == NULL) { cout << "Reactor " << reactorIndex << " cannot use io_uring and uses epoll instead." << endl; }
+    }
+
+    return reactor;
+}
+
+// Runs the server loop of <reactor> on the calling thread. Reactor 0 is passed the listening socket
+// configurations, the others NULL.
+void runReactor(struct reactorThread *reactor, struct serverConfiguration *configurations) {
+    localReactor = reactor;
+    initializeTimerWheel();
+    if (reactor->ring != NULL) {
+        runRingReactor(reactor, configurations);
+        return;
+    }
+
+    // Server loop. Loops continuously and processes connection requests.
+    struct epoll_event readyEvents[MAXEPOLLEVENTS];
+    while (true) {
+        // We use epoll_wait() to handle connections from multiple clients. If a new connection
+        // passes the port knocking, it is accepted and the client's socket file descriptor
+        // is added to the epoll instance of one of the reactors. It returns only the descriptors
+        // that are ready to be read, so the cost of a wakeup does not depend on how many are watched.
+        // It waits no longer than until the reactor's next timer is due.
+        int readyCount = epoll_wait(reactor->epollFileDescriptor, readyEvents, MAXEPOLLEVENTS, timerTimeoutMilliseconds());
+        if (readyCount < 0) {
+            if (errno == EINTR) { continue; }
+            perror("EPOLL_WAIT error");
+            exit(1);
+        }
+
+        advanceTimers(currentTimerTick());
+
+        for (int i = 0; i < readyCount; i++) {
+            int readyDescriptor = readyEvents[i].data.fd;
+
+            // Another reactor has posted work to our mailbox.
+            if (readyDescriptor == reactor->wakeupFileDescriptor) {
+                drainMailbox();
+                continue;
+            }
+
+            // If the descriptor is one of the listening sockets, that means
+            // we have one or more new connections to knock with.
+            int listenerIndex = -1;
+            for (int j = 0; configurations != NULL && j < PORTAMOUNT; j++) {
+                if (configurations[j].serverSocketDescriptor == readyDescriptor) { listenerIndex = j; }
+            }
+
+            if (listenerIndex >= 0) {
+                acceptKnocks(&configurations[listenerIndex]);
+                continue;
+            }
+
+            // Otherwise it must be a connection from a client already registered with
+            // the epoll instance, either containing a message or ready to be written
+            // to again after its outbound queue filled the socket's send buffer.
+            struct clientConnection *connection = findConnection(readyDescriptor);
+            if (connection == NULL || connection->closing) { continue; }
+            if (readyEvents[i].events & EPOLLOUT) { flushOutboundQueue(connection); }
+            if (readyEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) { readFromClient(readyDescriptor); }
+        }
+
+        processPendingFlushes();
+        processPendingDisconnects();
+    }
+
+    // Close connections before termination.
+    for (size_t i = 0; i < reactor->users.slots.size(); i++) {
+       if (reactor->users.slots[i].inUse) { close(reactor->users.slots[i].socketFd); }
+    }
+
+    close(reactor->wakeupFileDescriptor);
+    close(reactor->epollFileDescriptor);
+}
+
+// Registers a socket which has passed the knocking sequence with the local reactor and tells the client.
+void adoptConnection(int socketFd) {
+    // Client sockets are accepted non-blocking so a slow reader can never stall the server loop.
+    struct clientConnection *connection = acquireConnection(socketFd);
+    if (localReactor->ring != NULL) { armReceive(connection); }
+    else { watchFileDescriptor(socketFd); }
+    countMetric(&localReactor->metrics.connectionsOpened, 1);
+
+    static const sharedPayload welcome = makeReply("KNOCK SUCCESS");
+    queueMessage(socketFd, welcome);
+}
+
+// Returns the connection of <socketFd> on the local reactor, or NULL if it has none.
+struct clientConnection *findConnection(int socketFd) {
+    uint32_t slotIndex = slotForSocketFd(&localReactor->connectionSlotBySocketFd, socketFd);
+    if (slotIndex == NOSLOT) { return NULL; }
+    return &localReactor->connectionSlots[slotIndex];
+}
+
+// Takes a slot for <socketFd> from the local reactor's connection pool, reusing a released one if there is one,
+// and resets it.
+struct clientConnection *acquireConnection(int socketFd) {
+    uint32_t slotIndex;
+    if (!localReactor->freeConnectionSlots.empty()) {
+        slotIndex = localReactor->freeConnectionSlots.back();
+        localReactor->freeConnectionSlots.pop_back();
+    }
+    else {
+        slotIndex = localReactor->connectionSlots.size();
+        localReactor->connectionSlots.push_back(clientConnection());
+        localReactor->connectionSlots[slotIndex].keepaliveTimer = createTimer(TIMER_KEEPALIVE, slotIndex);
+    }
+    setSlotForSocketFd(&localReactor->connectionSlotBySocketFd, socketFd, slotIndex);
+
+    struct clientConnection *connection = &localReactor->connectionSlots[slotIndex];
+    connection->socketFd = socketFd;
+    connection->closing = false;
+    connection->flushScheduled = false;
+    connection->binaryProtocol = false;
+    connection->receiveArmed = false;
+    connection->sendInFlight = false;
+    connection->released = false;
+    connection->messagesInFlight = 0;
+    connection->headBytesSent = 0;
+    connection->queuedBytes = 0;
+    connection->peakQueuedMessages = 0;
+    connection->droppedMessages = 0;
+    for (int i = 0; i < RATECLASSCOUNT; i++) {
+        connection->rateBuckets[i].units = rateLimits[i].capacity;
+        connection->rateBuckets[i].lastRefillTick = localReactor->timers.currentTick;
+    }
+    connection->lastActivityTick = localReactor->timers.currentTick;
+    connection->pingSent = false;
+    scheduleKeepalive(connection);
+
+    // A read buffer which grew for large frames goes back to its initial size.
+    connection->readBuffer.readIndex = 0;
+    connection->readBuffer.writeIndex = 0;
+    if (connection->readBuffer.storage.size() > INITIALREADBUFFERSIZE) { vector<char>(INITIALREADBUFFERSIZE).swap(connection->readBuffer.storage); }
+
+    // The counters are reused unless STATS of the previous user is still reading them.
+    if (connection->publishedCounters.use_count() != 1) { connection->publishedCounters = make_shared<struct queueCounters>(); }
+    publishQueueCounters(connection);
+    return connection;
+}
+
+// Returns the slot of <socketFd> to the local reactor's connection pool. Its queued messages are dropped but the
+// storage of its buffers is kept for the next connection. With io_uring this waits for its recv and send to complete.
+void releaseConnection(int socketFd) {
+    uint32_t slotIndex = slotForSocketFd(&localReactor->connectionSlotBySocketFd, socketFd);
+    if (slotIndex == NOSLOT) { return; }
+    setSlotForSocketFd(&localReactor->connectionSlotBySocketFd, socketFd, NOSLOT);
+
+    // An io_uring recv or send of the connection still refers to its slot, and the send to its queued messages,
+    // so the slot is freed once they have completed. See completeReceive and completeSend.
+    struct clientConnection *connection = &localReactor->connectionSlots[slotIndex];
+    cancelTimer(connection->keepaliveTimer);
+    if (connection->receiveArmed || connection->sendInFlight) {
+        connection->closing = true;
+        connection->released = true;
+        return;
+    }
+    freeConnectionSlot(slotIndex);
+}
+
+// Empties the connection in <slotIndex> and puts the slot on the local reactor's free list.
+void freeConnectionSlot(uint32_t slotIndex) {
+    // Whatever was still queued no longer counts towards the reactor's queued totals.
+    struct clientConnection *connection = &localReactor->connectionSlots[slotIndex];
+    connection->outboundQueue.clear();
+    connection->headBytesSent = 0;
+    connection->queuedBytes = 0;
+    publishQueueCounters(connection);
+    localReactor->freeConnectionSlots.push_back(slotIndex);
+}
+
+// Returns the slot <table> gives <socketFd>, or NOSLOT.
+uint32_t slotForSocketFd(const vector<uint32_t> *table, int socketFd) {
+    if (socketFd < 0 || (size_t)socketFd >= table->size()) { return NOSLOT; }
+    return (*table)[socketFd];
+}
+
+// Sets the slot <table> gives <socketFd>, growing the table if needed.
+void setSlotForSocketFd(vector<uint32_t> *table, int socketFd, uint32_t slotIndex) {
+    if ((size_t)socketFd >= table->size()) { table->resize(max((size_t)socketFd + 1, table->size() * 2), NOSLOT); }
+    (*table)[socketFd] = slotIndex;
+}
+
+// Is called when one of the listening sockets is readable. Accepts every pending connection on it and updates
+// the knocking state of each connecting IP address. A connection which completes the sequence is kept open.
+void acceptKnocks(struct serverConfiguration *configuration) {
+    // This address variable is used to peek at incoming connection requests during
+    // the knocking sequence. To access the IP address in order to use it as a key
+    // for the port knocking table.
+    struct sockaddr_storage connectingClientAddress;
+    socklen_t connectingClientAddressSize;
+
+    // The listening sockets are edge-triggered, so all pending connections
+    // must be accepted before we return to the server loop.
+    while (true) {
+        // We accept the connection. If the port sequence has not be finished or done incorrectly
+        // this accepted connection will be closed immediately, see below. We need to accept it
+        // temporarily during the knocking sequence to access the client's IP address in order to
+        // maintain his knock sequence status in the knocking map.
+        // The knocking sequence is portA -> portC -> portB
+        // Once a correct knocking sequence has been made, the last knock must have been on portB
+        // (SOCKET02), in that case the connection will not be closed but kept open on that port.
+        connectingClientAddressSize = sizeof connectingClientAddress;
+        int newClientSocketDescriptor = accept4(configuration->serverSocketDescriptor, (struct sockaddr *)&connectingClientAddress, &connectingClientAddressSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newClientSocketDescriptor < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { logSystemError("ACCEPT failure"); }
+            return;
+        }
+
+        handleKnock(configuration, newClientSocketDescriptor, &connectingClientAddress);
+    }
+}
+
+// Updates the knocking state of the IP address in <clientAddress> with a connection accepted on the listening
+// socket of <configuration>. A connection which completes the sequence is kept open, any other is closed.
+void handleKnock(struct serverConfiguration *configuration, int socketFd, const struct sockaddr_storage *clientAddress) {
+    unsigned char clientIpAddress[KNOCKADDRESSSIZE];
+
+    int portNum = configuration->portNumber;
+    countMetric(&localReactor->metrics.knocks, 1);
+    logToConsole("Knock at: %d", portNum);
+    knockAddressFromSocketAddress(clientAddress, clientIpAddress);
+
+    // If the client address is starting a knocking sequence,
+    // the starting time is set for this IP address.
+    uint64_t tickNow = localReactor->timers.currentTick;
+    struct connectionInProgress *knockState = findKnockState(clientIpAddress);
+    if (knockState == NULL) { knockState = createKnockState(clientIpAddress, tickNow); }
+
+    // The port knocking sequence must be performed within 2 minutes. Here we are
+    // measuring the elapsed time sinced first knock.
+    uint64_t elapsedTicks = tickNow - knockState->startTick;
+
+    // If time since the first knock of the sequence is more or equal then 120 sec(2 min), a message
+    // is sent to the client that a timeout has occured. Expired knocks are normally removed by the
+    // timer wheel before this can happen.
+    if (elapsedTicks >= secondsToTicks(KNOCKWINDOWSECONDS)) {
+        static const sharedPayload fail = makeReply("TIMEOUT FAIL");
+        countMetric(&localReactor->metrics.failedKnocks, 1);
+        send(socketFd, fail->data(), fail->length(), MSG_NOSIGNAL);
+        close(socketFd);
+        removeKnockState(knockState);
+        return;
+    }
+
+    // Record the port number attempt for the client address.
+    knockState->portAttempts[knockState->attemptCount++] = portNum;
+
+    // If number of attempts are 3 it is time to check if the knocking sequence
+    // is correct, and send the client a success or failure message of the matter.
+    if (knockState->attemptCount == PORTAMOUNT) {
+
+        // If the sequence is correct the client file descriptor is added to the epoll
+        // instance and a success message is sent to the client.
+        // Else a fail message is sent.
+        if (checkPortSequence(knockState->portAttempts)) {
+            logToConsole("Connected!");
+
+            // The connections are spread over the reactors in turn.
+            struct reactorThread *owner = reactors[nextReactorIndex];
+            nextReactorIndex = (nextReactorIndex + 1) % reactorCount;
+            if (owner == localReactor) { adoptConnection(socketFd); }
+            else {
+                struct mailboxItem *item = takeMailboxItem(MAILBOX_ADOPT_CONNECTION);
+                item->socketFd = socketFd;
+                postToReactor(owner, item);
+            }
+        }
+        else {
+            static const sharedPayload fail = makeReply("KNOCK FAIL");
+            countMetric(&localReactor->metrics.failedKnocks, 1);
+            send(socketFd, fail->data(), fail->length(), MSG_NOSIGNAL);
+            close(socketFd);
+        }
+
+        // The knock state for this address is removed so another attempt
+        // can be made should the client disconnect and reconnect later.
+        removeKnockState(knockState);
+    }
+    else {
+        // The knocking sequence is unfinished. Reset the connection.
+        resetConnection(socketFd);
+    }
+}
+
+// Is called when a client socket is readable. Reads until the socket is drained, appending to the connection's
+// read buffer, and hands every complete frame to checkAPI. A closed or failed socket, or a frame larger than
+// MAXFRAMEPAYLOADSIZE, disconnects the user.
+void readFromClient(int socketFileDescriptor) {
+    struct clientConnection *connection = findConnection(socketFileDescriptor);
+    struct inputRingBuffer *readBuffer = &connection->readBuffer;
+    struct reactorMetrics *metrics = &localReactor->metrics;
+
+    // The socket is edge-triggered, so we keep reading until the kernel has nothing more for us.
+    while (true) {
+        size_t writableLength;
+        char *writableRegion = ringBufferWritableRegion(readBuffer, &writableLength);
+        if (writableLength == 0) {
+            // Cannot happen with well formed frames since the buffer can always hold one complete frame.
+            disconnectUser(socketFileDescriptor);
+            return;
+        }
+
+        int bytesReceived = recv(socketFileDescriptor, writableRegion, writableLength, MSG_DONTWAIT);
+        countMetric(&metrics->receiveCalls, 1);
+        if (bytesReceived < 0) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+            logSystemError("RECV failure");
+            disconnectUser(socketFileDescriptor);
+            return;
+        }
+
+        // The client has closed his end of the connection without sending LEAVE.
+        if (bytesReceived == 0) {
+            disconnectUser(socketFileDescriptor);
+            return;
+        }
+        readBuffer->writeIndex += bytesReceived;
+        countMetric(&metrics->bytesReceived, bytesReceived);
+
+        if (!processFrames(connection)) { return; }
+    }
+}
+
+// Hands every complete frame in the connection's read buffer to checkAPI or checkBinaryAPI. A single read may
+// contain many pipelined commands, and the last one may be incomplete, in which case it stays buffered. The header
+// size is looked up for every frame, as CONNECT may switch to the binary protocol. Returns false if the connection
+// has been closed, by LEAVE or for a frame larger than MAXFRAMEPAYLOADSIZE.
+bool processFrames(struct clientConnection *connection) {
+    int socketFd = connection->socketFd;
+    struct inputRingBuffer *readBuffer = &connection->readBuffer;
+
+    // Anything the client sends shows it is still there, whether or not it is a whole frame.
+    connection->lastActivityTick = localReactor->timers.currentTick;
+    connection->pingSent = false;
+
+    while (true) {
+        bool binaryProtocol = connection->binaryProtocol;
+        size_t headerSize = binaryProtocol ? BINARYHEADERSIZE : FRAMEHEADERSIZE;
+        if (ringBufferSize(readBuffer) < headerSize) { break; }
+        struct binaryHeader header;
+        uint32_t payloadLength;
+        if (binaryProtocol) {
+            decodeBinaryHeader(ringBufferContiguous(readBuffer, BINARYHEADERSIZE), &header);
+            payloadLength = header.payloadLength;
+        }
+        else { payloadLength = decodeFrameHeader(ringBufferContiguous(readBuffer, FRAMEHEADERSIZE)); }
+        if (payloadLength > MAXFRAMEPAYLOADSIZE) {
+            disconnectUser(socketFd);
+            return false;
+        }
+        if (ringBufferSize(readBuffer) < headerSize + payloadLength) { break; }
+
+        // The message will be interpreted and proccessed in checkAPI or checkBinaryAPI.
+        const char *frame = ringBufferContiguous(readBuffer, headerSize + payloadLength);
+        readBuffer->readIndex += headerSize + payloadLength;
+        string_view payload(frame + headerSize, payloadLength);
+        uint64_t commandStart = monotonicNanoseconds();
+        if (binaryProtocol) { checkBinaryAPI(&header, payload, socketFd); }
+        else { checkAPI(payload, socketFd); }
+        recordLatency(&localReactor->metrics.commandLatency, monotonicNanoseconds() - commandStart);
+
+        // The command may have been LEAVE, in which case the socket is already closed.
+        if (findConnection(socketFd) == NULL) { return false; }
+    }
+    return true;
+}
+
+// Returns the number of bytes currently held by the ring buffer.
+size_t ringBufferSize(struct inputRingBuffer *ringBuffer) {
+    return ringBuffer->writeIndex - ringBuffer->readIndex;
+}
+
+// Returns a pointer to the largest contiguous free region of the ring buffer and stores its length in
+// <writableLength>. The buffer is doubled if it is full and still below MAXREADBUFFERSIZE. A length of
+// zero means the buffer is full and cannot grow.
+char *ringBufferWritableRegion(struct inputRingBuffer *ringBuffer, size_t *writableLength) {
+    size_t capacity = ringBuffer->storage.size();
+    size_t bufferedBytes = ringBufferSize(ringBuffer);
+
+    // Grow the buffer. The buffered bytes are copied to the start of the new storage.
+    if (bufferedBytes == capacity && capacity < MAXREADBUFFERSIZE) {
+        size_t newCapacity = capacity == 0 ? INITIALREADBUFFERSIZE : capacity * 2;
+        vector<char> newStorage(newCapacity);
+        if (bufferedBytes > 0) { memcpy(newStorage.data(), ringBufferContiguous(ringBuffer, bufferedBytes), bufferedBytes); }
+        ringBuffer->storage.swap(newStorage);
+        ringBuffer->readIndex = 0;
+        ringBuffer->writeIndex = bufferedBytes;
+        capacity = newCapacity;
+    }
+
+    // An empty buffer is rewound so the next read gets the whole storage in one piece.
+    if (bufferedBytes == 0) {
+        ringBuffer->readIndex = 0;
+        ringBuffer->writeIndex = 0;
+    }
+
+    // The free region runs from the write position to either the end of the storage or the read position.
+    size_t writeOffset = ringBuffer->writeIndex & (capacity - 1);
+    *writableLength = min(capacity - bufferedBytes, capacity - writeOffset);
+    return ringBuffer->storage.data() + writeOffset;
+}
+
+// Returns a pointer to the first <length> buffered bytes, rearranging the storage first if they wrap around
+// its end. <length> must not exceed ringBufferSize.
+const char *ringBufferContiguous(struct inputRingBuffer *ringBuffer, size_t length) {
+    size_t capacity = ringBuffer->storage.size();
+    size_t readOffset = ringBuffer->readIndex & (capacity - 1);
+
+    // Rotate the storage so the buffered bytes start at offset zero. This only happens when a
+    // frame straddles the end of the storage.
+    if (readOffset + length > capacity) {
+        size_t bufferedBytes = ringBufferSize(ringBuffer);
+        rotate(ringBuffer->storage.begin(), ringBuffer->storage.begin() + readOffset, ringBuffer->storage.end());
+        ringBuffer->readIndex = 0;
+        ringBuffer->writeIndex = bufferedBytes;
+        readOffset = 0;
+    }
+    return ringBuffer->storage.data() + readOffset;
+}
+
+// Reads the command line options. Exits with a usage message if an option is not recognized.
+void parseArguments(int argv, char *args[]) {
+    for (int i = 1; i < argv; i++) {
+        string option = args[i];
+        bool hasValue = i + 1 < argv;
+
+        if (option == "--overflow-policy" && hasValue) {
+            string policy = args[++i];
+            if (policy == "drop-oldest") { queueOverflowPolicy = OVERFLOW_DROP_OLDEST; }
+            else if (policy == "disconnect") { queueOverflowPolicy = OVERFLOW_DISCONNECT; }
+            else if (policy == "coalesce") { queueOverflowPolicy = OVERFLOW_COALESCE; }
+            else { option = ""; }
+        }
+        else if (option == "--max-queued-messages" && hasValue) { maxQueuedMessages = max(1, atoi(args[++i])); }
+        else if (option == "--max-queued-bytes" && hasValue) { maxQueuedBytes = max(1, atoi(args[++i])); }
+        else if (option == "--threads" && hasValue) { reactorCount = min(max(1, atoi(args[++i])), MAXREACTORTHREADS); }
+        else if (option == "--fortune-file" && hasValue) { fortuneFilePath = args[++i]; }
+        else if (option == "--change-id-interval" && hasValue) {
+            // The same as --rate-limit change-id=1/SECONDS,1, 0 meaning no limit.
+            int changeIdInterval = max(0, atoi(args[++i]));
+            rateLimits[RATE_CHANGEID].perSecond = changeIdInterval > 0 ? 1.0 / changeIdInterval : 0;
+            rateLimits[RATE_CHANGEID].burst = 1;
+        }
+        else if (option == "--rate-limit" && hasValue) {
+            if (!parseRateLimit(args[++i])) { option = ""; }
+        }
+        else if (option == "--ping-interval" && hasValue) { pingInterval = max(0, atoi(args[++i])); }
+        else if (option == "--idle-timeout" && hasValue) { idleTimeout = max(0, atoi(args[++i])); }
+        else if (option == "--message-log" && hasValue) { messageLogPath = args[++i]; }
+        else if (option == "--ports" && hasValue) {
+            if (sscanf(args[++i], "%d,%d,%d", &requestedPorts[SOCKET01], &requestedPorts[SOCKET02], &requestedPorts[SOCKET03]) != PORTAMOUNT) { option = ""; }
+            for (int j = 0; j < PORTAMOUNT; j++) {
+                if (requestedPorts[j] <= 0 || requestedPorts[j] > 65535 || requestedPorts[j] == requestedPorts[(j + 1) % PORTAMOUNT]) { option = ""; }
+            }
+        }
+        else if (option == "--reuse-port") { reusePort = true; }
+        else if (option == "--port-file" && hasValue) { portFilePath = args[++i]; }
+        else if (option == "--backlog" && hasValue) { listenBacklog = max(1, atoi(args[++i])); }
+        else if (option == "--metrics-port" && hasValue) {
+            metricsPort = atoi(args[++i]);
+            if (metricsPort <= 0 || metricsPort > 65535) { option = ""; }
+        }
+        else if (option == "--io-backend" && hasValue) {
+            string backend = args[++i];
+            if (backend == "epoll") { requestedIoBackend = IO_EPOLL; }
+            else if (backend == "io_uring") { requestedIoBackend = IO_URING; }
+            else { option = ""; }
+        }
+        else { option = ""; }
+
+        if (option == "") {
+            cout << "Usage: " << args[0] << " [--overflow-policy drop-oldest|disconnect|coalesce]";
+            cout << " [--max-queued-messages N] [--max-queued-bytes N] [--threads N]";
+            cout << " [--fortune-file PATH] [--change-id-interval SECONDS] [--message-log PATH]";
+            cout << " [--ports A,B,C] [--reuse-port] [--port-file PATH] [--backlog N] [--metrics-port PORT]";
+            cout << " [--io-backend epoll|io_uring] [--ping-interval SECONDS] [--idle-timeout SECONDS]";
+            cout << " [--rate-limit broadcast|private|who|change-id=RATE,BURST]..." << endl;
+            exit(1);
+        }
+    }
+    computeRateLimitUnits();
+
+    // Sharing ports found by the search with whichever server happens to hold them would be a mistake.
+    if (reusePort && requestedPorts[SOCKET01] == 0) {
+        cout << "--reuse-port can only be used with --ports" << endl;
+        exit(1);
+    }
+}
+
+/* ### Knock table functions ### */
+
+// Returns the table index an address hashes to, before probing.
+static int knockHomeIndex(const unsigned char *address) {
+    uint64_t high, low;
+    memcpy(&high, address, sizeof high);
+    memcpy(&low, address + sizeof high, sizeof low);
+    uint64_t hash = (high ^ (low * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+    return (hash ^ (hash >> 31)) & (KNOCKTABLECAPACITY - 1);
+}
+
+// Adds the entry at <index> to the end of the age list, as the newest knock.
+static void linkKnockState(int index) {
+    struct connectionInProgress *knockState = &portKnockingTable.entries[index];
+    knockState->previousByAge = portKnockingTable.newestIndex;
+    knockState->nextByAge = NOKNOCKINDEX;
+    if (portKnockingTable.newestIndex != NOKNOCKINDEX) { portKnockingTable.entries[portKnockingTable.newestIndex].nextByAge = index; }
+    else { portKnockingTable.oldestIndex = index; }
+    portKnockingTable.newestIndex = index;
+}
+
+// Removes the entry at <index> from the age list.
+static void unlinkKnockState(int index) {
+    struct connectionInProgress *knockState = &portKnockingTable.entries[index];
+    if (knockState->previousByAge != NOKNOCKINDEX) { portKnockingTable.entries[knockState->previousByAge].nextByAge = knockState->nextByAge; }
+    else { portKnockingTable.oldestIndex = knockState->nextByAge; }
+    if (knockState->nextByAge != NOKNOCKINDEX) { portKnockingTable.entries[knockState->nextByAge].previousByAge = knockState->previousByAge; }
+    else { portKnockingTable.newestIndex = knockState->previousByAge; }
+}
+
+// Moves the entry at <fromIndex> into the free entry at <toIndex>, keeping its place in the age list.
+static void moveKnockState(int fromIndex, int toIndex) {
+    struct connectionInProgress *knockState = &portKnockingTable.entries[toIndex];
+    *knockState = portKnockingTable.entries[fromIndex];
+    portKnockingTable.entries[fromIndex].inUse = false;
+    if (knockState->previousByAge != NOKNOCKINDEX) { portKnockingTable.entries[knockState->previousByAge].nextByAge = toIndex; }
+    else { portKnockingTable.oldestIndex = toIndex; }
+    if (knockState->nextByAge != NOKNOCKINDEX) { portKnockingTable.entries[knockState->nextByAge].previousByAge = toIndex; }
+    else { portKnockingTable.newestIndex = toIndex; }
+}
+
+// Empties the knock table. Is called once on startup.
+void initializeKnockTable() {
+    for (int i = 0; i < KNOCKTABLECAPACITY; i++) { portKnockingTable.entries[i].inUse = false; }
+    portKnockingTable.oldestIndex = NOKNOCKINDEX;
+    portKnockingTable.newestIndex = NOKNOCKINDEX;
+    portKnockingTable.entryCount = 0;
+    portKnockingTable.expiryTimer = NOTIMER;
+}
+
+// Writes the knock table key of a client address into <key>, KNOCKADDRESSSIZE bytes.
+void knockAddressFromSocketAddress(const struct sockaddr_storage *socketAddress, unsigned char *key) {
+    memset(key, 0, KNOCKADDRESSSIZE);
+    if (socketAddress->ss_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)socketAddress)->sin6_addr, KNOCKADDRESSSIZE);
+    }
+    else {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)socketAddress)->sin_addr, 4);
+    }
+}
+
+// Returns the knock in progress for <address>, or NULL if there is none.
+struct connectionInProgress *findKnockState(const unsigned char *address) {
+    for (int index = knockHomeIndex(address); portKnockingTable.entries[index].inUse; index = (index + 1) & (KNOCKTABLECAPACITY - 1)) {
+        if (memcmp(portKnockingTable.entries[index].address, address, KNOCKADDRESSSIZE) == 0) { return &portKnockingTable.entries[index]; }
+    }
+    return NULL;
+}
+
+// Starts a knock in progress for <address> at timer tick <tickNow>, evicting the oldest one if the table is too
+// full. <address> must not be in the table already. Must be called on reactor 0.
+struct connectionInProgress *createKnockState(const unsigned char *address, uint64_t tickNow) {
+    if (portKnockingTable.entryCount >= KNOCKTABLEMAXLOAD) { removeKnockState(&portKnockingTable.entries[portKnockingTable.oldestIndex]); }
+
+    int index = knockHomeIndex(address);
+    while (portKnockingTable.entries[index].inUse) { index = (index + 1) & (KNOCKTABLECAPACITY - 1); }
+
+    struct connectionInProgress *knockState = &portKnockingTable.entries[index];
+    memcpy(knockState->address, address, KNOCKADDRESSSIZE);
+    knockState->inUse = true;
+    knockState->attemptCount = 0;
+    knockState->startTick = tickNow;
+    linkKnockState(index);
+    portKnockingTable.entryCount++;
+
+    // The timer is only moved when the knock is the only one. Otherwise it is already set for an older one.
+    if (portKnockingTable.expiryTimer == NOTIMER) { portKnockingTable.expiryTimer = createTimer(TIMER_KNOCKS, 0); }
+    if (portKnockingTable.entryCount == 1) { scheduleTimer(portKnockingTable.expiryTimer, tickNow + secondsToTicks(KNOCKWINDOWSECONDS)); }
+    return knockState;
+}
+
+// Removes a knock in progress from the table. Other entries may be moved, so no pointers into the table may be
+// used after this.
+void removeKnockState(struct connectionInProgress *knockState) {
+    int emptyIndex = knockState - portKnockingTable.entries;
+    unlinkKnockState(emptyIndex);
+    portKnockingTable.entries[emptyIndex].inUse = false;
+    portKnockingTable.entryCount--;
+
+    // Backward shift deletion: move later entries of the probe sequence into the hole as long as
+    // that does not put them before their home index, so lookups never need tombstones.
+    int index = emptyIndex;
+    while (true) {
+        index = (index + 1) & (KNOCKTABLECAPACITY - 1);
+        struct connectionInProgress *candidate = &portKnockingTable.entries[index];
+        if (!candidate->inUse) { return; }
+
+        int home = knockHomeIndex(candidate->address);
+        bool reachableFromHole = emptyIndex <= index ? (home <= emptyIndex || home > index) : (home <= emptyIndex && home > index);
+        if (!reachableFromHole) { continue; }
+
+        moveKnockState(index, emptyIndex);
+        emptyIndex = index;
+    }
+}
+
+// Removes every knock in progress whose window has passed and sets the knock table's timer for the oldest
+// knock left. Is called when that timer fires.
+void expireKnockStates() {
+    uint64_t tickNow = localReactor->timers.currentTick;
+    uint64_t windowTicks = secondsToTicks(KNOCKWINDOWSECONDS);
+    while (portKnockingTable.oldestIndex != NOKNOCKINDEX) {
+        struct connectionInProgress *oldest = &portKnockingTable.entries[portKnockingTable.oldestIndex];
+        if (tickNow - oldest->startTick < windowTicks) {
+            scheduleTimer(portKnockingTable.expiryTimer, oldest->startTick + windowTicks);
+            return;
+        }
+        removeKnockState(oldest);
+    }
+}
+
+/* ### Server Id functions ### */
+
+// Memory-maps the fortune file at <path>, a list of fortunes separated by lines holding a single %, and indexes
+// its short fortunes into fortuneCorpus. Returns false if the file cannot be read or holds no short fortunes.
+bool loadFortuneCorpus(const string &path) {
+    int fortuneFileDescriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fortuneFileDescriptor < 0) { return false; }
+
+    struct stat fileStatus;
+    if (fstat(fortuneFileDescriptor, &fileStatus) < 0 || fileStatus.st_size == 0) {
+        close(fortuneFileDescriptor);
+        return false;
+    }
+
+    // The mapping is never unmapped, the corpus is used for as long as the server runs.
+    const char *corpus = (const char *)mmap(NULL, fileStatus.st_size, PROT_READ, MAP_PRIVATE, fortuneFileDescriptor, 0);
+    close(fortuneFileDescriptor);
+    if (corpus == MAP_FAILED) { return false; }
+
+    // Walk the file line by line. A line holding only % ends the current fortune.
+    const char *fileEnd = corpus + fileStatus.st_size;
+    const char *fortuneStart = corpus;
+    const char *lineStart = corpus;
+    while (lineStart < fileEnd) {
+        const char *lineEnd = (const char *)memchr(lineStart, '\n', fileEnd - lineStart);
+        if (lineEnd == NULL) { lineEnd = fileEnd; }
+
+        bool separator = lineEnd - lineStart == 1 && lineStart[0] == '%';
+        if (separator || lineEnd == fileEnd) {
+            const char *fortuneEnd = separator ? lineStart : fileEnd;
+            size_t length = fortuneEnd - fortuneStart;
+            if (length > 0 && length <= SHORTFORTUNELENGTH) {
+                struct fortuneEntry entry;
+                entry.text = fortuneStart;
+                entry.length = length;
+                fortuneCorpus.push_back(entry);
+            }
+            fortuneStart = lineEnd + 1;
+        }
+        lineStart = lineEnd + 1;
+    }
+
+    return !fortuneCorpus.empty();
+}
+
+// Returns a short fortune. It is sampled from fortuneCorpus if it is loaded, otherwise fortune -s is run.
+string getFortune(mt19937 *randomGenerator) {
+    string fortune = "";
+
+    if (!fortuneCorpus.empty()) {
+        uniform_int_distribution<size_t> distribution(0, fortuneCorpus.size() - 1);
+        struct fortuneEntry *entry = &fortuneCorpus[distribution(*randomGenerator)];
+        fortune.assign(entry->text, entry->length);
+        return fortune;
+    }
+
+    FILE *stream = popen("fortune -s", "r");
+    if (stream == NULL) { return fortune; }
+    char inStream[XLARGEBUFFERSIZE];
+    while (fgets(inStream, XLARGEBUFFERSIZE, stream) != NULL)
+    {
+        fortune.append(inStream);
+    }
+    pclose(stream);
+    return fortune;
+}
+
+// Runs on its own thread. Waits for Id change requests and carries them out.
+void runIdWorker() {
+    while (true) {
+        string groupInitials;
+        {
+            unique_lock<mutex> requestLock(idRequestMutex);
+            idRequestCondition.wait(requestLock, [] { return idRequestPending; });
+            idRequestPending = false;
+            groupInitials = idRequestGroupInitials;
+        }
+        setId(groupInitials);
+    }
+}
+
+/* ### User registry functions ### */
+
+// Claims <userName> in the user directory and adds the user to the local reactor's registry. Returns false,
+// changing nothing, if the name is already taken. The caller must make sure the socket is not registered yet.
+bool registerUser(string_view userName, int socketFd) {
+    if (userName.length() > MAXUSERNAMELENGTH) { return false; }
+    struct userNameKey key = makeUserNameKey(userName);
+    struct userRegistry *users = &localReactor->users;
+    struct directoryShard *shard = directoryShardFor(userName);
+    lock_guard<mutex> shardLock(shard->shardMutex);
+    if (shard->entries.count(key) != 0) { return false; }
+
+    // Reuse a released slot if there is one.
+    uint32_t slotIndex;
+    if (!users->freeSlots.empty()) {
+        slotIndex = users->freeSlots.back();
+        users->freeSlots.pop_back();
+    }
+    else {
+        // Every slot must fit in a user id.
+        slotIndex = users->slots.size();
+        if (slotIndex >= (1U << USERIDSLOTBITS)) { return false; }
+        users->slots.push_back(chatUser());
+        users->slots[slotIndex].generation = 0;
+    }
+
+    struct chatUser *user = &users->slots[slotIndex];
+    memcpy(user->userName, key.text, sizeof user->userName);
+    user->socketFd = socketFd;
+    user->isReceiving = false;
+    user->inUse = true;
+    user->receivingIndex = -1;
+    setSlotForSocketFd(&users->slotBySocketFd, socketFd, slotIndex);
+    {
+        lock_guard<mutex> historyLock(broadcastHistoryMutex);
+        user->broadcastSequence = broadcastHistory.nextSequence;
+    }
+
+    struct directoryEntry *entry = &shard->entries[key];
+    entry->reactorIndex = localReactor->reactorIndex;
+    entry->handle.slotIndex = slotIndex;
+    entry->handle.generation = user->generation;
+    entry->counters = findConnection(socketFd)->publishedCounters;
+    addToUserList(key);
+    return true;
+}
+
+// Removes the user owning <socketFd> from the local registry and the directory, if there is one. His slot
+// is recycled.
+void unregisterUser(int socketFd) {
+    struct userRegistry *users = &localReactor->users;
+    uint32_t slotIndex = slotForSocketFd(&users->slotBySocketFd, socketFd);
+    if (slotIndex == NOSLOT) { return; }
+    struct chatUser *user = &users->slots[slotIndex];
+
+    // Remove him from the receiving array by moving the last receiving user into his place.
+    if (user->receivingIndex >= 0) {
+        uint32_t lastSlotIndex = users->receivingUsers.back();
+        users->receivingUsers[user->receivingIndex] = lastSlotIndex;
+        users->slots[lastSlotIndex].receivingIndex = user->receivingIndex;
+        users->receivingUsers.pop_back();
+    }
+
+    partAllRooms(user);
+    setSlotForSocketFd(&users->slotBySocketFd, socketFd, NOSLOT);
+    {
+        struct directoryShard *shard = directoryShardFor(user->userName);
+        lock_guard<mutex> shardLock(shard->shardMutex);
+        struct userNameKey key = makeUserNameKey(user->userName);
+        shard->entries.erase(key);
+        removeFromUserList(key);
+    }
+
+    user->inUse = false;
+    user->isReceiving = false;
+    user->receivingIndex = -1;
+    user->userName[0] = '\0';
+    user->generation++;
+    users->freeSlots.push_back(slotIndex);
+}
+
+// Looks a username up in the user directory. Returns false if no such user is connected, otherwise fills in
+// <entry> if it is not NULL.
+bool lookupUserName(string_view userName, struct directoryEntry *entry) {
+    if (userName.length() > MAXUSERNAMELENGTH) { return false; }
+    struct directoryShard *shard = directoryShardFor(userName);
+    lock_guard<mutex> shardLock(shard->shardMutex);
+    userDirectoryMap::iterator found = shard->entries.find(makeUserNameKey(userName));
+    if (found == shard->entries.end()) { return false; }
+    if (entry != NULL) { *entry = found->second; }
+    return true;
+}
+
+// Returns the directory shard <userName> belongs to.
+struct directoryShard *directoryShardFor(string_view userName) {
+    return &userDirectory[hash<string_view>()(userName) % USERDIRECTORYSHARDS];
+}
+
+// Copies <userName>, which must not be longer than MAXUSERNAMELENGTH, into a user directory key.
+struct userNameKey makeUserNameKey(string_view userName) {
+    struct userNameKey key;
+    memcpy(key.text, userName.data(), userName.length());
+    key.text[userName.length()] = '\0';
+    return key;
+}
+
+// Returns the user owning the given socket, or NULL if the socket has not made a CONNECT.
+struct chatUser *findUserBySocket(int socketFd) {
+    struct userRegistry *users = &localReactor->users;
+    uint32_t slotIndex = slotForSocketFd(&users->slotBySocketFd, socketFd);
+    if (slotIndex == NOSLOT) { return NULL; }
+    return &users->slots[slotIndex];
+}
+
+// Returns the local user a handle refers to, or NULL if that user has left.
+struct chatUser *findUserByHandle(struct userHandle handle) {
+    struct userRegistry *users = &localReactor->users;
+    if (handle.slotIndex >= users->slots.size()) { return NULL; }
+    struct chatUser *user = &users->slots[handle.slotIndex];
+    if (!user->inUse || user->generation != handle.generation) { return NULL; }
+    return user;
+}
+
+// Returns the binary protocol's user id of the user with <handle> on reactor <reactorIndex>, see USERIDREACTORBITS.
+uint64_t makeUserId(int reactorIndex, struct userHandle handle) {
+    return (uint64_t)handle.generation << 32 | (uint64_t)handle.slotIndex << USERIDREACTORBITS | (uint64_t)reactorIndex;
+}
+
+// Splits <userId> into the reactor index and handle it was made of. Returns false if it names no reactor.
+bool splitUserId(uint64_t userId, int *reactorIndex, struct userHandle *handle) {
+    *reactorIndex = userId & ((1U << USERIDREACTORBITS) - 1);
+    handle->slotIndex = (userId >> USERIDREACTORBITS) & ((1U << USERIDSLOTBITS) - 1);
+    handle->generation = userId >> 32;
+    return *reactorIndex < reactorCount;
+}
+
+// Marks the user as receiving and adds him to the array of receiving users. He is first sent the messages to
+// everyone he missed since he logged in, as far as the history goes back.
+void setUserReceiving(struct chatUser *user) {
+    if (user->isReceiving) { return; }
+
+    // Messages already in the history when he catches up may still be on their way from other reactors.
+    // His broadcastSequence makes sure they are not sent to him again when they arrive.
+    vector<sharedPayload> missedMessages;
+    {
+        lock_guard<mutex> historyLock(broadcastHistoryMutex);
+        copyHistory(&broadcastHistory, user->broadcastSequence, &missedMessages);
+        user->broadcastSequence = broadcastHistory.nextSequence;
+    }
+    for (size_t i = 0; i < missedMessages.size(); i++) { queueMessage(user->socketFd, missedMessages[i]); }
+
+    user->isReceiving = true;
+    user->receivingIndex = localReactor->users.receivingUsers.size();
+    localReactor->users.receivingUsers.push_back(user - localReactor->users.slots.data());
+}
+
+/* ### User list functions ### */
+
+// Adds <userName> to the user list and records the login. The caller must hold the lock of the user's directory
+// shard.
+void addToUserList(const struct userNameKey &userName) {
+    lock_guard<mutex> listLock(connectedUsers.listMutex);
+    connectedUsers.indexByName[userName] = connectedUsers.names.size();
+    connectedUsers.names.push_back(userName);
+    if (!connectedUsers.replyText.empty()) { connectedUsers.replyText.push_back(' '); }
+    connectedUsers.replyText.append(userName.text);
+    recordUserListChange(true, userName);
+}
+
+// Removes <userName> from the user list and records the logout. The caller must hold the lock of the user's
+// directory shard.
+void removeFromUserList(const struct userNameKey &userName) {
+    lock_guard<mutex> listLock(connectedUsers.listMutex);
+    userIndexMap::iterator entry = connectedUsers.indexByName.find(userName);
+    if (entry == connectedUsers.indexByName.end()) { return; }
+
+    // Move the last name into his place.
+    uint32_t index = entry->second;
+    connectedUsers.indexByName.erase(entry);
+    if (index + 1 < connectedUsers.names.size()) {
+        connectedUsers.names[index] = connectedUsers.names.back();
+        connectedUsers.indexByName[connectedUsers.names[index]] = index;
+    }
+    connectedUsers.names.pop_back();
+    removeFromUserListReply(userName);
+    recordUserListChange(false, userName);
+}
+
+// Bumps the user list's version and records the login or logout of <userName> as the change to it. The caller
+// must hold the user list's lock.
+void recordUserListChange(bool joined, const struct userNameKey &userName) {
+    connectedUsers.version++;
+    struct userListChange *change = &connectedUsers.changes[connectedUsers.version & (USERLISTCHANGES - 1)];
+    change->joined = joined;
+    change->userName = userName;
+}
+
+// Cuts <userName> and a space next to it out of the user list's reply text. The caller must hold the user list's
+// lock.
+void removeFromUserListReply(const struct userNameKey &userName) {
+    string &text = connectedUsers.replyText;
+    size_t length = strlen(userName.text);
+
+    // Names hold no spaces, so the name is the match with a space or the end of the text on both sides.
+    size_t position = text.find(userName.text);
+    while (position != string::npos) {
+        size_t end = position + length;
+        if ((position == 0 || text[position - 1] == ' ') && (end == text.length() || text[end] == ' ')) { break; }
+        position = text.find(userName.text, position + 1);
+    }
+    if (position == string::npos) { return; }
+
+    if (position > 0) { text.erase(position - 1, length + 1); }
+    else { text.erase(0, min(length + 1, text.length())); }
+}
+
+// Returns the reply to a plain WHO: every username, separated by spaces. It is made from the reply text when WHO is
+// first asked for after the list has changed, and shared until it changes again.
+sharedPayload userListReply() {
+    lock_guard<mutex> listLock(connectedUsers.listMutex);
+    if (connectedUsers.cachedReply == NULL || connectedUsers.cachedVersion != connectedUsers.version) {
+        connectedUsers.cachedReply = makeReply(connectedUsers.replyText);
+        connectedUsers.cachedVersion = connectedUsers.version;
+    }
+    return connectedUsers.cachedReply;
+}
+
+// Appends the user list's version and length and up to <count> usernames from position <offset> on to <reply>,
+// separated by spaces.
+void appendUserListPage(uint64_t offset, uint64_t count, string *reply) {
+    lock_guard<mutex> listLock(connectedUsers.listMutex);
+    size_t userCount = connectedUsers.names.size();
+    reply->append(to_string(connectedUsers.version)).append(" ").append(to_string(userCount));
+    offset = min<uint64_t>(offset, userCount);
+    count = min<uint64_t>(min<uint64_t>(count, MAXWHOPAGESIZE), userCount - offset);
+    if (count > 0) {
+        reply->push_back(' ');
+        appendUserNames(offset, offset + count, reply);
+    }
+}
+
+// Appends the user list's version to <reply>, followed by the logins (+name) and logouts (-name) made since
+// version <sinceVersion>, oldest first. If they are no longer all known, it is followed by * and every username.
+void appendUserListChanges(uint64_t sinceVersion, string *reply) {
+    lock_guard<mutex> listLock(connectedUsers.listMutex);
+    uint64_t version = connectedUsers.version;
+    reply->append(to_string(version));
+    if (sinceVersion > version || version - sinceVersion > USERLISTCHANGES) {
+        reply->append(" *");
+        if (!connectedUsers.names.empty()) {
+            reply->push_back(' ');
+            appendUserNames(0, connectedUsers.names.size(), reply);
+        }
+        return;
+    }
+    for (uint64_t changeVersion = sinceVersion + 1; changeVersion <= version; changeVersion++) {
+        struct userListChange *change = &connectedUsers.changes[changeVersion & (USERLISTCHANGES - 1)];
+        reply->append(change->joined ? " +" : " -").append(change->userName.text);
+    }
+}
+
+// Appends the usernames from position <first> up to <last> to <reply>, separated by spaces. The caller must hold
+// the user list's lock.
+void appendUserNames(size_t first, size_t last, string *reply) {
+    for (size_t i = first; i < last; i++) {
+        if (i > first) { reply->push_back(' '); }
+        reply->append(connectedUsers.names[i].text);
+    }
+}
+
+/* ### Message history functions ### */
+
+// Makes <history> empty, keeping <size> messages.
+void initializeHistory(struct messageHistory *history, size_t size) {
+    history->entries.assign(size, sharedPayload());
+    history->nextSequence = 0;
+}
+
+// Adds <payload> to <history> and returns its sequence number. The caller must hold the history's lock.
+uint64_t appendToHistory(struct messageHistory *history, const sharedPayload &payload) {
+    uint64_t sequence = history->nextSequence++;
+    history->entries[sequence & (history->entries.size() - 1)] = payload;
+    return sequence;
+}
+
+// Appends the messages of <history> from sequence number <fromSequence> on, as far as they are still kept,
+// to <messages>. The caller must hold the history's lock.
+void copyHistory(const struct messageHistory *history, uint64_t fromSequence, vector<sharedPayload> *messages) {
+    uint64_t size = history->entries.size();
+    uint64_t oldestSequence = history->nextSequence > size ? history->nextSequence - size : 0;
+    for (uint64_t sequence = max(fromSequence, oldestSequence); sequence < history->nextSequence; sequence++) {
+        messages->push_back(history->entries[sequence & (size - 1)]);
+    }
+}
+
+/* ### Message log functions ### */
+
+// Opens the message log at messageLogPath, creating it if needed, cuts off a record left half written by a crash
+// and restores the message history from the end of the log. Exits if the file is not a message log.
+void openMessageLog() {
+    struct timespec startTime, endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    messageLogDescriptor = open(messageLogPath.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat fileStatus;
+    if (messageLogDescriptor < 0 || fstat(messageLogDescriptor, &fileStatus) < 0) {
+        perror("MESSAGE LOG failure");
+        exit(1);
+    }
+
+    size_t logSize = fileStatus.st_size;
+    if (logSize == 0) {
+        if (write(messageLogDescriptor, MESSAGELOGMAGIC, MESSAGELOGMAGICSIZE) != MESSAGELOGMAGICSIZE) {
+            perror("MESSAGE LOG failure");
+            exit(1);
+        }
+        messageLogSize = MESSAGELOGMAGICSIZE;
+        return;
+    }
+
+    // Only the pages near the end of the log are read, unless its last record is damaged.
+    const char *log = (const char *)mmap(NULL, logSize, PROT_READ, MAP_PRIVATE, messageLogDescriptor, 0);
+    if (log == MAP_FAILED) {
+        perror("MESSAGE LOG failure");
+        exit(1);
+    }
+    if (logSize < MESSAGELOGMAGICSIZE || memcmp(log, MESSAGELOGMAGIC, MESSAGELOGMAGICSIZE) != 0) {
+        cout << messageLogPath << " is not a message log" << endl;
+        exit(1);
+    }
+
+    // A crash while a batch was being written leaves a partial record at the end. Find the end of the last
+    // complete record by walking the log from the start, and cut off what follows it.
+    size_t validSize = logSize;
+    if (logRecordEndingAt(log, logSize) == 0) {
+        validSize = MESSAGELOGMAGICSIZE;
+        while (uint32_t recordLength = logRecordStartingAt(log, logSize, validSize)) { validSize += recordLength; }
+        if (validSize < logSize) {
+            cout << "Cutting " << logSize - validSize << " damaged bytes off the end of the message log" << endl;
+            if (ftruncate(messageLogDescriptor, validSize) < 0) {
+                perror("MESSAGE LOG failure");
+                exit(1);
+            }
+        }
+    }
+
+    messageLogSize = validSize;
+    size_t restoredRecords = restoreFromMessageLog(log, validSize);
+    munmap((void *)log, logSize);
+
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    double elapsedMilliseconds = (endTime.tv_sec - startTime.tv_sec) * 1000.0 + (endTime.tv_nsec - startTime.tv_nsec) / 1000000.0;
+    cout << "Restored " << restoredRecords << " messages from the message log in " << elapsedMilliseconds << " ms" << endl;
+}
+
+// Rebuilds the history of messages to everyone and of the rooms from the records in <log>, which is <logSize> bytes
+// long and ends with a complete record. Returns the number of records restored.
+size_t restoreFromMessageLog(const char *log, size_t logSize) {
+    // Walk back from the end to find where the restored records start. No history keeps more than the
+    // newest records, so the rest of the log is never touched.
+    size_t firstRecord = logSize;
+    size_t restoredRecords = 0;
+    // Every record on the way is checked, its leading length against its trailing one, so a damaged record is
+    // never restored. Only the records after it are.
+    while (restoredRecords < MESSAGELOGRESTORERECORDS && firstRecord > MESSAGELOGMAGICSIZE) {
+        uint32_t recordLength = logRecordEndingAt(log, firstRecord);
+        if (recordLength == 0) {
+            cout << "The message log is damaged before byte " << firstRecord << ", older messages are not restored" << endl;
+            break;
+        }
+        firstRecord -= recordLength;
+        restoredRecords++;
+    }
+
+    // Add them to the histories in the order they were sent. The server is not running yet, so the
+    // histories are not locked.
+    size_t recordStart = firstRecord;
+    while (recordStart < logSize) {
+        uint32_t recordLength = logRecordStartingAt(log, logSize, recordStart);
+        if (recordLength == 0) { break; }
+        const char *record = log + recordStart;
+        uint8_t kind = record[4];
+        uint8_t roomNameLength = record[5];
+        string_view message(record + 6 + roomNameLength, recordLength - LOGRECORDOVERHEAD - roomNameLength);
+        sharedPayload payload = makeMessage(message);
+
+        if (kind == LOGRECORDBROADCAST) { appendToHistory(&broadcastHistory, payload); }
+        else {
+            string room(record + 6, roomNameLength);
+            struct roomEntry *entry = &roomShardFor(room)->rooms[room];
+            if (entry->history.entries.empty()) {
+                entry->reactorMask = 0;
+                initializeHistory(&entry->history, ROOMHISTORYSIZE);
+            }
+            appendToHistory(&entry->history, payload);
+        }
+        recordStart += recordLength;
+    }
+    return restoredRecords;
+}
+
+// Returns the length of the record which ends at <recordEnd> in <log>, or 0 if there is no valid record there.
+uint32_t logRecordEndingAt(const char *log, size_t recordEnd) {
+    if (recordEnd < MESSAGELOGMAGICSIZE + LOGRECORDOVERHEAD) { return 0; }
+    uint32_t recordLength;
+    memcpy(&recordLength, log + recordEnd - 4, 4);
+    if (recordLength < LOGRECORDOVERHEAD || recordLength > recordEnd - MESSAGELOGMAGICSIZE) { return 0; }
+    return logRecordStartingAt(log, recordEnd, recordEnd - recordLength) == recordLength ? recordLength : 0;
+}
+
+// Returns the length of the record which starts at <recordStart> in <log>, <logSize> bytes long, or 0 if there is
+// no complete and valid record there.
+uint32_t logRecordStartingAt(const char *log, size_t logSize, size_t recordStart) {
+    if (logSize - recordStart < LOGRECORDOVERHEAD) { return 0; }
+    const char *record = log + recordStart;
+    uint32_t recordLength, trailingLength;
+    memcpy(&recordLength, record, 4);
+    if (recordLength < LOGRECORDOVERHEAD || recordLength > logSize - recordStart) { return 0; }
+    memcpy(&trailingLength, record + recordLength - 4, 4);
+
+    uint8_t kind = record[4];
+    uint8_t roomNameLength = record[5];
+    if (trailingLength != recordLength || recordLength < LOGRECORDOVERHEAD + (uint32_t)roomNameLength) { return 0; }
+    if (kind == LOGRECORDBROADCAST && roomNameLength == 0) { return recordLength; }
+    if (kind == LOGRECORDROOM && isRoomName(string_view(record + 6, roomNameLength))) { return recordLength; }
+    return 0;
+}
+
+// Hands <payload> to the log writer thread. Does nothing if there is no message log. The caller must hold the lock
+// of the history the message was added to, so the log keeps the messages of each channel in order.
+void logMessage(uint8_t kind, const string &roomName, const sharedPayload &payload) {
+    if (messageLogDescriptor < 0) { return; }
+
+    bool wasEmpty;
+    {
+        lock_guard<mutex> logLock(messageLogMutex);
+        if (messageLogStopped) { return; }
+        wasEmpty = pendingLogRecords.empty();
+        pendingLogRecords.push_back(logRecord());
+        struct logRecord *record = &pendingLogRecords.back();
+        record->kind = kind;
+        record->roomName = roomName;
+        record->payload = payload;
+    }
+    // The writer only sleeps when there is nothing left to write.
+    if (wasEmpty) { messageLogCondition.notify_one(); }
+}
+
+// Runs on its own thread. Writes the records added by logMessage to the message log and syncs them to disk, a
+// batch at a time.
+void runLogWriter() {
+    vector<struct logRecord> batch;
+    string buffer;
+    chrono::steady_clock::time_point lastSync = chrono::steady_clock::now();
+    while (true) {
+        {
+            unique_lock<mutex> logLock(messageLogMutex);
+            messageLogCondition.wait(logLock, [] { return !pendingLogRecords.empty(); });
+        }
+
+        // Give the batch until a sync interval has passed since the last sync to grow.
+        this_thread::sleep_until(lastSync + chrono::milliseconds(MESSAGELOGSYNCINTERVALMS));
+        {
+            lock_guard<mutex> logLock(messageLogMutex);
+            batch.swap(pendingLogRecords);
+        }
+        lastSync = chrono::steady_clock::now();
+
+        // Everything logged during the interval goes out in one write and one sync.
+        buffer.clear();
+        for (size_t i = 0; i < batch.size(); i++) {
+            struct logRecord *record = &batch[i];
+            string_view message = replyPayload(*record->payload);
+            uint32_t recordLength = LOGRECORDOVERHEAD + record->roomName.length() + message.length();
+            uint8_t header[2] = {record->kind, (uint8_t)record->roomName.length()};
+            buffer.append((const char *)&recordLength, 4).append((const char *)header, 2);
+            buffer.append(record->roomName).append(message).append((const char *)&recordLength, 4);
+        }
+        size_t recordCount = batch.size();
+        batch.clear();
+
+        size_t written = 0;
+        while (written < buffer.length()) {
+            ssize_t bytesWritten = write(messageLogDescriptor, buffer.data() + written, buffer.length() - written);
+            if (bytesWritten < 0) {
+                if (errno == EINTR) { continue; }
+                perror("MESSAGE LOG failure");
+                break;
+            }
+            written += bytesWritten;
+        }
+
+        // A batch written in part would leave a partial record in the middle of the log once the next batch is
+        // appended, so it is cut off again. If even that fails, the log is left as it is and nothing more is logged.
+        if (written < buffer.length()) {
+            if (ftruncate(messageLogDescriptor, messageLogSize) < 0) {
+                perror("MESSAGE LOG failure, no longer logging messages");
+                lock_guard<mutex> logLock(messageLogMutex);
+                messageLogStopped = true;
+                pendingLogRecords.clear();
+                return;
+            }
+            logToConsole("MESSAGE LOG failure, %zu messages not logged", recordCount);
+        }
+        else { messageLogSize += written; }
+        if (fdatasync(messageLogDescriptor) < 0) { perror("MESSAGE LOG failure"); }
+    }
+}
+
+/* ### Room functions ### */
+
+// Adds the user to the room <roomName>, creating it if it does not exist. Returns false if the name is not a
+// valid room name, the user is already in the room or is in too many rooms.
+bool joinRoom(struct chatUser *user, string_view roomName) {
+    if (!isRoomName(roomName) || user->rooms.size() >= MAXROOMSPERUSER) { return false; }
+    for (size_t i = 0; i < user->rooms.size(); i++) {
+        if (user->rooms[i].roomName == roomName) { return false; }
+    }
+
+    string room(roomName);
+    struct roomSubscribers *subscribers = &localReactor->rooms[room];
+
+    // The first local member announces this reactor in the room directory.
+    if (subscribers->memberSlots.empty()) {
+        struct roomShard *shard = roomShardFor(room);
+        lock_guard<mutex> shardLock(shard->shardMutex);
+        struct roomEntry *entry = &shard->rooms[room];
+        // A room restored from the message log keeps its history.
+        if (entry->history.entries.empty()) { initializeHistory(&entry->history, ROOMHISTORYSIZE); }
+        entry->reactorMask |= 1ULL << localReactor->reactorIndex;
+    }
+
+    struct roomMembership membership;
+    membership.roomName = room;
+    membership.memberIndex = subscribers->memberSlots.size();
+    user->rooms.push_back(membership);
+    subscribers->memberSlots.push_back(user - localReactor->users.slots.data());
+    return true;
+}
+
+// Removes the user from the room <roomName>. Returns false if he is not in it. A room without members is
+// removed.
+bool partRoom(struct chatUser *user, string_view roomName) {
+    size_t membershipIndex = 0;
+    while (membershipIndex < user->rooms.size() && user->rooms[membershipIndex].roomName != roomName) { membershipIndex++; }
+    if (membershipIndex == user->rooms.size()) { return false; }
+
+    string room = user->rooms[membershipIndex].roomName;
+    uint32_t memberIndex = user->rooms[membershipIndex].memberIndex;
+    user->rooms[membershipIndex] = user->rooms.back();
+    user->rooms.pop_back();
+
+    // Remove him from the member array by moving the last member into his place.
+    struct roomSubscribers *subscribers = &localReactor->rooms[room];
+    uint32_t lastSlotIndex = subscribers->memberSlots.back();
+    subscribers->memberSlots[memberIndex] = lastSlotIndex;
+    subscribers->memberSlots.pop_back();
+    if (memberIndex < subscribers->memberSlots.size()) {
+        vector<struct roomMembership> *movedRooms = &localReactor->users.slots[lastSlotIndex].rooms;
+        for (size_t i = 0; i < movedRooms->size(); i++) {
+            if ((*movedRooms)[i].roomName == room) { (*movedRooms)[i].memberIndex = memberIndex; }
+        }
+    }
+
+    // The last local member withdraws this reactor from the room directory.
+    if (subscribers->memberSlots.empty()) {
+        localReactor->rooms.erase(room);
+        struct roomShard *shard = roomShardFor(room);
+        lock_guard<mutex> shardLock(shard->shardMutex);
+        unordered_map<string, struct roomEntry>::iterator entry = shard->rooms.find(room);
+        entry->second.reactorMask &= ~(1ULL << localReactor->reactorIndex);
+        if (entry->second.reactorMask == 0) { shard->rooms.erase(entry); }
+    }
+    return true;
+}
+
+// Removes the user from every room he is in. Is called when he leaves the server.
+void partAllRooms(struct chatUser *user) {
+    while (!user->rooms.empty()) {
+        string room = user->rooms.back().roomName;
+        partRoom(user, room);
+    }
+}
+
+// Queues <payload> for every member of the room <roomName> connected to the local reactor, except the one
+// using <excludedSocketFd>.
+void sendToLocalRoomMembers(const string &roomName, const sharedPayload &payload, int excludedSocketFd) {
+    unordered_map<string, struct roomSubscribers>::iterator room = localReactor->rooms.find(roomName);
+    if (room == localReactor->rooms.end()) { return; }
+    uint64_t fanoutStart = monotonicNanoseconds();
+    struct userRegistry *users = &localReactor->users;
+    vector<uint32_t> *memberSlots = &room->second.memberSlots;
+    for (size_t i = 0; i < memberSlots->size(); i++) {
+        int memberSocketFd = users->slots[(*memberSlots)[i]].socketFd;
+        if (memberSocketFd != excludedSocketFd) { queueMessage(memberSocketFd, payload); }
+    }
+    recordLatency(&localReactor->metrics.fanoutLatency, monotonicNanoseconds() - fanoutStart);
+}
+
+// Adds <payload> to the history of <roomName> and returns the reactor threads which have members in the room,
+// one bit per reactor.
+uint64_t appendToRoomHistory(const string &roomName, const sharedPayload &payload) {
+    struct roomShard *shard = roomShardFor(roomName);
+    lock_guard<mutex> shardLock(shard->shardMutex);
+    unordered_map<string, struct roomEntry>::iterator entry = shard->rooms.find(roomName);
+    if (entry == shard->rooms.end()) { return 0; }
+    appendToHistory(&entry->second.history, payload);
+    logMessage(LOGRECORDROOM, roomName, payload);
+    return entry->second.reactorMask;
+}
+
+// Returns true if <roomName> starts with ROOMPREFIX and is a valid room name.
+bool isRoomName(string_view roomName) {
+    return roomName.length() > 1 && roomName.length() <= MAXROOMNAMELENGTH && roomName[0] == ROOMPREFIX;
+}
+
+// Returns the room directory shard <roomName> belongs to.
+struct roomShard *roomShardFor(const string &roomName) {
+    return &roomDirectory[hash<string>()(roomName) % USERDIRECTORYSHARDS];
+}
+
+/* ### Outbound queue functions ### */
+
+// Appends a payload to the outbound queue of the connection owning <socketFd> and schedules the queue to be
+// flushed after the current batch of events. Applies the overflow policy if the queue exceeds its bounds.
+void queueMessage(int socketFd, const sharedPayload &payload) {
+    struct clientConnection *connection = findConnection(socketFd);
+    if (connection == NULL || connection->closing) { return; }
+
+    connection->outboundQueue.push_back(payload);
+    connection->queuedBytes += payload->length();
+    if (connection->outboundQueue.size() > connection->peakQueuedMessages) { connection->peakQueuedMessages = connection->outboundQueue.size(); }
+
+    if (!connection->flushScheduled) {
+        connection->flushScheduled = true;
+        localReactor->pendingFlushes.push_back(socketFd);
     }
+
+    if (connection->outboundQueue.size() > maxQueuedMessages || connection->queuedBytes > maxQueuedBytes) { enforceQueueLimits(connection); }
+    publishQueueCounters(connection);
 }
 
-// This function finds user with socketFd == clientSocketDescriptor and sends him message.
-void sendMessageToUser(string message, int clientSocketDescriptor, string receivingUser) {
-    // Find user sending the message and the fd for the receiving user.
-    string sendingUser = "";
-    int receivingClientSocketDescriptor;
-    for (size_t i = 0; i < currentUsers.size(); i++) {
-        if (currentUsers[i].socketFd == clientSocketDescriptor) { sendingUser = currentUsers[i].userName; }
-        if (currentUsers[i].userName == receivingUser) { receivingClientSocketDescriptor = currentUsers[i].socketFd; }
+// Sends as much of the connection's outbound queue as the socket accepts without blocking, gathering up to
+// MAXIOVECSPERSEND messages into each sendmsg() call. Is called for every connection in pendingFlushes and
+// when a socket becomes writable again. With io_uring it queues a single send instead, see submitSend.
+void flushOutboundQueue(struct clientConnection *connection) {
+    if (localReactor->ring != NULL) {
+        submitSend(connection);
+        return;
     }
 
-    // Assemble the message.
-    message = "<PRIVATE> " + sendingUser + ": " + message;
+    struct iovec messageVectors[MAXIOVECSPERSEND];
+
+    while (!connection->outboundQueue.empty()) {
+        size_t vectorCount = gatherOutboundQueue(connection, messageVectors);
 
-    char sendMessageBuffer[message.length() + 1];
-    strcpy(sendMessageBuffer, message.c_str());
+        struct msghdr messageHeader;
+        memset(&messageHeader, 0, sizeof messageHeader);
+        messageHeader.msg_iov = messageVectors;
+        messageHeader.msg_iovlen = vectorCount;
 
-    // Send the message.
-    if (send(receivingClientSocketDescriptor, sendMessageBuffer, sizeof sendMessageBuffer, 0) < 0) { perror("server failure: failed to send message"); }
+        ssize_t bytesSent = sendmsg(connection->socketFd, &messageHeader, MSG_NOSIGNAL);
+        countMetric(&localReactor->metrics.sendCalls, 1);
+        if (bytesSent < 0) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+            logSystemError("server failure: failed to send message");
+            scheduleDisconnect(connection);
+            return;
+        }
+
+        consumeSentBytes(connection, bytesSent);
+    }
 }
 
-// This function removes the user from the main file descriptor set and closes his connection.
-void disconnectUser(int socketFileDescriptor) {
-    // Remove the user from fd_set.
-    FD_CLR(socketFileDescriptor, &mainFileDescriptorSet);
-    vector<chatUser> newUserList;
+// Points <messageVectors> at up to MAXIOVECSPERSEND payloads from the front of the connection's outbound queue,
+// starting with the unsent part of the head. Returns the number of vectors used.
+size_t gatherOutboundQueue(struct clientConnection *connection, struct iovec *messageVectors) {
+    size_t vectorCount = min(connection->outboundQueue.size(), (size_t)MAXIOVECSPERSEND);
+    for (size_t i = 0; i < vectorCount; i++) {
+        const string &payload = *connection->outboundQueue[i];
+        size_t skip = i == 0 ? connection->headBytesSent : 0;
+        messageVectors[i].iov_base = (void *)(payload.data() + skip);
+        messageVectors[i].iov_len = payload.length() - skip;
+    }
+    return vectorCount;
+}
 
-    // Update the user list.
-    for (size_t i = 0; i < currentUsers.size(); i++) {
-        if (currentUsers[i].socketFd != socketFileDescriptor) { newUserList.push_back(currentUsers[i]); }
+// Pops every payload which was sent completely by a send of <bytesSent> bytes from the connection's outbound
+// queue. The remainder of a partially sent one stays at the head.
+void consumeSentBytes(struct clientConnection *connection, size_t bytesSent) {
+    countMetric(&localReactor->metrics.bytesSent, bytesSent);
+    connection->queuedBytes -= bytesSent;
+    size_t bytesLeft = bytesSent + connection->headBytesSent;
+    connection->headBytesSent = 0;
+    while (bytesLeft > 0 && bytesLeft >= connection->outboundQueue.front()->length()) {
+        bytesLeft -= connection->outboundQueue.front()->length();
+        connection->outboundQueue.pop_front();
+    }
+    connection->headBytesSent = bytesLeft;
+    publishQueueCounters(connection);
+}
+
+// Flushes the outbound queue of every connection which had messages queued during the current batch of events.
+void processPendingFlushes() {
+    vector<int> *pendingFlushes = &localReactor->pendingFlushes;
+    for (size_t i = 0; i < pendingFlushes->size(); i++) {
+        struct clientConnection *connection = findConnection((*pendingFlushes)[i]);
+        if (connection == NULL) { continue; }
+        connection->flushScheduled = false;
+        if (!connection->closing) { flushOutboundQueue(connection); }
     }
-    currentUsers = newUserList;
+    pendingFlushes->clear();
+}
 
-    // Close connection.
-    close(socketFileDescriptor);
+// Copies the connection's queue statistics into its published counters. The change in its queue length and
+// size is added to the local reactor's totals.
+void publishQueueCounters(struct clientConnection *connection) {
+    struct queueCounters *counters = connection->publishedCounters.get();
+    struct reactorMetrics *metrics = &localReactor->metrics;
+    adjustMetric(&metrics->queuedMessages, (int64_t)connection->outboundQueue.size() - (int64_t)counters->queuedMessages.load(memory_order_relaxed));
+    adjustMetric(&metrics->queuedBytes, (int64_t)connection->queuedBytes - (int64_t)counters->queuedBytes.load(memory_order_relaxed));
+    counters->queuedMessages.store(connection->outboundQueue.size(), memory_order_relaxed);
+    counters->queuedBytes.store(connection->queuedBytes, memory_order_relaxed);
+    counters->peakQueuedMessages.store(connection->peakQueuedMessages, memory_order_relaxed);
+    counters->droppedMessages.store(connection->droppedMessages, memory_order_relaxed);
 }
 
-/* ### Server-side private functions ### */
+// Applies queueOverflowPolicy to a connection whose outbound queue exceeds maxQueuedMessages or maxQueuedBytes.
+void enforceQueueLimits(struct clientConnection *connection) {
+    deque<sharedPayload> *queue = &connection->outboundQueue;
 
-// This function is only called once upon server initialization. It is used to dynamically allocate listening ports
-// for the server. It scans the ports on the local machine for closed ports. When three consecutive closed ports
-// are found, the global port variables are set and the function terminates. It also configures the addresses as well
-// as binding them to the listening sockets. Finally, it makes the sockets non-blocking and sets their listening flags.
-void initializeServer(struct serverConfiguration *configurations) {
-    // Configure the addresses.
-    configurations[SOCKET01].serverSocketAddress.sin_family = AF_INET;
-    configurations[SOCKET01].serverSocketAddress.sin_addr.s_addr = INADDR_ANY;
-
-    configurations[SOCKET02].serverSocketAddress.sin_family = AF_INET;
-    configurations[SOCKET02].serverSocketAddress.sin_addr.s_addr = INADDR_ANY;
-
-    configurations[SOCKET03].serverSocketAddress.sin_family = AF_INET;
-    configurations[SOCKET03].serverSocketAddress.sin_addr.s_addr = INADDR_ANY;
-
-    // Find three available and consecutive ports. We simply portscan
-    // the range from PORTLOWERBOUND to PORTUPPERBOUND and check any
-    // three ports at a time.
-    for (int i = PORTLOWERBOUND; i < PORTUPPERBOUND - 2; i++) {
-        portA = i;
-        portB = i + 1;
-        portC = i + 2;
-
-        configurations[SOCKET01].serverSocketAddress.sin_port = htons(portA);
-        configurations[SOCKET02].serverSocketAddress.sin_port = htons(portB);
-        configurations[SOCKET03].serverSocketAddress.sin_port = htons(portC);
-
-        if (connect(configurations[SOCKET01].serverSocketDescriptor, (struct sockaddr *)&configurations[SOCKET01].serverSocketAddress, sizeof(configurations[SOCKET01].serverSocketAddress)) < 0) {
-            if (connect(configurations[SOCKET02].serverSocketDescriptor, (struct sockaddr *)&configurations[SOCKET02].serverSocketAddress, sizeof(configurations[SOCKET02].serverSocketAddress)) < 0) {
-                if (connect(configurations[SOCKET03].serverSocketDescriptor, (struct sockaddr *)&configurations[SOCKET03].serverSocketAddress, sizeof(configurations[SOCKET03].serverSocketAddress)) < 0) {
-                    configurations[SOCKET01].portNumber = portA;
-                    configurations[SOCKET02].portNumber = portB;
-                    configurations[SOCKET03].portNumber = portC;
-
-                    cout << "Three consecutive closed ports found: ";
-                    cout << "PortA = " << portA << ", PortB = " << portB << ", PortC = " << portC << endl << endl;
-                    break;
-                }
+    // Messages handed to an io_uring send are still being read by the kernel, so they are never touched.
+    size_t firstMovable = max(connection->headBytesSent > 0 ? (size_t)1 : 0, connection->messagesInFlight);
+
+    if (queueOverflowPolicy == OVERFLOW_DISCONNECT) {
+        scheduleDisconnect(connection);
+        return;
+    }
+
+    if (queueOverflowPolicy == OVERFLOW_COALESCE) {
+        // Merge everything behind the head, which may be partially sent, into one message.
+        // Only the byte bound can still be exceeded after that.
+        size_t coalesceIndex = max((size_t)1, firstMovable);
+        if (queue->size() > coalesceIndex + 1) {
+            shared_ptr<string> coalesced = make_shared<string>();
+            coalesced->reserve(connection->queuedBytes);
+            for (size_t i = coalesceIndex; i < queue->size(); i++) { coalesced->append(*(*queue)[i]); }
+            queue->erase(queue->begin() + coalesceIndex, queue->end());
+            queue->push_back(coalesced);
+        }
+        if (connection->queuedBytes > maxQueuedBytes) { scheduleDisconnect(connection); }
+        return;
+    }
+
+    // Drop the oldest messages, skipping the head if part of it has been sent already, since
+    // removing it would corrupt the stream. The newest message is always kept.
+    size_t dropIndex = firstMovable;
+    while ((queue->size() > maxQueuedMessages || connection->queuedBytes > maxQueuedBytes) && queue->size() > dropIndex + 1) {
+        connection->queuedBytes -= (*queue)[dropIndex]->length();
+        queue->erase(queue->begin() + dropIndex);
+        connection->droppedMessages++;
+        countMetric(&localReactor->metrics.droppedMessages, 1);
+    }
+}
+
+// Marks the connection for disconnection after the current batch of events.
+void scheduleDisconnect(struct clientConnection *connection) {
+    if (connection->closing) { return; }
+    connection->closing = true;
+    localReactor->pendingDisconnects.push_back(connection->socketFd);
+}
+
+// Disconnects every connection scheduled by scheduleDisconnect.
+void processPendingDisconnects() {
+    vector<int> *pendingDisconnects = &localReactor->pendingDisconnects;
+    for (size_t i = 0; i < pendingDisconnects->size(); i++) { disconnectUser((*pendingDisconnects)[i]); }
+    pendingDisconnects->clear();
+}
+
+/* ### Reactor mailbox functions ### */
+
+// Returns a mailbox item of type <type> from the local reactor's pool, allocating one only if the pool is empty.
+struct mailboxItem *takeMailboxItem(enum mailboxItemType type) {
+    // Only this reactor takes from returnedMailboxItems, and it takes the whole stack at once, so an item can
+    // never be taken and given back while another thread is looking at it.
+    if (localReactor->freeMailboxItems == NULL) { localReactor->freeMailboxItems = localReactor->returnedMailboxItems.exchange(NULL, memory_order_acquire); }
+
+    struct mailboxItem *item = localReactor->freeMailboxItems;
+    if (item != NULL) { localReactor->freeMailboxItems = item->next; }
+    else {
+        item = new mailboxItem();
+        item->owner = localReactor;
+    }
+    item->type = type;
+    return item;
+}
+
+// Gives a processed mailbox item back to the pool of the reactor it was taken from. May be called from any reactor.
+void returnMailboxItem(struct mailboxItem *item) {
+    // The payload is let go of now rather than when the item is next used. The room name keeps its storage.
+    item->payload.reset();
+    item->roomName.clear();
+
+    struct reactorThread *owner = item->owner;
+    if (owner == localReactor) {
+        item->next = owner->freeMailboxItems;
+        owner->freeMailboxItems = item;
+        return;
+    }
+    struct mailboxItem *head = owner->returnedMailboxItems.load(memory_order_relaxed);
+    do { item->next = head; } while (!owner->returnedMailboxItems.compare_exchange_weak(head, item, memory_order_release, memory_order_relaxed));
+}
+
+// Pushes <item> onto the mailbox of <reactor> and wakes it up if the mailbox was empty. May be called from
+// any thread. The mailbox takes ownership of the item.
+void postToReactor(struct reactorThread *reactor, struct mailboxItem *item) {
+    struct mailboxItem *head = reactor->mailboxHead.load(memory_order_relaxed);
+    do { item->next = head; } while (!reactor->mailboxHead.compare_exchange_weak(head, item, memory_order_release, memory_order_relaxed));
+
+    // Only the producer which finds the mailbox empty needs to wake the reactor. Anything pushed
+    // after that is picked up by the same drain.
+    if (head == NULL) {
+        uint64_t wakeups = 1;
+        if (write(reactor->wakeupFileDescriptor, &wakeups, sizeof wakeups) < 0) { logSystemError("WAKEUP failure"); }
+    }
+}
+
+// Takes every item out of the local reactor's mailbox and processes them in the order they were posted.
+void drainMailbox() {
+    // Reset the eventfd before taking the items, so a post made after the exchange wakes us again.
+    uint64_t wakeups;
+    while (read(localReactor->wakeupFileDescriptor, &wakeups, sizeof wakeups) > 0) {}
+
+    // The mailbox is a stack, so reverse it to get the items in the order they were posted.
+    struct mailboxItem *stack = localReactor->mailboxHead.exchange(NULL, memory_order_acquire);
+    struct mailboxItem *items = NULL;
+    while (stack != NULL) {
+        struct mailboxItem *next = stack->next;
+        stack->next = items;
+        items = stack;
+        stack = next;
+    }
+
+    while (items != NULL) {
+        struct mailboxItem *item = items;
+        items = item->next;
+
+        if (item->type == MAILBOX_ADOPT_CONNECTION) { adoptConnection(item->socketFd); }
+        else if (item->type == MAILBOX_BROADCAST) {
+            // Users who caught up on the history after the message was sent have already been sent it.
+            uint64_t fanoutStart = monotonicNanoseconds();
+            struct userRegistry *users = &localReactor->users;
+            for (size_t i = 0; i < users->receivingUsers.size(); i++) {
+                struct chatUser *receiver = &users->slots[users->receivingUsers[i]];
+                if (receiver->broadcastSequence <= item->sequence) { queueMessage(receiver->socketFd, item->payload); }
             }
+            recordLatency(&localReactor->metrics.fanoutLatency, monotonicNanoseconds() - fanoutStart);
+        }
+        else if (item->type == MAILBOX_PRIVATE_MESSAGE) {
+            struct chatUser *receiver = findUserByHandle(item->receiver);
+            if (receiver != NULL) { queueMessage(receiver->socketFd, item->payload); }
         }
+        else if (item->type == MAILBOX_ROOM_MESSAGE) { sendToLocalRoomMembers(item->roomName, item->payload, -1); }
+
+        returnMailboxItem(item);
     }
+}
 
-    // Make the sockets non-blocking.
-    int q = 1;
-    ioctl(configurations[SOCKET01].serverSocketDescriptor, FIONBIO, (char *)&q);
-    ioctl(configurations[SOCKET02].serverSocketDescriptor, FIONBIO, (char *)&q);
-    ioctl(configurations[SOCKET03].serverSocketDescriptor, FIONBIO, (char *)&q);
+/* ### io_uring functions ### */
+
+// Sets up an io_uring with RINGENTRIES submission queue entries and registers its buffer ring of receive buffers.
+// Returns NULL if the kernel lacks anything the io_uring backend needs.
+struct ioRing *createIoRing() {
+    // Completions are processed in task context only when the reactor enters the ring, which saves interrupting it.
+    struct io_uring_params parameters;
+    memset(&parameters, 0, sizeof parameters);
+    parameters.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    int ringFileDescriptor = syscall(__NR_io_uring_setup, RINGENTRIES, &parameters);
+    if (ringFileDescriptor < 0) { return NULL; }
+
+    struct ioRing *ring = new ioRing();
+    ring->ringFileDescriptor = ringFileDescriptor;
+    ring->ringMemory = MAP_FAILED;
+    ring->entryMemory = MAP_FAILED;
+    ring->bufferRing = (struct io_uring_buf_ring *)MAP_FAILED;
+
+    // Both queues must live in one mapping, completions must never be dropped when the completion queue is full,
+    // and waiting must take a timeout.
+    unsigned requiredFeatures = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((parameters.features & requiredFeatures) != requiredFeatures) {
+        destroyIoRing(ring);
+        return NULL;
+    }
+
+    ring->ringMemorySize = max(parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned), parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe));
+    ring->ringMemory = mmap(NULL, ring->ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFileDescriptor, IORING_OFF_SQ_RING);
+    ring->entryMemorySize = parameters.sq_entries * sizeof(struct io_uring_sqe);
+    ring->entryMemory = mmap(NULL, ring->entryMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFileDescriptor, IORING_OFF_SQES);
+    ring->bufferRingSize = RINGRECEIVEBUFFERS * sizeof(struct io_uring_buf);
+    ring->bufferRing = (struct io_uring_buf_ring *)mmap(NULL, ring->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->ringMemory == MAP_FAILED || ring->entryMemory == MAP_FAILED || ring->bufferRing == MAP_FAILED) {
+        destroyIoRing(ring);
+        return NULL;
+    }
+
+    char *ringMemory = (char *)ring->ringMemory;
+    ring->submissionHead = (unsigned *)(ringMemory + parameters.sq_off.head);
+    ring->submissionTailPointer = (unsigned *)(ringMemory + parameters.sq_off.tail);
+    ring->submissionMask = *(unsigned *)(ringMemory + parameters.sq_off.ring_mask);
+    ring->submissionEntries = parameters.sq_entries;
+    ring->submissionArray = (unsigned *)(ringMemory + parameters.sq_off.array);
+    ring->submissionQueueEntries = (struct io_uring_sqe *)ring->entryMemory;
+    ring->submissionTail = *ring->submissionTailPointer;
+    ring->completionHead = (unsigned *)(ringMemory + parameters.cq_off.head);
+    ring->completionTail = (unsigned *)(ringMemory + parameters.cq_off.tail);
+    ring->completionMask = *(unsigned *)(ringMemory + parameters.cq_off.ring_mask);
+    ring->completionQueueEntries = (struct io_uring_cqe *)(ringMemory + parameters.cq_off.cqes);
 
-    // Assign name to sockets by binding the addresses to them.
-    bind(configurations[SOCKET01].serverSocketDescriptor, (struct sockaddr *)&configurations[SOCKET01].serverSocketAddress, sizeof configurations[SOCKET01].serverSocketAddress);
-    bind(configurations[SOCKET02].serverSocketDescriptor, (struct sockaddr *)&configurations[SOCKET02].serverSocketAddress, sizeof configurations[SOCKET02].serverSocketAddress);
-    bind(configurations[SOCKET03].serverSocketDescriptor, (struct sockaddr *)&configurations[SOCKET03].serverSocketAddress, sizeof configurations[SOCKET03].serverSocketAddress);
+    // Provided buffer rings need Linux 5.19, and multishot recv into them 6.0.
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof registration);
+    registration.ring_addr = (uint64_t)ring->bufferRing;
+    registration.ring_entries = RINGRECEIVEBUFFERS;
+    registration.bgid = RINGBUFFERGROUP;
+    if (syscall(__NR_io_uring_register, ringFileDescriptor, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        destroyIoRing(ring);
+        return NULL;
+    }
 
-    // Mark the sockets as open for connections.
-    // The knock descriptors only need to listen to one client.
-    // The descriptor we will be using will receive up to 8 clients.
-    listen(configurations[SOCKET01].serverSocketDescriptor, 1);
-    listen(configurations[SOCKET02].serverSocketDescriptor, MAXCLIENTSALLOWED);
-    listen(configurations[SOCKET03].serverSocketDescriptor, 1);
+    ring->receiveBuffers = new char[(size_t)RINGRECEIVEBUFFERS * RINGRECEIVEBUFFERSIZE];
+    for (int i = 0; i < RINGRECEIVEBUFFERS; i++) { recycleReceiveBuffer(ring, i); }
+    return ring;
 }
 
-// This function is called when the same IP address has made the third knock. It reads its port attempt vector and
-// determines if the sequence is correct.
-bool checkPortSequence(vector<int> ports) {
-    // The sequence is portA -> portC -> portB.
-    return ports[SOCKET01] == portA && ports[SOCKET02] == portC && ports[SOCKET03] == portB;
+// Unmaps and closes what createIoRing set up of <ring> and frees it.
+void destroyIoRing(struct ioRing *ring) {
+    if (ring->ringMemory != MAP_FAILED) { munmap(ring->ringMemory, ring->ringMemorySize); }
+    if (ring->entryMemory != MAP_FAILED) { munmap(ring->entryMemory, ring->entryMemorySize); }
+    if (ring->bufferRing != MAP_FAILED) { munmap(ring->bufferRing, ring->bufferRingSize); }
+    close(ring->ringFileDescriptor);
+    delete[] ring->receiveBuffers;
+    delete ring;
+}
+
+// Returns a cleared submission queue entry of the local reactor's ring carrying <userData>. If the queue is full,
+// the entries in it are handed to the kernel first.
+struct io_uring_sqe *nextSubmission(uint64_t userData) {
+    struct ioRing *ring = localReactor->ring;
+    while (ring->submissionTail - __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE) == ring->submissionEntries) { enterRing(ring, 0); }
+
+    unsigned index = ring->submissionTail & ring->submissionMask;
+    struct io_uring_sqe *entry = &ring->submissionQueueEntries[index];
+    memset(entry, 0, sizeof *entry);
+    entry->user_data = userData;
+    ring->submissionArray[index] = index;
+    ring->submissionTail++;
+    return entry;
+}
+
+// Hands every entry written since the last call to the kernel. Then waits until a completion arrives or
+// <timeoutMilliseconds> have passed, forever if it is -1, unless it is 0.
+void enterRing(struct ioRing *ring, int timeoutMilliseconds) {
+    __atomic_store_n(ring->submissionTailPointer, ring->submissionTail, __ATOMIC_RELEASE);
+    unsigned pendingSubmissions = ring->submissionTail - __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeoutMilliseconds / 1000;
+    timeout.tv_nsec = (timeoutMilliseconds % 1000) * 1000000;
+    struct io_uring_getevents_arg waitArguments;
+    memset(&waitArguments, 0, sizeof waitArguments);
+    if (timeoutMilliseconds > 0) { waitArguments.ts = (uint64_t)&timeout; }
+
+    unsigned flags = 0, waitCount = 0;
+    if (timeoutMilliseconds != 0) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        waitCount = 1;
+    }
+    else if (pendingSubmissions == 0) { return; }
+
+    int result = syscall(__NR_io_uring_enter, ring->ringFileDescriptor, pendingSubmissions, waitCount, flags, &waitArguments, sizeof waitArguments);
+    countMetric(&localReactor->metrics.ringEnterCalls, 1);
+    if (result < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+        perror("IO_URING_ENTER error");
+        exit(1);
+    }
 }
 
-// Is used by checkAPI to split input strings from client thus: ABCDEFGH... A, B, CDEFGH...
-// Is useful to interpret the API commands, to e.g. separate the actual message from the MSG <USER> command.
-void splitString(vector<string> &inputCommands, string input) {
-    string tmp = "";
-    int counter = 0;
-    for (int i = 0; i < input.length(); i++) {
-        if (input[i] == ' ' && counter < 2) {
-            inputCommands.push_back(tmp);
-            tmp = "";
-            counter++;
+// Runs the server loop of <reactor> with its io_uring instead of epoll. See runReactor.
+void runRingReactor(struct reactorThread *reactor, struct serverConfiguration *configurations) {
+    struct ioRing *ring = reactor->ring;
+    for (int i = 0; configurations != NULL && i < PORTAMOUNT; i++) { armAccept(configurations, i); }
+    armWakeup();
+
+    while (true) {
+        // The accepts, recvs and sends are all in the ring, so one io_uring_enter hands the kernel everything
+        // the last batch submitted, among them a send for every connection it queued messages for, and waits
+        // for the next completions, no longer than until the reactor's next timer is due.
+        enterRing(ring, timerTimeoutMilliseconds());
+        advanceTimers(currentTimerTick());
+
+        // The completion is copied out and its entry returned to the kernel before it is handled.
+        unsigned head = *ring->completionHead;
+        while (head != __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe completion = ring->completionQueueEntries[head & ring->completionMask];
+            head++;
+            __atomic_store_n(ring->completionHead, head, __ATOMIC_RELEASE);
+            handleCompletion(&completion, configurations);
         }
-        else { tmp += input[i]; }
+
+        processPendingFlushes();
+        processPendingDisconnects();
     }
-    inputCommands.push_back(tmp);
 }
 
-// This is used when making sure that we do not create > 1 users with the same user name.
-// Also used to make sure that messages are not sent to non-existent users.
-bool userExists(string user) {
-    for (int i = 0; i < currentUsers.size(); i++) {
-        if (currentUsers[i].userName == user) { return true; }
+// Hands the completion to the function for its ringOperation.
+void handleCompletion(const struct io_uring_cqe *completion, struct serverConfiguration *configurations) {
+    uint32_t index = (uint32_t)completion->user_data;
+    switch (completion->user_data >> RINGOPERATIONSHIFT) {
+        case RING_ACCEPT: completeAccept(configurations, index, completion); break;
+        case RING_WAKEUP:
+            // Another reactor has posted work to our mailbox.
+            if (!(completion->flags & IORING_CQE_F_MORE)) { armWakeup(); }
+            drainMailbox();
+            break;
+        case RING_RECEIVE: completeReceive(index, completion); break;
+        case RING_SEND: completeSend(index, completion); break;
+    }
+}
+
+// Submits a multishot accept on the listening socket of configurations[<listenerIndex>].
+void armAccept(struct serverConfiguration *configurations, int listenerIndex) {
+    struct io_uring_sqe *entry = nextSubmission((uint64_t)RING_ACCEPT << RINGOPERATIONSHIFT | listenerIndex);
+    entry->opcode = IORING_OP_ACCEPT;
+    entry->fd = configurations[listenerIndex].serverSocketDescriptor;
+    entry->ioprio = IORING_ACCEPT_MULTISHOT;
+    entry->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+// Submits a multishot poll of the local reactor's wakeup eventfd.
+void armWakeup() {
+    struct io_uring_sqe *entry = nextSubmission((uint64_t)RING_WAKEUP << RINGOPERATIONSHIFT);
+    entry->opcode = IORING_OP_POLL_ADD;
+    entry->fd = localReactor->wakeupFileDescriptor;
+    entry->len = IORING_POLL_ADD_MULTI;
+    entry->poll32_events = POLLIN;
+}
+
+// Submits a multishot recv of the connection, which receives into the buffer ring.
+void armReceive(struct clientConnection *connection) {
+    uint32_t slotIndex = connection - localReactor->connectionSlots.data();
+    struct io_uring_sqe *entry = nextSubmission((uint64_t)RING_RECEIVE << RINGOPERATIONSHIFT | slotIndex);
+    entry->opcode = IORING_OP_RECV;
+    entry->fd = connection->socketFd;
+    entry->ioprio = IORING_RECV_MULTISHOT;
+    entry->flags = IOSQE_BUFFER_SELECT;
+    entry->buf_group = RINGBUFFERGROUP;
+    connection->receiveArmed = true;
+}
+
+// Submits a sendmsg of up to MAXIOVECSPERSEND messages from the front of the connection's outbound queue, unless
+// one is in flight already. It is handed to the kernel with the other submissions of the batch.
+void submitSend(struct clientConnection *connection) {
+    if (connection->sendInFlight || connection->outboundQueue.empty()) { return; }
+
+    if (connection->ringSend == NULL) { connection->ringSend.reset(new ringSend()); }
+    struct ringSend *send = connection->ringSend.get();
+    size_t vectorCount = gatherOutboundQueue(connection, send->messageVectors);
+    memset(&send->messageHeader, 0, sizeof send->messageHeader);
+    send->messageHeader.msg_iov = send->messageVectors;
+    send->messageHeader.msg_iovlen = vectorCount;
+
+    uint32_t slotIndex = connection - localReactor->connectionSlots.data();
+    struct io_uring_sqe *entry = nextSubmission((uint64_t)RING_SEND << RINGOPERATIONSHIFT | slotIndex);
+    entry->opcode = IORING_OP_SENDMSG;
+    entry->fd = connection->socketFd;
+    entry->addr = (uint64_t)&send->messageHeader;
+    entry->msg_flags = MSG_NOSIGNAL;
+    connection->sendInFlight = true;
+    connection->messagesInFlight = vectorCount;
+    countMetric(&localReactor->metrics.sendCalls, 1);
+}
+
+// Is called for every connection a multishot accept has accepted. Looks up the client's address, which the accept
+// does not report, and counts the knock.
+void completeAccept(struct serverConfiguration *configurations, int listenerIndex, const struct io_uring_cqe *completion) {
+    if (!(completion->flags & IORING_CQE_F_MORE)) { armAccept(configurations, listenerIndex); }
+    if (completion->res < 0) {
+        if (completion->res != -EINTR && completion->res != -ECONNABORTED && completion->res != -EAGAIN) {
+            char description[LARGEBUFFERSIZE];
+            logToConsole("ACCEPT failure: %s", strerror_r(-completion->res, description, sizeof description));
+        }
+        return;
+    }
+
+    struct sockaddr_storage connectingClientAddress;
+    socklen_t connectingClientAddressSize = sizeof connectingClientAddress;
+    if (getpeername(completion->res, (struct sockaddr *)&connectingClientAddress, &connectingClientAddressSize) < 0) {
+        close(completion->res);
+        return;
+    }
+    handleKnock(&configurations[listenerIndex], completion->res, &connectingClientAddress);
+}
+
+// Is called for every recv of the connection in <slotIndex>. Hands the data to processFrames and gives the buffer
+// back to the buffer ring. A closed or failed socket disconnects the user.
+void completeReceive(uint32_t slotIndex, const struct io_uring_cqe *completion) {
+    struct ioRing *ring = localReactor->ring;
+    struct clientConnection *connection = &localReactor->connectionSlots[slotIndex];
+    if (!(completion->flags & IORING_CQE_F_MORE)) { connection->receiveArmed = false; }
+    countMetric(&localReactor->metrics.receiveCalls, 1);
+
+    // The data is copied out of the buffer the kernel picked, so the buffer can be given back at once.
+    bool connected = !connection->closing;
+    if (completion->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bufferId = completion->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (connected && completion->res > 0) {
+            countMetric(&localReactor->metrics.bytesReceived, completion->res);
+            connected = receiveIntoConnection(connection, ring->receiveBuffers + (size_t)bufferId * RINGRECEIVEBUFFERSIZE, completion->res);
+        }
+        recycleReceiveBuffer(ring, bufferId);
+    }
+
+    // The connection has been closed, by a command or before this completion arrived.
+    if (connection->released) {
+        if (!connection->receiveArmed && !connection->sendInFlight) { freeConnectionSlot(slotIndex); }
+        return;
+    }
+    if (!connected) { return; }
+
+    // The client has closed his end of the connection without sending LEAVE, or the recv failed. A multishot recv
+    // also stops when the buffer ring has run out of buffers, in which case it is simply submitted again.
+    if (completion->res == 0 || (completion->res < 0 && completion->res != -ENOBUFS)) {
+        if (completion->res < 0) {
+            char description[LARGEBUFFERSIZE];
+            logToConsole("RECV failure: %s", strerror_r(-completion->res, description, sizeof description));
+        }
+        disconnectUser(connection->socketFd);
+        return;
+    }
+    if (!connection->receiveArmed) { armReceive(connection); }
+}
+
+// Is called when the sendmsg of the connection in <slotIndex> has completed. Pops what was sent and schedules
+// another flush if more messages have been queued in the meantime.
+void completeSend(uint32_t slotIndex, const struct io_uring_cqe *completion) {
+    struct clientConnection *connection = &localReactor->connectionSlots[slotIndex];
+    connection->sendInFlight = false;
+    connection->messagesInFlight = 0;
+
+    if (connection->released) {
+        if (!connection->receiveArmed) { freeConnectionSlot(slotIndex); }
+        return;
+    }
+    if (connection->closing) { return; }
+
+    if (completion->res < 0) {
+        if (completion->res != -EINTR && completion->res != -EAGAIN) {
+            char description[LARGEBUFFERSIZE];
+            logToConsole("server failure: failed to send message: %s", strerror_r(-completion->res, description, sizeof description));
+            scheduleDisconnect(connection);
+            return;
+        }
+    }
+    else { consumeSentBytes(connection, completion->res); }
+
+    // The rest of the queue goes out with the next batch, including whatever did not fit into the socket's send
+    // buffer, for which the kernel waits before it completes the next send.
+    if (!connection->outboundQueue.empty() && !connection->flushScheduled) {
+        connection->flushScheduled = true;
+        localReactor->pendingFlushes.push_back(connection->socketFd);
+    }
+}
+
+// Copies <length> received bytes into the connection's read buffer and processes the frames in it. Returns false
+// if the connection has been closed.
+bool receiveIntoConnection(struct clientConnection *connection, const char *data, size_t length) {
+    while (length > 0) {
+        size_t writableLength;
+        char *writableRegion = ringBufferWritableRegion(&connection->readBuffer, &writableLength);
+        if (writableLength == 0) {
+            // Cannot happen with well formed frames since the buffer can always hold one complete frame.
+            disconnectUser(connection->socketFd);
+            return false;
+        }
+
+        size_t copiedLength = min(writableLength, length);
+        memcpy(writableRegion, data, copiedLength);
+        connection->readBuffer.writeIndex += copiedLength;
+        data += copiedLength;
+        length -= copiedLength;
+        if (!processFrames(connection)) { return false; }
+    }
+    return true;
+}
+
+// Puts the receive buffer <bufferId> back into the local reactor's buffer ring.
+void recycleReceiveBuffer(struct ioRing *ring, unsigned short bufferId) {
+    // The ring is an array of io_uring_buf whose first entry holds the tail. Its bufs member cannot be used, as
+    // C++ gives the empty struct in front of it a size, which moves the array 8 bytes further.
+    struct io_uring_buf *buffer = &((struct io_uring_buf *)ring->bufferRing)[ring->bufferRingTail & (RINGRECEIVEBUFFERS - 1)];
+    buffer->addr = (uint64_t)(ring->receiveBuffers + (size_t)bufferId * RINGRECEIVEBUFFERSIZE);
+    buffer->len = RINGRECEIVEBUFFERSIZE;
+    buffer->bid = bufferId;
+    ring->bufferRingTail++;
+    __atomic_store_n(&ring->bufferRing->tail, ring->bufferRingTail, __ATOMIC_RELEASE);
+}
+
+/* ### Timer wheel functions ### */
+
+// Returns the current timer tick, counted in TIMERTICKMILLISECONDS from an arbitrary point in the past.
+uint64_t currentTimerTick() {
+    return monotonicNanoseconds() / (TIMERTICKMILLISECONDS * 1000000ULL);
+}
+
+// Returns the number of ticks in <seconds> seconds.
+uint64_t secondsToTicks(int seconds) {
+    return (uint64_t)seconds * 1000 / TIMERTICKMILLISECONDS;
+}
+
+// Empties the local reactor's timer wheel and sets it to the current tick.
+void initializeTimerWheel() {
+    struct timerWheel *wheel = &localReactor->timers;
+    for (int i = 0; i < TIMERWHEELLEVELS * TIMERWHEELSLOTS; i++) { wheel->slotHeads[i] = NOTIMER; }
+    wheel->currentTick = currentTimerTick();
+    wheel->armedCount = 0;
+}
+
+// Puts the timer into the slot its expiry tick belongs in, seen from the wheel's current tick.
+static void linkTimer(struct timerWheel *wheel, uint32_t timer) {
+    struct timerEntry *entry = &wheel->entries[timer];
+    const uint64_t wheelTicks = 1ULL << (TIMERWHEELBITS * TIMERWHEELLEVELS);
+    if (entry->expiryTick < wheel->currentTick) { entry->expiryTick = wheel->currentTick; }
+    if (entry->expiryTick - wheel->currentTick >= wheelTicks) { entry->expiryTick = wheel->currentTick + wheelTicks - 1; }
+
+    int level = 0;
+    while (level + 1 < TIMERWHEELLEVELS && entry->expiryTick - wheel->currentTick >= 1ULL << (TIMERWHEELBITS * (level + 1))) { level++; }
+    entry->wheelSlot = level * TIMERWHEELSLOTS + ((entry->expiryTick >> (TIMERWHEELBITS * level)) & (TIMERWHEELSLOTS - 1));
+
+    uint32_t *head = &wheel->slotHeads[entry->wheelSlot];
+    entry->previous = NOTIMER;
+    entry->next = *head;
+    if (*head != NOTIMER) { wheel->entries[*head].previous = timer; }
+    *head = timer;
+}
+
+// Takes the timer out of its slot's list.
+static void unlinkTimer(struct timerWheel *wheel, uint32_t timer) {
+    struct timerEntry *entry = &wheel->entries[timer];
+    if (entry->previous != NOTIMER) { wheel->entries[entry->previous].next = entry->next; }
+    else { wheel->slotHeads[entry->wheelSlot] = entry->next; }
+    if (entry->next != NOTIMER) { wheel->entries[entry->next].previous = entry->previous; }
+}
+
+// Returns a new, unarmed timer of the local reactor which will be handed to the function for <kind> with
+// <owner> when it fires.
+uint32_t createTimer(enum timerKind kind, uint32_t owner) {
+    struct timerWheel *wheel = &localReactor->timers;
+    uint32_t timer;
+    if (!wheel->freeEntries.empty()) {
+        timer = wheel->freeEntries.back();
+        wheel->freeEntries.pop_back();
+    }
+    else {
+        timer = wheel->entries.size();
+        wheel->entries.push_back(timerEntry());
+    }
+
+    struct timerEntry *entry = &wheel->entries[timer];
+    entry->armed = false;
+    entry->kind = kind;
+    entry->owner = owner;
+    return timer;
+}
+
+// Arms <timer> to fire at <expiryTick>, moving it if it is armed already. A tick which has passed fires it
+// on the next tick. Takes constant time.
+void scheduleTimer(uint32_t timer, uint64_t expiryTick) {
+    struct timerWheel *wheel = &localReactor->timers;
+    struct timerEntry *entry = &wheel->entries[timer];
+    if (entry->armed) { unlinkTimer(wheel, timer); }
+    else {
+        entry->armed = true;
+        wheel->armedCount++;
+    }
+    entry->expiryTick = expiryTick;
+    linkTimer(wheel, timer);
+}
+
+// Disarms <timer> if it is armed. Takes constant time.
+void cancelTimer(uint32_t timer) {
+    struct timerWheel *wheel = &localReactor->timers;
+    struct timerEntry *entry = &wheel->entries[timer];
+    if (!entry->armed) { return; }
+    unlinkTimer(wheel, timer);
+    entry->armed = false;
+    wheel->armedCount--;
+}
+
+// Processes every tick up to and including <tickNow>, moving timers down the levels of the wheel as it
+// reaches the start of their slots and firing the timers of each tick.
+void advanceTimers(uint64_t tickNow) {
+    struct timerWheel *wheel = &localReactor->timers;
+
+    // Without timers there is nothing to visit the ticks for, however many have passed.
+    if (wheel->armedCount == 0) {
+        wheel->currentTick = max(wheel->currentTick, tickNow + 1);
+        return;
+    }
+
+    while (wheel->currentTick <= tickNow) {
+        uint64_t tick = wheel->currentTick;
+
+        // Empty the slot of every level which starts at this tick into the levels below, the highest level
+        // first, since its timers may belong in a slot of the next level which starts at this tick as well.
+        int cascadeLevels = 0;
+        while (cascadeLevels + 1 < TIMERWHEELLEVELS && (tick & ((1ULL << (TIMERWHEELBITS * (cascadeLevels + 1))) - 1)) == 0) { cascadeLevels++; }
+        for (int level = cascadeLevels; level >= 1; level--) {
+            uint32_t *head = &wheel->slotHeads[level * TIMERWHEELSLOTS + ((tick >> (TIMERWHEELBITS * level)) & (TIMERWHEELSLOTS - 1))];
+            uint32_t timer = *head;
+            *head = NOTIMER;
+            while (timer != NOTIMER) {
+                uint32_t nextTimer = wheel->entries[timer].next;
+                linkTimer(wheel, timer);
+                timer = nextTimer;
+            }
+        }
+
+        // Fire the timers of this tick. Firing may schedule or cancel other timers, or this one again.
+        uint32_t *head = &wheel->slotHeads[tick & (TIMERWHEELSLOTS - 1)];
+        while (*head != NOTIMER) {
+            uint32_t timer = *head;
+            struct timerEntry *entry = &wheel->entries[timer];
+            unlinkTimer(wheel, timer);
+            entry->armed = false;
+            wheel->armedCount--;
+            fireTimer(entry->kind, entry->owner);
+        }
+        wheel->currentTick++;
+    }
+}
+
+// Returns true if the wheel moves a timer of a higher level down at <tick>. Whether the slots of the third and
+// higher levels hold a timer is not looked at, as they are only reached every TIMERWHEELSLOTS squared ticks.
+static bool timerCascadesAt(struct timerWheel *wheel, uint64_t tick) {
+    if ((tick & (TIMERWHEELSLOTS - 1)) != 0) { return false; }
+    if ((tick & (TIMERWHEELSLOTS * TIMERWHEELSLOTS - 1)) == 0) { return true; }
+    return wheel->slotHeads[TIMERWHEELSLOTS + ((tick >> TIMERWHEELBITS) & (TIMERWHEELSLOTS - 1))] != NOTIMER;
+}
+
+// Returns the milliseconds the server loop may wait before advanceTimers has something to do, or -1 if the
+// local reactor has no armed timers.
+int timerTimeoutMilliseconds() {
+    struct timerWheel *wheel = &localReactor->timers;
+    if (wheel->armedCount == 0) { return -1; }
+
+    // The first level holds the timers of the next TIMERWHEELSLOTS ticks. Past them, only the start of a
+    // slot of a higher level can be due.
+    uint64_t tick = wheel->currentTick;
+    uint64_t firstLevelEnd = tick + TIMERWHEELSLOTS;
+    while (tick < firstLevelEnd && wheel->slotHeads[tick & (TIMERWHEELSLOTS - 1)] == NOTIMER && !timerCascadesAt(wheel, tick)) { tick++; }
+    if (tick == firstLevelEnd) {
+        tick = (tick + TIMERWHEELSLOTS - 1) & ~(uint64_t)(TIMERWHEELSLOTS - 1);
+        while (!timerCascadesAt(wheel, tick)) { tick += TIMERWHEELSLOTS; }
+    }
+
+    int64_t nanosecondsLeft = (int64_t)(tick * TIMERTICKMILLISECONDS * 1000000ULL - monotonicNanoseconds());
+    if (nanosecondsLeft <= 0) { return 0; }
+    return (nanosecondsLeft + 999999) / 1000000;
+}
+
+// Hands a timer which has fired to the function for its kind.
+void fireTimer(enum timerKind kind, uint32_t owner) {
+    switch (kind) {
+        case TIMER_KEEPALIVE: checkKeepalive(owner); break;
+        case TIMER_KNOCKS: expireKnockStates(); break;
+    }
+}
+
+// Is called when the keepalive timer of the connection in <slotIndex> fires. Sends the connection PING once it
+// has been silent for pingInterval seconds, disconnects it once it has been silent for idleTimeout seconds and
+// schedules the timer again.
+void checkKeepalive(uint32_t slotIndex) {
+    struct clientConnection *connection = &localReactor->connectionSlots[slotIndex];
+    if (connection->closing) { return; }
+
+    // A client which has stopped answering, or whose host has gone away without closing the connection,
+    // would otherwise keep its descriptor and be sent every message to everyone for good.
+    uint64_t silentTicks = localReactor->timers.currentTick - connection->lastActivityTick;
+    if (idleTimeout > 0 && silentTicks >= secondsToTicks(idleTimeout)) {
+        countMetric(&localReactor->metrics.idleDisconnects, 1);
+        logToConsole("Disconnecting a client which has been silent for %d seconds.", idleTimeout);
+        scheduleDisconnect(connection);
+        return;
+    }
+
+    if (pingInterval > 0 && !connection->pingSent && silentTicks >= secondsToTicks(pingInterval)) {
+        static const sharedPayload ping = makeReply("PING");
+        queueMessage(connection->socketFd, ping);
+        connection->pingSent = true;
+        countMetric(&localReactor->metrics.pingsSent, 1);
+    }
+    scheduleKeepalive(connection);
+}
+
+// Schedules the connection's keepalive timer for the next time checkKeepalive may have something to do,
+// counting from the last time the client sent something.
+void scheduleKeepalive(struct clientConnection *connection) {
+    // The timer is not moved when the client sends something, as that would cost more than letting it fire
+    // and finding the client has not been silent after all.
+    uint64_t expiryTick;
+    if (pingInterval > 0 && !connection->pingSent) { expiryTick = connection->lastActivityTick + secondsToTicks(pingInterval); }
+    else if (idleTimeout > 0) { expiryTick = connection->lastActivityTick + secondsToTicks(idleTimeout); }
+    else if (pingInterval > 0) { expiryTick = localReactor->timers.currentTick + secondsToTicks(pingInterval); }
+    else { return; }
+    scheduleTimer(connection->keepaliveTimer, expiryTick);
+}
+
+/* ### Metrics functions ### */
+
+// Adds <amount> to a counter of the local reactor. Only the reactor owning the counter may call this.
+void countMetric(atomic<uint64_t> *counter, uint64_t amount) {
+    // Nobody else writes the counter, so it does not need a locked increment.
+    counter->store(counter->load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Adds <amount>, which may be negative, to a gauge of the local reactor. Only the reactor owning the gauge may
+// call this.
+void adjustMetric(atomic<int64_t> *gauge, int64_t amount) {
+    if (amount != 0) { gauge->store(gauge->load(memory_order_relaxed) + amount, memory_order_relaxed); }
+}
+
+// Adds a latency of <nanoseconds> to a histogram of the local reactor.
+void recordLatency(struct latencyHistogram *histogram, uint64_t nanoseconds) {
+    countMetric(&histogram->buckets[latencyBucket(nanoseconds)], 1);
+    countMetric(&histogram->totalNanoseconds, nanoseconds);
+}
+
+// Returns the index of the histogram bucket <nanoseconds> falls into. The leading bit of the latency picks the
+// power of two, and the LATENCYSUBBUCKETBITS bits following it pick the bucket within it.
+int latencyBucket(uint64_t nanoseconds) {
+    if (nanoseconds < (1ULL << MINLATENCYEXPONENT)) { return 0; }
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    if (exponent >= MAXLATENCYEXPONENT) { return LATENCYBUCKETS - 1; }
+    int subBucket = (nanoseconds >> (exponent - LATENCYSUBBUCKETBITS)) & ((1 << LATENCYSUBBUCKETBITS) - 1);
+    return 1 + ((exponent - MINLATENCYEXPONENT) << LATENCYSUBBUCKETBITS) + subBucket;
+}
+
+// Returns the smallest latency in nanoseconds which falls above the histogram bucket <bucket>. The last bucket has
+// no limit and must not be passed.
+uint64_t latencyBucketLimit(int bucket) {
+    if (bucket == 0) { return 1ULL << MINLATENCYEXPONENT; }
+    int exponent = MINLATENCYEXPONENT + ((bucket - 1) >> LATENCYSUBBUCKETBITS);
+    uint64_t subBucket = (bucket - 1) & ((1 << LATENCYSUBBUCKETBITS) - 1);
+    return ((1ULL << LATENCYSUBBUCKETBITS) + subBucket + 1) << (exponent - LATENCYSUBBUCKETBITS);
+}
+
+// Returns the time of the monotonic clock in nanoseconds.
+uint64_t monotonicNanoseconds() {
+    struct timespec timeNow;
+    clock_gettime(CLOCK_MONOTONIC, &timeNow);
+    return (uint64_t)timeNow.tv_sec * 1000000000ULL + timeNow.tv_nsec;
+}
+
+// Opens the metrics endpoint on the loopback address at metricsPort. Exits if the port cannot be bound. Only
+// local processes can reach it, as it is not protected by the knocking sequence.
+int openMetricsListener() {
+    int listeningSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    int q = 1;
+    setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &q, sizeof(q));
+
+    struct sockaddr_in metricsAddress;
+    memset(&metricsAddress, 0, sizeof metricsAddress);
+    metricsAddress.sin_family = AF_INET;
+    metricsAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    metricsAddress.sin_port = htons(metricsPort);
+    if (listeningSocket < 0 || bind(listeningSocket, (struct sockaddr *)&metricsAddress, sizeof metricsAddress) < 0 ||
+        listen(listeningSocket, SOMAXCONN) < 0) {
+        perror("METRICS failure");
+        exit(1);
+    }
+    cout << "Metrics are served on 127.0.0.1:" << metricsPort << endl;
+    return listeningSocket;
+}
+
+// Runs on its own thread. Answers every request made to the metrics endpoint with the metrics of all reactors, as
+// an HTTP response, so Prometheus and curl can read them. The path asked for does not matter. The reactors never
+// wait for the endpoint.
+void runMetricsServer(int listeningSocket) {
+    char request[XXLARGEBUFFERSIZE];
+    while (true) {
+        int clientSocket = accept4(listeningSocket, NULL, NULL, SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) { logSystemError("METRICS failure"); }
+            continue;
+        }
+
+        // Read the request up to its blank line, but do not let a silent client hold up the next one.
+        struct timeval timeout = {METRICSREQUESTTIMEOUTSECONDS, 0};
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        size_t requestLength = 0;
+        while (requestLength < sizeof request) {
+            ssize_t bytesReceived = recv(clientSocket, request + requestLength, sizeof request - requestLength, 0);
+            if (bytesReceived <= 0) { break; }
+            requestLength += bytesReceived;
+            if (string_view(request, requestLength).find("\r\n\r\n") != string_view::npos) { break; }
+        }
+
+        string body = renderMetrics();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+        response.append(to_string(body.length())).append("\r\n\r\n").append(body);
+        sendAll(clientSocket, response.data(), response.length());
+        close(clientSocket);
+    }
+}
+
+// Returns the metrics of all reactors in the Prometheus text format. Counters are added up over the reactors.
+string renderMetrics() {
+    static const char *verbNames[COMMANDVERBCOUNT] = {"UNKNOWN", "ID", "LEAVE", "WHO", "MSG", "CHANGE", "CONNECT", "RECV", "STATS", "JOIN", "PART", "HISTORY", "LOOKUP", "PONG"};
+
+    uint64_t knocks = 0, failedKnocks = 0, connectionsOpened = 0, connectionsClosed = 0, receiveCalls = 0, bytesReceived = 0;
+    uint64_t sendCalls = 0, bytesSent = 0, ringEnterCalls = 0, droppedMessages = 0, pingsSent = 0, idleDisconnects = 0, commandNanoseconds = 0, fanoutNanoseconds = 0;
+    int64_t queuedMessages = 0, queuedBytes = 0;
+    uint64_t commands[COMMANDVERBCOUNT] = {0};
+    uint64_t rateLimitedCommands[RATECLASSCOUNT] = {0};
+    uint64_t commandBuckets[LATENCYBUCKETS] = {0};
+    uint64_t fanoutBuckets[LATENCYBUCKETS] = {0};
+    for (size_t i = 0; i < reactors.size(); i++) {
+        struct reactorMetrics *metrics = &reactors[i]->metrics;
+        knocks += metrics->knocks.load(memory_order_relaxed);
+        failedKnocks += metrics->failedKnocks.load(memory_order_relaxed);
+        connectionsOpened += metrics->connectionsOpened.load(memory_order_relaxed);
+        connectionsClosed += metrics->connectionsClosed.load(memory_order_relaxed);
+        receiveCalls += metrics->receiveCalls.load(memory_order_relaxed);
+        bytesReceived += metrics->bytesReceived.load(memory_order_relaxed);
+        sendCalls += metrics->sendCalls.load(memory_order_relaxed);
+        bytesSent += metrics->bytesSent.load(memory_order_relaxed);
+        ringEnterCalls += metrics->ringEnterCalls.load(memory_order_relaxed);
+        queuedMessages += metrics->queuedMessages.load(memory_order_relaxed);
+        queuedBytes += metrics->queuedBytes.load(memory_order_relaxed);
+        droppedMessages += metrics->droppedMessages.load(memory_order_relaxed);
+        pingsSent += metrics->pingsSent.load(memory_order_relaxed);
+        idleDisconnects += metrics->idleDisconnects.load(memory_order_relaxed);
+        for (int j = 0; j < COMMANDVERBCOUNT; j++) { commands[j] += metrics->commands[j].load(memory_order_relaxed); }
+        for (int j = 0; j < RATECLASSCOUNT; j++) { rateLimitedCommands[j] += metrics->rateLimitedCommands[j].load(memory_order_relaxed); }
+        for (int j = 0; j < LATENCYBUCKETS; j++) {
+            commandBuckets[j] += metrics->commandLatency.buckets[j].load(memory_order_relaxed);
+            fanoutBuckets[j] += metrics->fanoutLatency.buckets[j].load(memory_order_relaxed);
+        }
+        commandNanoseconds += metrics->commandLatency.totalNanoseconds.load(memory_order_relaxed);
+        fanoutNanoseconds += metrics->fanoutLatency.totalNanoseconds.load(memory_order_relaxed);
+    }
+    size_t userCount;
+    {
+        lock_guard<mutex> listLock(connectedUsers.listMutex);
+        userCount = connectedUsers.names.size();
+    }
+
+    stringstream metrics;
+    metrics << "# HELP chat_knocks_total Connections made to the knocking ports.\n# TYPE chat_knocks_total counter\n";
+    metrics << "chat_knocks_total " << knocks << "\n";
+    metrics << "# HELP chat_failed_knocks_total Knocking sequences which were wrong or too slow.\n# TYPE chat_failed_knocks_total counter\n";
+    metrics << "chat_failed_knocks_total " << failedKnocks << "\n";
+    metrics << "# HELP chat_connections_opened_total Connections which passed the knocking sequence.\n# TYPE chat_connections_opened_total counter\n";
+    metrics << "chat_connections_opened_total " << connectionsOpened << "\n";
+    metrics << "# HELP chat_connections_closed_total Connections which were closed.\n# TYPE chat_connections_closed_total counter\n";
+    metrics << "chat_connections_closed_total " << connectionsClosed << "\n";
+    metrics << "# HELP chat_connections Open connections.\n# TYPE chat_connections gauge\n";
+    metrics << "chat_connections " << (int64_t)(connectionsOpened - connectionsClosed) << "\n";
+    metrics << "# HELP chat_users Logged in users.\n# TYPE chat_users gauge\n";
+    metrics << "chat_users " << userCount << "\n";
+    metrics << "# HELP chat_commands_total Commands received, by verb.\n# TYPE chat_commands_total counter\n";
+    for (int i = 0; i < COMMANDVERBCOUNT; i++) { metrics << "chat_commands_total{verb=\"" << verbNames[i] << "\"} " << commands[i] << "\n"; }
+    metrics << "# HELP chat_receive_calls_total Calls to recv on client connections.\n# TYPE chat_receive_calls_total counter\n";
+    metrics << "chat_receive_calls_total " << receiveCalls << "\n";
+    metrics << "# HELP chat_received_bytes_total Bytes received from clients.\n# TYPE chat_received_bytes_total counter\n";
+    metrics << "chat_received_bytes_total " << bytesReceived << "\n";
+    metrics << "# HELP chat_send_calls_total Calls to sendmsg on client connections.\n# TYPE chat_send_calls_total counter\n";
+    metrics << "chat_send_calls_total " << sendCalls << "\n";
+    metrics << "# HELP chat_sent_bytes_total Bytes sent to clients.\n# TYPE chat_sent_bytes_total counter\n";
+    metrics << "chat_sent_bytes_total " << bytesSent << "\n";
+    metrics << "# HELP chat_io_uring_enter_calls_total Calls to io_uring_enter, which submit recvs, sends and accepts and wait for them.\n# TYPE chat_io_uring_enter_calls_total counter\n";
+    metrics << "chat_io_uring_enter_calls_total " << ringEnterCalls << "\n";
+    metrics << "# HELP chat_queued_messages Messages waiting in outbound queues.\n# TYPE chat_queued_messages gauge\n";
+    metrics << "chat_queued_messages " << queuedMessages << "\n";
+    metrics << "# HELP chat_queued_bytes Bytes waiting in outbound queues.\n# TYPE chat_queued_bytes gauge\n";
+    metrics << "chat_queued_bytes " << queuedBytes << "\n";
+    metrics << "# HELP chat_dropped_messages_total Messages dropped from full outbound queues.\n# TYPE chat_dropped_messages_total counter\n";
+    metrics << "chat_dropped_messages_total " << droppedMessages << "\n";
+    metrics << "# HELP chat_pings_sent_total PINGs sent to connections which had been silent for the ping interval.\n# TYPE chat_pings_sent_total counter\n";
+    metrics << "chat_pings_sent_total " << pingsSent << "\n";
+    metrics << "# HELP chat_idle_disconnects_total Connections closed for being silent for the idle timeout.\n# TYPE chat_idle_disconnects_total counter\n";
+    metrics << "chat_idle_disconnects_total " << idleDisconnects << "\n";
+    metrics << "# HELP chat_rate_limited_commands_total Commands refused by the per-connection rate limits, by class.\n# TYPE chat_rate_limited_commands_total counter\n";
+    for (int i = 0; i < RATECLASSCOUNT; i++) { metrics << "chat_rate_limited_commands_total{class=\"" << rateClassNames[i] << "\"} " << rateLimitedCommands[i] << "\n"; }
+    metrics << "# HELP chat_suppressed_log_lines_total Console log lines dropped by the rate limit.\n# TYPE chat_suppressed_log_lines_total counter\n";
+    metrics << "chat_suppressed_log_lines_total " << countSuppressedConsoleLines() << "\n";
+    appendHistogram(metrics, "chat_command_duration_seconds", "Time spent handling a command, not counting sending the reply.", commandBuckets, commandNanoseconds);
+    appendHistogram(metrics, "chat_fanout_duration_seconds", "Time spent queueing a message to everyone or to a room for the receivers of one reactor.", fanoutBuckets, fanoutNanoseconds);
+    return metrics.str();
+}
+
+// Appends a histogram with the given bucket counts and total to <metrics> in the Prometheus text format, with its
+// limits in seconds.
+void appendHistogram(stringstream &metrics, const char *name, const char *help, const uint64_t *buckets, uint64_t totalNanoseconds) {
+    metrics << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+    uint64_t cumulativeCount = 0;
+    for (int i = 0; i < LATENCYBUCKETS - 1; i++) {
+        cumulativeCount += buckets[i];
+        metrics << name << "_bucket{le=\"" << latencyBucketLimit(i) / 1e9 << "\"} " << cumulativeCount << "\n";
+    }
+    cumulativeCount += buckets[LATENCYBUCKETS - 1];
+    metrics << name << "_bucket{le=\"+Inf\"} " << cumulativeCount << "\n";
+    metrics << name << "_sum " << totalNanoseconds / 1e9 << "\n";
+    metrics << name << "_count " << cumulativeCount << "\n";
+}
+
+/* ### Console log functions ### */
+
+// Formats a line like printf and hands it to the console log thread through the local reactor's console log ring.
+// Returns at once. Lines over CONSOLELOGLINESPERSECOND in a second are dropped and counted instead, so a flood of
+// knocks or failing connections cannot keep a reactor busy writing to the terminal. Threads other than the
+// reactors share the last ring and take turns at it.
+void logToConsole(const char *format, ...) {
+    unique_lock<mutex> consoleLock(consoleLogMutex, defer_lock);
+    struct consoleLogRing *ring = &consoleLogRings[MAXREACTORTHREADS];
+    if (localReactor != NULL) { ring = &consoleLogRings[localReactor->reactorIndex]; }
+    else { consoleLock.lock(); }
+
+    time_t timeNow = time(NULL);
+    if (timeNow != ring->lineSecond) {
+        ring->lineSecond = timeNow;
+        ring->linesThisSecond = 0;
+    }
+    if (ring->linesThisSecond == CONSOLELOGLINESPERSECOND) {
+        ring->suppressedLines.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    ring->linesThisSecond++;
+
+    char line[LARGEBUFFERSIZE];
+    va_list arguments;
+    va_start(arguments, format);
+    int lineLength = vsnprintf(line, sizeof line - 1, format, arguments);
+    va_end(arguments);
+    if (lineLength < 0) { return; }
+    size_t length = min((size_t)lineLength, sizeof line - 2);
+    line[length++] = '\n';
+
+    // Only this thread moves writeIndex; the console log thread only ever frees more space.
+    uint64_t writeIndex = ring->writeIndex.load(memory_order_relaxed);
+    if (writeIndex + length - ring->readIndex.load(memory_order_acquire) > CONSOLELOGRINGSIZE) {
+        ring->suppressedLines.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    size_t offset = writeIndex % CONSOLELOGRINGSIZE;
+    size_t firstPart = min(length, CONSOLELOGRINGSIZE - offset);
+    memcpy(ring->bytes + offset, line, firstPart);
+    memcpy(ring->bytes, line + firstPart, length - firstPart);
+    ring->writeIndex.store(writeIndex + length, memory_order_seq_cst);
+
+    // Pairs with the console log thread setting consoleLoggerWaiting before it looks at the rings a last time, so
+    // either it sees this line or this sees it waiting.
+    if (consoleLoggerWaiting.load(memory_order_seq_cst) && consoleLoggerWaiting.exchange(false)) {
+        uint64_t wakeup = 1;
+        if (write(consoleLogWakeupFileDescriptor, &wakeup, sizeof wakeup) == -1) { return; }
+    }
+}
+
+// Logs <message> followed by the description of errno, like perror.
+void logSystemError(const char *message) {
+    char description[LARGEBUFFERSIZE];
+    logToConsole("%s: %s", message, strerror_r(errno, description, sizeof description));
+}
+
+// Copies the lines waiting in <ring> to the end of <batch> and frees their space. Returns whether there were any.
+bool drainConsoleLogRing(struct consoleLogRing *ring, string &batch) {
+    uint64_t readIndex = ring->readIndex.load(memory_order_relaxed);
+    uint64_t writeIndex = ring->writeIndex.load(memory_order_seq_cst);
+    if (writeIndex == readIndex) { return false; }
+
+    size_t offset = readIndex % CONSOLELOGRINGSIZE;
+    size_t length = writeIndex - readIndex;
+    size_t firstPart = min(length, CONSOLELOGRINGSIZE - offset);
+    batch.append(ring->bytes + offset, firstPart).append(ring->bytes, length - firstPart);
+    ring->readIndex.store(writeIndex, memory_order_release);
+    return true;
+}
+
+// Returns the number of lines the console log has dropped in total.
+uint64_t countSuppressedConsoleLines() {
+    uint64_t suppressedLines = 0;
+    for (struct consoleLogRing &ring : consoleLogRings) {
+        suppressedLines += ring.suppressedLines.load(memory_order_relaxed);
+    }
+    return suppressedLines;
+}
+
+// Runs on its own thread. Prints the lines handed to logToConsole, a batch at a time, and reports how many lines
+// were dropped since the last batch. When every ring is empty it says it is waiting, looks at the rings once more
+// in case a line was logged meanwhile, and sleeps until a thread which logs a line wakes it.
+void runConsoleLogger() {
+    string batch;
+    uint64_t reportedSuppressedLines = 0;
+    while (true) {
+        bool waiting = false;
+        while (true) {
+            bool drained = false;
+            for (struct consoleLogRing &ring : consoleLogRings) {
+                drained |= drainConsoleLogRing(&ring, batch);
+            }
+            if (drained || waiting) { break; }
+            consoleLoggerWaiting.store(true, memory_order_seq_cst);
+            waiting = true;
+        }
+        if (batch.empty()) {
+            uint64_t wakeup;
+            if (read(consoleLogWakeupFileDescriptor, &wakeup, sizeof wakeup) == -1 && errno != EINTR) { return; }
+            continue;
+        }
+        consoleLoggerWaiting.store(false, memory_order_relaxed);
+
+        uint64_t suppressedLines = countSuppressedConsoleLines();
+        if (suppressedLines != reportedSuppressedLines) {
+            batch.append("(").append(to_string(suppressedLines - reportedSuppressedLines)).append(" lines not logged)\n");
+            reportedSuppressedLines = suppressedLines;
+        }
+        fwrite(batch.data(), 1, batch.length(), stdout);
+        fflush(stdout);
+        batch.clear();
     }
-    return false;
 }
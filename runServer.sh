@@ -1,5 +1,6 @@
 #!/bin/bash
-g++ chat_server.cpp -o chatserver
-g++ chat_client.cpp -o chatclient
+g++ -std=c++17 -O2 -pthread chat_server.cpp -o chatserver
+g++ -std=c++17 chat_client.cpp -o chatclient
+g++ -std=c++17 -O2 chat_bench.cpp -o chatbench
 echo "Done building and compiling client and server. Now running server.."
-./chatserver
+./chatserver "$@"